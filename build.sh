@@ -74,7 +74,7 @@ SYSTEM_DRIVER=system
 MEMORY_DRIVER=physical_memory_allocator
 SPECIAL_DRIVERS="$SYSTEM_DRIVER $MEMORY_DRIVER"
 
-DRIVERS="pi3gpu show_page riscos"
+DRIVERS="pi3gpu show_page riscos parallel_benchmark"
 #DRIVERS="test_vm"
 
 echo Building drivers: $DRIVERS
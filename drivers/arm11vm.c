@@ -93,6 +93,8 @@ static uint32_t __attribute__(( target("+crc") )) hardware_crc32( const uint8_t
 }
 
 #ifdef QEMU
+// Debug only: shows the registers every 2.5s. This driver isn't in build.sh's DRIVERS any more;
+// riscos.c replaced it, and does this sort of thing with timer callbacks (see call_every).
 static void qemu_timer_thread()
 {
   uint32_t *arm_code = (void *) ro_address.r;
@@ -1675,16 +1677,14 @@ void entry()
 
   if (image_is_valid()) {
     // Establish a translation table mapping the VM "physical" addresses to real memory
-    static const NUMBER tt_size = { .r = 4096 };
+    // Zeroed, so all entries are initially Aarch64_VMSA_invalid
+    static const NUMBER tt_size = { .r = 4096 | ALLOCATE_ZEROED };
     PHYSICAL_MEMORY_BLOCK el2_tt = SYSTEM__allocate_memory( system, tt_size );
     DRIVER_SYSTEM__map_at( driver_system(), el2_tt, el2_tt_address );
 
     vm_memory_base = PHYSICAL_MEMORY_BLOCK__physical_address( riscos_memory ).r;
 
     Aarch64_VMSA_entry *tt = (void*) el2_tt_address.r;
-    for (int i = 0; i < 512; i++) {
-      tt[i] = Aarch64_VMSA_invalid;
-    }
 
     for (int i = 0; i < 32; i++) {
       Aarch64_VMSA_entry entry = Aarch64_VMSA_block_at( vm_memory_base + (i << 21) );
@@ -31,11 +31,15 @@ asm ( ".section .init"
 #endif
 
 SYSTEM system = { .r = 0 }; // Initialised by _start code
+SERVICE_DIRECTORY service_directory_interface = { .r = 0 }; // See service_directory()
 
 integer_register __attribute__(( aligned( 16 ) )) stack[STACK_SIZE];
 
 const uint32_t badly_written_driver_exception = 0xbadc0de;
 
+// Shared by all the threads in the map, see CLAIM_LOCK
+uint64_t isambard_lock_spin_budget = ISAMBARD_LOCK_SPIN_INITIAL;
+
 #define GLOBAL_FUNCTION( name ) "\n.global " #name "\n.type " #name ", function\n" #name ":"
 
 #define SYSTEM_CALL( name, code )  \
@@ -48,6 +52,12 @@ asm ( ".section .text" \
     "\n.previous" );
 
 SYSTEM_CALL( gate_function, ISAMBARD_GATE );
+SYSTEM_CALL( wake_and_wait_function, ISAMBARD_WAKE_AND_WAIT );
+SYSTEM_CALL( signal_event, ISAMBARD_EVENT_SIGNAL );
+SYSTEM_CALL( broadcast_event, ISAMBARD_EVENT_BROADCAST );
+SYSTEM_CALL( wait_for_events, ISAMBARD_EVENT_WAIT );
+SYSTEM_CALL( futex_wait, ISAMBARD_FUTEX_WAIT );
+SYSTEM_CALL( futex_wake, ISAMBARD_FUTEX_WAKE );
 SYSTEM_CALL( interface_to_return, ISAMBARD_INTERFACE_TO_RETURN );
 SYSTEM_CALL( interface_to_pass_to, ISAMBARD_INTERFACE_TO_PASS );
 SYSTEM_CALL( duplicate_to_pass_to, ISAMBARD_DUPLICATE_TO_PASS );
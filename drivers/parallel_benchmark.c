@@ -0,0 +1,238 @@
+/* Copyright (c) 2021 Simon Willcocks */
+
+// Runs a CPU-bound loop in one thread per core, for a fixed time, to show
+// whether the secondary cores are really scheduling work.
+// The first row shows the iterations achieved by a single thread, the
+// following rows the total achieved with two, three and four cores busy.
+//
+// Then a thread on core 0 and one on core 1 wake each other repeatedly, showing
+// the average and maximum round trip, and the average and maximum latency of the
+// inter-processor interrupts received by core 1, all in nanoseconds.
+//
+// Then the same threads repeatedly claim one lock for a short critical section,
+// showing the total claims achieved with one to four cores contending for it, and
+// the adaptive spin budget (in timer ticks) that resulted.
+//
+// Finally, the ping-pong is repeated while every core is busy with a CPU-bound
+// loop that never yields, showing the average and maximum round trip of the high
+// priority ping and pong threads under that load.
+// Below that is the maximum time the pong thread waited to run after being woken,
+// over both rounds, in nanoseconds.
+
+#include "drivers.h"
+#include "exclusive.h"
+
+ISAMBARD_INTERFACE( TRIVIAL_NUMERIC_DISPLAY )
+#include "interfaces/client/TRIVIAL_NUMERIC_DISPLAY.h"
+#define N( n ) NUMBER__from_integer_register( n )
+
+#define BENCHMARK_CORES 4
+#define WINDOW_MS 500
+
+static uint32_t cores = 0;
+static uint32_t volatile run_number = 0;
+static uint32_t volatile active_workers = 0;
+static uint64_t volatile deadline = 0;
+
+static uint64_t volatile iterations[BENCHMARK_CORES];
+static bool volatile contend_for_lock = false;
+static uint64_t contended_lock = 0;
+static uint64_t volatile protected_counter = 0;
+static uint32_t volatile finished[BENCHMARK_CORES];
+
+static inline uint64_t now()
+{
+  uint64_t result;
+  asm volatile ( "mrs %[d], CNTPCT_EL0" : [d] "=r" (result) );
+  return result;
+}
+
+static void worker( uint32_t number )
+{
+  uint32_t my_run = 0;
+
+  for (;;) {
+    while (run_number == my_run) {
+      futex_wait( &run_number, my_run, 0 );
+    }
+    my_run = run_number;
+
+    uint64_t count = 0;
+    if (number < active_workers && contend_for_lock) {
+      uint64_t end = deadline;
+      while (now() < end) {
+        claim_lock( &contended_lock );
+        for (int i = 0; i < 100; i++) { asm volatile ( "" ); }
+        protected_counter++;
+        release_lock( &contended_lock );
+        count++;
+      }
+    }
+    else if (number < active_workers) {
+      uint64_t end = deadline;
+      while (now() < end) {
+        for (int i = 0; i < 1000; i++) { asm volatile ( "" ); }
+        count++;
+      }
+    }
+    iterations[number] = count;
+    memory_write_barrier();
+    finished[number] = my_run;
+  }
+}
+
+static void worker0() { worker( 0 ); }
+static void worker1() { worker( 1 ); }
+static void worker2() { worker( 2 ); }
+static void worker3() { worker( 3 ); }
+
+static uint64_t run( uint32_t workers )
+{
+  uint32_t frequency;
+  asm ( "mrs %[freq], CNTFRQ_EL0" : [freq] "=r" (frequency) );
+
+  active_workers = workers;
+  deadline = now() + (frequency / 1000) * WINDOW_MS;
+  memory_write_barrier();
+  run_number = run_number + 1;
+  futex_wake( &run_number, 0 );
+
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < cores; i++) {
+    while (finished[i] != run_number) {
+      sleep_ms( 10 );
+    }
+    memory_read_barrier();
+    total += iterations[i];
+  }
+  return total;
+}
+
+#define PING_PONGS 1000
+
+static uint32_t volatile pinger = 0;
+static uint32_t volatile ponger = 0;
+// Round 1 with the cores idle, round 2 with them busy
+static uint32_t volatile ping_pong_round = 0;
+static uint32_t volatile ping_pong_finished = 0;
+static uint64_t volatile round_trip_total[2] = { 0 };
+static uint64_t volatile round_trip_max[2] = { 0 };
+
+static void pong()
+{
+  set_priority( THREAD_PRIORITY_HIGHEST );
+  ponger = this_thread;
+  futex_wake( &ponger, 0 );
+  wait_until_woken();
+  for (;;) {
+    wake_and_wait( pinger );
+  }
+}
+
+static void ping()
+{
+  set_priority( THREAD_PRIORITY_HIGHEST );
+  pinger = this_thread;
+  while (ponger == 0) {
+    futex_wait( &ponger, 0, 0 );
+  }
+
+  for (uint32_t round = 1; round <= 2; round++) {
+    uint32_t current;
+    while ((current = ping_pong_round) != round) {
+      futex_wait( &ping_pong_round, current, 0 );
+    }
+    if (round == 2) {
+      sleep_ms( WINDOW_MS / 10 ); // Let the workers get going
+    }
+
+    for (int i = 0; i < PING_PONGS; i++) {
+      uint64_t start = now();
+      wake_and_wait( ponger );
+      uint64_t round_trip = now() - start;
+      round_trip_total[round - 1] += round_trip;
+      if (round_trip > round_trip_max[round - 1]) round_trip_max[round - 1] = round_trip;
+    }
+
+    ping_pong_finished = round;
+    futex_wake( &ping_pong_finished, 0 );
+  }
+
+  for (;;) {
+    wait_until_woken();
+  }
+}
+
+static inline uint64_t nanoseconds( uint64_t ticks )
+{
+  uint64_t frequency;
+  asm ( "mrs %[freq], CNTFRQ_EL0" : [freq] "=r" (frequency) );
+  return (ticks * 1000) / (frequency / 1000000);
+}
+
+void entry()
+{
+  TRIVIAL_NUMERIC_DISPLAY tnd = TRIVIAL_NUMERIC_DISPLAY__get_service( "Trivial Numeric Display", -1 );
+
+  static void (*const workers[BENCHMARK_CORES])() = { worker0, worker1, worker2, worker3 };
+  static uint64_t __attribute__(( aligned( 16 ) )) stacks[BENCHMARK_CORES][32];
+
+  while (cores < BENCHMARK_CORES && 0 != create_thread_on_core( cores, workers[cores], stacks[cores] + 32 )) {
+    cores++;
+  }
+
+  for (uint32_t n = 1; n <= cores; n++) {
+    uint64_t total = run( n );
+    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1600 ), N( 400 + 10 * n ), N( n ), N( 0xffffffff ) );
+    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1700 ), N( 400 + 10 * n ), N( total ), N( 0xff80ff80 ) );
+  }
+
+  if (cores < 2) return;
+
+  static uint64_t __attribute__(( aligned( 16 ) )) ping_stack[32];
+  static uint64_t __attribute__(( aligned( 16 ) )) pong_stack[32];
+  create_thread_on_core( 1, pong, pong_stack + 32 );
+  create_thread_on_core( 0, ping, ping_stack + 32 );
+
+  ping_pong_round = 1;
+  futex_wake( &ping_pong_round, 0 );
+  uint32_t finished_round;
+  while ((finished_round = ping_pong_finished) != 1) {
+    futex_wait( &ping_pong_finished, finished_round, 0 );
+  }
+
+  NUMBER ipis = DRIVER_SYSTEM__get_ipi_statistic( driver_system(), N( 1 ), N( 0 ) );
+  NUMBER ipi_total = DRIVER_SYSTEM__get_ipi_statistic( driver_system(), N( 1 ), N( 1 ) );
+  NUMBER ipi_max = DRIVER_SYSTEM__get_ipi_statistic( driver_system(), N( 1 ), N( 2 ) );
+
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1600 ), N( 460 ), N( nanoseconds( round_trip_total[0] / PING_PONGS ) ), N( 0xffffffff ) );
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1700 ), N( 460 ), N( nanoseconds( round_trip_max[0] ) ), N( 0xffffffff ) );
+  if (ipis.r != 0) {
+    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1600 ), N( 470 ), N( nanoseconds( ipi_total.r / ipis.r ) ), N( 0xff80ff80 ) );
+  }
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1700 ), N( 470 ), N( nanoseconds( ipi_max.r ) ), N( 0xff80ff80 ) );
+
+  contend_for_lock = true;
+  for (uint32_t n = 1; n <= cores; n++) {
+    uint64_t before = protected_counter;
+    uint64_t total = run( n );
+    // Red, if the lock failed to protect the counter
+    uint32_t colour = (protected_counter - before == total) ? 0xff80ff80 : 0xffff0000;
+    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1600 ), N( 480 + 10 * n ), N( n ), N( 0xffffffff ) );
+    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1700 ), N( 480 + 10 * n ), N( total ), N( colour ) );
+  }
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1700 ), N( 530 ), N( isambard_lock_spin_budget ), N( 0xffffffff ) );
+
+  contend_for_lock = false;
+  ping_pong_round = 2;
+  futex_wake( &ping_pong_round, 0 );
+  run( cores );
+  while ((finished_round = ping_pong_finished) != 2) {
+    futex_wait( &ping_pong_finished, finished_round, 0 );
+  }
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1600 ), N( 540 ), N( nanoseconds( round_trip_total[1] / PING_PONGS ) ), N( 0xffffffff ) );
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1700 ), N( 540 ), N( nanoseconds( round_trip_max[1] ) ), N( 0xffffffff ) );
+
+  NUMBER wake_max = DRIVER_SYSTEM__get_wake_latency( driver_system(), N( ponger ), N( 8 ) );
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 1700 ), N( 550 ), N( nanoseconds( wake_max.r ) ), N( 0xff80ff80 ) );
+}
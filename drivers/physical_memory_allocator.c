@@ -2,7 +2,9 @@
 
 #define STACK_SIZE 128
 
+#ifndef BEING_TESTED
 #include "drivers.h"
+#endif
 
 // The Memory Manager driver is the only code in the system that can access all memory.
 // It runs in 1 4k page of code, plus 1 4k page of data.
@@ -23,17 +25,24 @@ typedef struct chunk {
 static chunk * freed_chunks = 0;
 static chunk * available_chunks = 0;
 
+#ifndef BEING_TESTED
 void inter_map_exception( const char *string )
 {
   for (;;) { asm ( "svc 4\n\tsvc 2" : : "r" (string) ); }
 }
+#else
+// Tests provide their own
+void inter_map_exception( const char *string );
+#endif
 
 void release_free_chunk( chunk *p )
 {
   chunk **list = &available_chunks;
+  chunk **prev_ref = 0;
   chunk *prev = 0;
 
   while (*list != 0 && (*list) < p) {
+    prev_ref = list;
     prev = *list;
     list = &prev->next;
   }
@@ -42,13 +51,29 @@ void release_free_chunk( chunk *p )
     inter_map_exception( "Corrupt physical memory structure, double free?" );
   }
 
-  if ((char *)p - (char*) prev == (1 << prev->log2size)           // p starts after prev
-   && prev->log2size == p->log2size                               // same size
-   && ((((integer_register)prev) & (1u << (1 + p->log2size))) == 0)) {    // alignment matches
-    // FIXME:
-    // Merge chunks if prev + (1 << prev->log2size) == p
-    // AND if prev is on an even boundary (i.e. the combined chunk would be
-    // on a valid boundary - e.g. combine chunks 2 & 3, not 3 & 4)
+  integer_register size = (1ull << p->log2size);
+
+  // Merge chunks with their buddies, if they're free, e.g. combine chunks 2 & 3, not 3 & 4.
+  // The combined chunk is released again, in case it can be merged with its own buddy.
+  if (prev != 0
+   && (integer_register) p - (integer_register) prev == size        // p starts after prev
+   && prev->log2size == p->log2size                             // same size
+   && ((((integer_register)prev) & size) == 0)) {               // alignment matches
+    *prev_ref = prev->next;
+    prev->log2size++;
+    release_free_chunk( prev );
+    return;
+  }
+
+  chunk *next = *list;
+  if (next != 0
+   && (integer_register) next - (integer_register) p == size        // next starts after p
+   && next->log2size == p->log2size                             // same size
+   && ((((integer_register)p) & size) == 0)) {                  // alignment matches
+    *list = next->next;
+    p->log2size++;
+    release_free_chunk( p );
+    return;
   }
 
   p->next = *list;
@@ -72,7 +97,11 @@ void make_list_of_freed_chunks( uint64_t p, uint64_t end )
 
   // This occurs before anything can request memory
 
+#ifndef BEING_TESTED
 #define assert( x ) if (!(x)) { asm ( "brk 1" ); }
+#else
+#define assert( x ) if (!(x)) { inter_map_exception( "assert" ); }
+#endif
 #define initialise_block( min, max, next_action ) \
         blocks( min, max, \
         { \
@@ -148,7 +177,7 @@ integer_register allocate( uint32_t size )
           p->log2size = log2size;
           remainder -= (1u << log2size);
           if (remainder != 0) {
-            chunk *new_chunk = (chunk*) (c + (1u << log2size));
+            chunk *new_chunk = (chunk*) (((uint8_t*) p) + (1u << log2size));
             new_chunk->next = p->next;
             p->next = new_chunk;
             p = new_chunk;
@@ -161,7 +190,111 @@ integer_register allocate( uint32_t size )
   return result;
 }
 
-integer_register entry( uint64_t zero, uint64_t call, uint64_t p1, uint64_t p2 )
+void free_block( uint64_t p, uint64_t size )
+{
+  // Blocks are returned as the largest naturally aligned chunks that fit, which
+  // will merge with their free neighbours.
+  uint64_t end = p + size;
+
+  while (p < end) {
+    int log2size = 12;
+    while (log2size < 34
+        && 0 == (p & ((2ull << log2size) - 1))
+        && p + (2ull << log2size) <= end) {
+      log2size++;
+    }
+    chunk *c = (void*) p;
+    c->log2size = log2size;
+    c->next = 0;
+    release_free_chunk( c );
+    p += (1ull << log2size);
+  }
+}
+
+// Free chunks are naturally aligned, as are the ranges used for compaction, so a
+// chunk is either entirely inside the range, or entirely outside it (or it
+// contains the whole range, in which case compaction wasn't needed).
+uint64_t free_bytes_in_range( uint64_t start, uint64_t end )
+{
+  uint64_t result = 0;
+  for (chunk *p = available_chunks; p != 0 && (uint64_t) p < end; p = p->next) {
+    if ((uint64_t) p >= start) {
+      result += (1ull << p->log2size);
+    }
+  }
+  return result;
+}
+
+void claim_range( uint64_t start, uint64_t end )
+{
+  // Remove all free chunks in the range from the list; the caller now owns them
+  chunk **list = &available_chunks;
+  while (*list != 0 && (uint64_t) *list < end) {
+    if ((uint64_t) *list >= start) {
+      *list = (*list)->next;
+    }
+    else {
+      list = &(*list)->next;
+    }
+  }
+}
+
+void clean_and_invalidate( uint64_t p, uint64_t size )
+{
+  // This driver's view of memory is uncached, but other maps' views of it may
+  // not be; write back and discard any lines for the memory.
+#ifndef BEING_TESTED
+  uint64_t ctr;
+  asm volatile ( "mrs %[c], CTR_EL0" : [c] "=r" (ctr) );
+  uint64_t line_size = 4 << ((ctr >> 16) & 0xf);
+
+  for (uint64_t va = p; va < p + size; va += line_size) {
+    asm volatile ( "dc civac, %[va]" : : [va] "r" (va) );
+  }
+  asm volatile ( "dsb sy" );
+#else
+  p = p; size = size;
+#endif
+}
+
+void copy_block( uint64_t dest, uint64_t src, uint64_t size )
+{
+  clean_and_invalidate( src, size );
+  clean_and_invalidate( dest, size );
+
+  uint64_t *d = (void*) dest;
+  uint64_t *s = (void*) src;
+  for (uint64_t i = 0; i < size / sizeof( uint64_t ); i++) {
+    d[i] = s[i];
+  }
+}
+
+void zero_block( uint64_t p, uint64_t size )
+{
+  // The zeros go straight to RAM, but the previous owner may have left lines
+  // in the caches; they must not be written back later, or read by the next owner.
+#ifdef BEING_TESTED
+  for (uint64_t *w = (void*) p; w < (uint64_t*) (p + size); w++) { *w = 0; }
+#else
+  uint64_t dczid;
+  asm volatile ( "mrs %[d], DCZID_EL0" : [d] "=r" (dczid) );
+  if (0 != (dczid & 0x10)) {
+    inter_map_exception( "DC ZVA prohibited" );
+  }
+  uint64_t block_size = 4 << (dczid & 0xf);
+
+  uint64_t end = p + size;
+
+  clean_and_invalidate( p, size );
+
+  for (uint64_t va = p; va < end; va += block_size) {
+    asm volatile ( "dc zva, %[va]" : : [va] "r" (va) : "memory" );
+  }
+  asm volatile ( "dsb sy" );
+#endif
+}
+
+integer_register entry( uint64_t zero, uint64_t call, uint64_t p1, uint64_t p2, uint64_t p3 )
 {
   zero = zero; // There is only one "object" in this driver
   switch (call) {
@@ -171,8 +304,36 @@ integer_register entry( uint64_t zero, uint64_t call, uint64_t p1, uint64_t p2 )
     return 0;
   case 1: // Allocate block
     return allocate( (p1 + 4095) & ~0xfff );
+  case 2: // Free block (address, size), sizes are in whole pages
+    if (0 != (p1 & 0xfff) || 0 != (p2 & 0xfff)) {
+      inter_map_exception( "Freeing partial pages" );
+    }
+    // The previous owner's dirty lines mustn't be written back over the free lists
+    clean_and_invalidate( p1, p2 );
+    free_block( p1, p2 );
+    return 0;
+  case 3: // Zero block (address, size), sizes are in whole pages
+    if (0 != (p1 & 0xfff) || 0 != (p2 & 0xfff)) {
+      inter_map_exception( "Zeroing partial pages" );
+    }
+    zero_block( p1, p2 );
+    return 0;
+  case 4: // Free bytes in range (start, end)
+    return free_bytes_in_range( p1, p2 );
+  case 5: // Claim all free memory in range (start, end)
+    claim_range( p1, p2 );
+    return 0;
+  case 6: // Copy block (destination, source), size in x3
+    if (0 != (p1 & 0xfff) || 0 != (p2 & 0xfff) || 0 != (p3 & 0xfff)) {
+      inter_map_exception( "Copying partial pages" );
+    }
+    copy_block( p1, p2, p3 );
+    return 0;
   }
+#ifndef BEING_TESTED
   asm ( "brk 1" );
+#else
+  inter_map_exception( "Unknown call" );
+#endif
   return 0;
 }
-
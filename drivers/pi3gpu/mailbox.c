@@ -21,68 +21,90 @@
 
 #include "devices.h"
 #include "exclusive.h"
+#include "queues.h"
 
 ISAMBARD_INTERFACE( GPU_MAILBOX_MANAGER )
 ISAMBARD_INTERFACE( GPU_MAILBOX )
 ISAMBARD_INTERFACE( GPU_MAILBOX_CLIENT )
+ISAMBARD_INTERFACE( WORK )
+ISAMBARD_INTERFACE( WORK_QUEUE )
+#include "interfaces/client/WORK_QUEUE.h"
+#include "interfaces/client/WORK.h"
 
 #define assert( c ) if (!(c)) { asm ( "brk 7" ); }
 
 typedef struct mailbox_channel mailbox_channel;
 typedef struct mailbox_channel *MBOX;
 
+// Filled by the interrupt handler, emptied by the message pump
+DEFINE_SPSC_QUEUE( mailbox_messages, uint32_t, 8 )
+
 struct mailbox_channel {
-  uint64_t lock; // Protects access to waiting_thread, client.
-  uint32_t waiting_thread;
-  uint32_t received_message;
+  uint64_t lock; // Protects access to client.
+  mailbox_messages_queue received;
   GPU_MAILBOX_CLIENT client;
 };
 
 struct mailbox_channel channels[16] = {};
 
-static uint32_t blocking_message = 0;
+// A message whose channel's queue was full; mailbox interrupts are disabled until the
+// pump has made room for it, and delivered it to the queue.
+static uint32_t volatile blocking_message = 0;
 static uint64_t blocked_sending_thread = 0;
 
+// The message pump is work queued by the interrupt handler, at most once at a time
+static WORK_QUEUE interrupt_work_queue = {};
+static WORK pump = {};
+static bool volatile pump_queued = false;
+
+// If the queue is full, the messages wait for the next interrupt to queue the pump
+static void queue_pump()
+{
+  if (!pump_queued) {
+    pump_queued = true;
+    NUMBER queued = WORK_QUEUE__try_queue( interrupt_work_queue, NUMBER__from_integer_register( pump.r ), NUMBER__from_integer_register( WORK__perform__METHOD ), NUMBER__from_integer_register( 0 ) );
+    if (queued.r == 0) {
+      pump_queued = false;
+    }
+  }
+}
+
 void mailbox_interrupt()
 {
   uint32_t mailbox0_pending = devices.mailbox[0].config;
 
   if ((mailbox0_pending & 0x10) != 0) { // Not empty
     if (blocking_message != 0) {
-      int channel = blocking_message & 0xf;
-      if (channels[channel].received_message == 0) {
-        channels[channel].received_message = blocking_message & ~0xf;
-        blocking_message = 0;
-        wake_thread( channels[channel].waiting_thread );
-      }
-      else {
-        asm ( "brk 4" ); // How?
-      }
-    }
-    while (0 == (devices.mailbox[0].status & 0x40000000)) { // Not empty
-      uint32_t message = devices.mailbox[0].value; // Could peek, but using blocking_message is probably faster, and allows the GPU to insert one more message into the mailbox
-
-      int channel = message & 0xf;
-      if (channels[channel].waiting_thread == 0) {
-        // Message on unclaimed channel, discard
-        asm ( "brk 8" );
-        continue;
-      }
-      if (channels[channel].received_message == 0) {
-        channels[channel].received_message = message & ~0xf;
-        wake_thread( channels[channel].waiting_thread );
-      }
-      else {
-        // Channel client hasn't dealt with previous message yet. Blocked.
-        // TODO Keep an eye on how often this happens; maybe implement a fifo for each channel in software.
-        blocking_message = message;
-        break;
-      }
-    }
-    // Emptying the fifo removes the interrupt, if not every message can be delivered yet, pause the interrupts
-    if (0 != blocking_message) {
+      // Still blocked (queue_message enables the interrupts regardless); only the pump
+      // delivers the blocked message, once there's room for it.
       memory_write_barrier(); // About to write to devices.mailbox
       devices.mailbox[0].config = 0; // No interrupts, we're blocked
+      queue_pump();
+    }
+    else {
+      while (0 == (devices.mailbox[0].status & 0x40000000)) { // Not empty
+        uint32_t message = devices.mailbox[0].value; // Could peek, but using blocking_message is probably faster, and allows the GPU to insert one more message into the mailbox
+
+        int channel = message & 0xf;
+        if (channels[channel].client.r == 0) {
+          // Message on unclaimed channel, discard
+          asm ( "brk 8" );
+          continue;
+        }
+        if (mailbox_messages_try_push( &channels[channel].received, message & ~0xf )) {
+          queue_pump();
+        }
+        else {
+          // Channel client hasn't dealt with the previous messages yet. Blocked.
+          // Emptying the fifo removes the interrupt, if not every message can be delivered
+          // yet, pause the interrupts (before the pump can see the message).
+          memory_write_barrier(); // About to write to devices.mailbox
+          devices.mailbox[0].config = 0; // No interrupts, we're blocked
+          dsb();
+          blocking_message = message;
+          break;
+        }
+      }
     }
   }
   memory_read_barrier(); // Completed our reads of devices.mailbox
@@ -109,8 +131,23 @@ ISAMBARD_PROVIDER( MBOX, AS_GPU_MAILBOX( MBOX ) )
 // Using the driver initialisation stack
 ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( MBOX, RETURN_FUNCTIONS_GPU_MAILBOX( MBOX ), mailbox_stack_lock, mailbox_stack, 64 * 8 )
 
+// Delivers the received messages to the channel clients
+typedef NUMBER PUMP;
+
+integer_register pump_lock = 0;
+ISAMBARD_STACK( pump_stack, 64 );
+
+#include "interfaces/provider/WORK.h"
+
+ISAMBARD_WORK__SERVER( PUMP )
+ISAMBARD_PROVIDER( PUMP, AS_WORK( PUMP ) )
+ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( PUMP, RETURN_FUNCTIONS_WORK( PUMP ), pump_lock, pump_stack, 64 * 8 )
+
 void expose_gpu_mailbox()
 {
+  interrupt_work_queue = WORK_QUEUE__get_service( "Interrupt Work Queue", -1 );
+  pump = PUMP__WORK__to_pass_to( system.r, 0 );
+
   MANAGER__GPU_MAILBOX_MANAGER__register_service( "Pi GPU Mailboxes", 0 );
 }
 
@@ -121,30 +158,40 @@ void MANAGER__GPU_MAILBOX_MANAGER__claim_channel( MANAGER o, NUMBER channel )
   MANAGER__GPU_MAILBOX_MANAGER__claim_channel__return( MBOX__GPU_MAILBOX__to_return( (void*) &channels[channel.r] ) );
 }
 
-// Should we have one of these per channel with a registered client?
-void __attribute__(( noreturn )) message_pump()
+void PUMP__WORK__perform( PUMP o, NUMBER argument )
 {
-  int last_channel = 0;
-  for (;;) {
-    int messages = wait_until_woken() + 1;
-    for (int j = 0; j < messages; j++) {
-      for (int i = 0; i < 17; i++) {
-        int c = (last_channel+i) % 16;
-        if (channels[c].waiting_thread == this_thread
-         && channels[c].received_message != 0) {
-          NUMBER message = { .r = channels[c].received_message };
-          channels[c].received_message = 0;
-          GPU_MAILBOX_CLIENT__incoming_message( channels[c].client, message );
-          last_channel = c;
-          if (blocking_message != 0) {
-            memory_write_barrier(); // About to write to devices.mailbox
-            devices.mailbox[0].config = 1; // Interrupt on not empty
-          }
-          break;
+  o = o; argument = argument;
+
+  // Messages arriving from now on need another pass
+  pump_queued = false;
+  dsb();
+
+  // One message from each channel in turn, until they're all empty
+  bool delivered;
+  do {
+    delivered = false;
+    for (int c = 0; c < 16; c++) {
+      uint32_t received;
+      if (channels[c].client.r != 0
+       && mailbox_messages_try_pop( &channels[c].received, &received )) {
+        NUMBER message = { .r = received };
+        GPU_MAILBOX_CLIENT__incoming_message( channels[c].client, message );
+        delivered = true;
+        // The interrupt handler is paused while a message is blocked; only this channel's
+        // queue has room for it. The FIFO may be empty, so there may be no interrupt to
+        // deliver it: it's delivered here, then the interrupts resumed.
+        uint32_t blocked = blocking_message;
+        if (blocked != 0 && (blocked & 0xf) == (uint32_t) c
+         && mailbox_messages_try_push( &channels[c].received, blocked & ~0xf )) {
+          blocking_message = 0;
+          memory_write_barrier(); // About to write to devices.mailbox
+          devices.mailbox[0].config = 1; // Interrupt on not empty
         }
       }
     }
-  }
+  } while (delivered);
+
+  PUMP__WORK__perform__return();
 }
 
 void MBOX__GPU_MAILBOX__register_client( MBOX channel, GPU_MAILBOX_CLIENT client )
@@ -156,23 +203,8 @@ void MBOX__GPU_MAILBOX__register_client( MBOX channel, GPU_MAILBOX_CLIENT client
     MBOX__exception( name_code( "Channel already has a client" ).r );
   }
 
-  if (channel->waiting_thread != 0) {
-    release_lock( &channel->lock );
-    MBOX__exception( name_code( "Channel is already waiting for a response" ).r );
-  }
-
   channel->client = client;
 
-  static uint32_t pump_thread = 0;
-  if (pump_thread == 0) {
-    static struct {
-      uint64_t s[32];
-    } pump_thread_stack;
-    pump_thread = create_thread( message_pump, (void*) ((&pump_thread_stack)+1) );
-  }
-
-  channel->waiting_thread = pump_thread;
-
   release_lock( &channel->lock );
 
   MBOX__GPU_MAILBOX__register_client__return();
@@ -197,7 +229,7 @@ void MBOX__GPU_MAILBOX__queue_message( MBOX channel, NUMBER message )
 
   blocked_sending_thread = 0;
   dsb();
-  wake_thread( this_thread ); wait_until_woken(); // clear gate FIXME: lame.
+  wake_and_wait( this_thread ); // clear gate
 
   memory_write_barrier(); // About to write to devices.mailbox
   devices.mailbox[1].value = message.r | (channel - channels);
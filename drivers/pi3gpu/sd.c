@@ -671,6 +671,9 @@ extern PHYSICAL_MEMORY_BLOCK test_memory;
 
 uint32_t initialisation_thread = -1;
 
+// Debug only, and not started (see expose_emmc). Besides showing the page every 20ms, it
+// wakes initialisation_thread once the display is set up; if it's revived, the loop should
+// become a timer callback (DRIVER_SYSTEM add_timer_callback), rather than a thread.
 void show_page_thread()
 {
   mapped_memory[0] = 0;
@@ -728,12 +731,12 @@ void __attribute__(( noreturn )) ping_thread()
   pit = this_thread;
   yield();
   if (pot == 0) asm ( "brk 3" );
+  wait_until_woken();
   for (;;) {
     local++;
-    wait_until_woken();
     ping++;
     pingpong--;
-    wake_thread( pot );
+    wake_and_wait( pot );
   }
 }
 
@@ -745,14 +748,13 @@ void __attribute__(( noreturn )) pong_thread()
   yield();
   if (pit == 0) asm ( "brk 3" );
   // Kick it off!
-  wake_thread( pit );
+  wake_and_wait( pit );
   for (;;) {
     local++;
-    wait_until_woken();
     yield();
     pong++;
     pingpong++;
-    wake_thread( pit );
+    wake_and_wait( pit );
   }
 }
 
@@ -10,6 +10,9 @@
 
 ISAMBARD_INTERFACE( BLOCK_DEVICE )
 #include "interfaces/client/BLOCK_DEVICE.h"
+ISAMBARD_INTERFACE( TICKER )
+#include "interfaces/client/TICKER.h"
+#include "interfaces/provider/TICKER.h"
 
 static const NUMBER el2_tt_address = { .r = 0x80000 };
 static const NUMBER ro_address = { .r = 0x8000000 };
@@ -1317,40 +1320,68 @@ void map_page( uint64_t physical, void *virtual )
   DRIVER_SYSTEM__map_at( driver_system(), device_page, NUMBER__from_integer_register( (integer_register) virtual ) );
 }
 
-static bool volatile noisy_ticker_thread_running = false;
+// Periodic work, done by the system driver's timer workers; the object is the routine
+typedef union { integer_register r; void (*routine)(); } Ticker;
 
-static void noisy_ticker_thread()
+ISAMBARD_TICKER__SERVER( Ticker )
+ISAMBARD_PROVIDER( Ticker, AS_TICKER( Ticker ) )
+
+static uint64_t ticker_lock = 0;
+ISAMBARD_STACK( ticker_stack, 64 );
+ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( Ticker, RETURN_FUNCTIONS_TICKER( Ticker ), ticker_lock, ticker_stack, 64 * 8 )
+
+void Ticker__TICKER__tick( Ticker o )
+{
+  o.routine();
+  Ticker__TICKER__tick__return();
+}
+
+// vm_interrupt_tick waits for the virtual machine to stop running, so it has a lock and stack
+// of its own, rather than holding up the other callbacks on ticker_lock.
+typedef union { integer_register r; } VmTicker;
+
+ISAMBARD_TICKER__SERVER( VmTicker )
+ISAMBARD_PROVIDER( VmTicker, AS_TICKER( VmTicker ) )
+
+static uint64_t vm_ticker_lock = 0;
+ISAMBARD_STACK( vm_ticker_stack, 64 );
+ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( VmTicker, RETURN_FUNCTIONS_TICKER( VmTicker ), vm_ticker_lock, vm_ticker_stack, 64 * 8 )
+
+static void vm_interrupt_tick();
+
+void VmTicker__TICKER__tick( VmTicker o )
+{
+  o = o;
+  vm_interrupt_tick();
+  VmTicker__TICKER__tick__return();
+}
+
+static void call_every( TICKER ticker, uint32_t first_ms, uint32_t period_ms )
+{
+  DRIVER_SYSTEM__add_timer_callback( driver_system(), N( ticker.r ), N( TICKER__tick__METHOD ), N( first_ms * 1000 ), N( period_ms * 1000 ) );
+}
+
+static void noisy_tick()
 {
   static uint32_t ticks = 0;
   uint32_t *ram = (void*) (ro_address.r + 0x400000);
-  noisy_ticker_thread_running = true;
-  for (;;) {
-    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 10 ), N( 200 ), N( ++ticks ), N( 0xff0000ff ) );
-    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 10 ), N( 210 ), N( *ram ), N( 0xff0000ff ) ); // Word at 0x400000 in VM memory, there's no cache in NS EL1 yet.
-    asm ( "svc 0" ); // To update the screen on real hardware
-    sleep_ms( 1000 );
-  }
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 10 ), N( 200 ), N( ++ticks ), N( 0xff0000ff ) );
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 10 ), N( 210 ), N( *ram ), N( 0xff0000ff ) ); // Word at 0x400000 in VM memory, there's no cache in NS EL1 yet.
+  asm ( "svc 0" ); // To update the screen on real hardware
 }
 
-static bool volatile ticker_thread_running = false;
-
-static void ticker_thread()
+// Raise an interrupt on the virtual machine every so often.
+static void vm_interrupt_tick()
 {
-  ticker_thread_running = true;
-    sleep_ms( 100 );
   static uint32_t ticks = 0;
-  // Raise an interrupt on the virtual machine every so often.
-  for (;;) {
-    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 10 ), N( 160 ), N( ++ticks ), N( 0xffff8080 ) );
-    sleep_ms( 2000 ); // FIXME only good for qemu
-    TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 10 ), N( 170 ), N( ticks ), N( 0xffff0000 ) );
-    claim_lock( &vm_lock );     // This will work only as long as this is the same core as the VM
-    // (Otherwise the virtual machine might still be running, and we'll only get the lock when it
-    // voluntarily exits (or there's an interrupt on that core. FIXME
-    uint64_t hcr2 = change_vm_system_register( vm_thread, HCR_EL2, (1ull << 7), ~(1ull << 7) );
-    release_lock( &vm_lock );
-    TRIVIAL_NUMERIC_DISPLAY__show_64bits( tnd, N( 10 ), N( 180 ), N( hcr2 ), N( 0xffff0000 ) );
-  }
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 10 ), N( 170 ), N( ticks ), N( 0xffff0000 ) );
+  // The timer workers run on the core that registered the callback, the VM's. If the virtual
+  // machine is still running, this waits until it exits or is interrupted. FIXME
+  claim_lock( &vm_lock );
+  uint64_t hcr2 = change_vm_system_register( vm_thread, HCR_EL2, (1ull << 7), ~(1ull << 7) );
+  release_lock( &vm_lock );
+  TRIVIAL_NUMERIC_DISPLAY__show_64bits( tnd, N( 10 ), N( 180 ), N( hcr2 ), N( 0xffff0000 ) );
+  TRIVIAL_NUMERIC_DISPLAY__show_32bits( tnd, N( 10 ), N( 160 ), N( ++ticks ), N( 0xffff8080 ) );
 }
 
 void entry()
@@ -1373,16 +1404,14 @@ void entry()
 
   if (image_is_valid()) {
     // Establish a translation table mapping the VM "physical" addresses to real memory
-    static const NUMBER tt_size = { .r = 4096 };
+    // Zeroed, so all entries are initially Aarch64_VMSA_invalid
+    static const NUMBER tt_size = { .r = 4096 | ALLOCATE_ZEROED };
     PHYSICAL_MEMORY_BLOCK el2_tt = SYSTEM__allocate_memory( system, tt_size );
     DRIVER_SYSTEM__map_at( driver_system(), el2_tt, el2_tt_address );
 
     vm_memory_base = PHYSICAL_MEMORY_BLOCK__physical_address( riscos_memory ).r;
 
     Aarch64_VMSA_entry *tt = (void*) el2_tt_address.r;
-    for (int i = 0; i < 512; i++) {
-      tt[i] = Aarch64_VMSA_invalid;
-    }
 
     for (int i = 0; i < 32; i++) {
       Aarch64_VMSA_entry entry = Aarch64_VMSA_block_at( vm_memory_base + (i << 21) );
@@ -1443,21 +1472,10 @@ void entry()
 
     vm_thread = this_thread;
 
-    {
-      // Testing virtual interrupts, generate one every so often and check it
-      // behaves as expected.
-      static uint64_t __attribute__(( aligned( 16 ) )) stack[64];
-      create_thread( ticker_thread, stack + 32 );
-      while (ticker_thread_running == 0) { yield(); }
-    }
-
-    {
-      // Testing virtual interrupts, generate one every so often and check it
-      // behaves as expected.
-      static uint64_t __attribute__(( aligned( 16 ) )) stack[64];
-      create_thread( noisy_ticker_thread, stack + 32 );
-      while (noisy_ticker_thread_running == 0) { yield(); }
-    }
+    // Testing virtual interrupts, generate one every so often and check it
+    // behaves as expected.
+    call_every( VmTicker__TICKER__to_pass_to( system.r, 0 ), 2100, 2000 ); // FIXME only good for qemu
+    call_every( Ticker__TICKER__to_pass_to( system.r, noisy_tick ), 0, 1000 );
 
     for (;;) {
       claim_lock( &vm_lock );
@@ -31,6 +31,9 @@ asm ( ".section .init"
 
 #include "drivers.h"
 #include "atomic.h"
+#include "exclusive.h"
+#include "epoch.h"
+#include "queues.h"
 #include "system_services.h"
 #include "aarch64_vmsa.h"
 
@@ -50,12 +53,24 @@ asm ( ".section .text"
 // MapValue implements both of these interfaces
 #include "interfaces/provider/SYSTEM.h"
 #include "interfaces/provider/DRIVER_SYSTEM.h"
+// DmaPool implements this interface
+ISAMBARD_INTERFACE( DMA_MEMORY )
+#include "interfaces/provider/DMA_MEMORY.h"
+// MemoryAccounts implements this interface
+ISAMBARD_INTERFACE( MEMORY_ACCOUNTS )
+#include "interfaces/provider/MEMORY_ACCOUNTS.h"
+// WorkQueue and InterruptWorkQueue implement this interface
+ISAMBARD_INTERFACE( WORK_QUEUE )
+#include "interfaces/provider/WORK_QUEUE.h"
+// ServiceDirectory implements this interface
+#include "interfaces/provider/SERVICE_DIRECTORY.h"
 
 uint64_t __attribute__(( aligned( 16 ) )) map_stack[64];
 uint64_t map_lock = 0;
 
 static integer_register allocatable_memory_base = 0;
 static integer_register allocatable_memory_top = 0;
+static integer_register allocator_memory_top = 0; // Memory given to the allocator so far
 
 ISAMBARD_PHYSICAL_MEMORY_BLOCK__SERVER( ContiguousMemoryBlock )
 ISAMBARD_PROVIDER( ContiguousMemoryBlock, AS_PHYSICAL_MEMORY_BLOCK( ContiguousMemoryBlock ) )
@@ -66,6 +81,52 @@ ISAMBARD_DRIVER_SYSTEM__SERVER( MapValue )
 ISAMBARD_PROVIDER( MapValue, AS_DRIVER_SYSTEM( MapValue ); AS_SYSTEM( MapValue ) )
 ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( MapValue, RETURN_FUNCTIONS_DRIVER_SYSTEM( MapValue ) RETURN_FUNCTIONS_SYSTEM( MapValue ), map_lock, map_stack, 64 * 8 )
 
+typedef struct { integer_register r; } DmaPool; // Only one pool, object is the map using it
+
+ISAMBARD_DMA_MEMORY__SERVER( DmaPool )
+ISAMBARD_PROVIDER( DmaPool, AS_DMA_MEMORY( DmaPool ) )
+ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( DmaPool, RETURN_FUNCTIONS_DMA_MEMORY( DmaPool ), map_lock, map_stack, 64 * 8 )
+
+typedef struct { integer_register r; } MemoryAccounts; // Object is the map using it
+
+ISAMBARD_MEMORY_ACCOUNTS__SERVER( MemoryAccounts )
+ISAMBARD_PROVIDER( MemoryAccounts, AS_MEMORY_ACCOUNTS( MemoryAccounts ) )
+ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( MemoryAccounts, RETURN_FUNCTIONS_MEMORY_ACCOUNTS( MemoryAccounts ), map_lock, map_stack, 64 * 8 )
+
+typedef struct { integer_register r; } WorkQueue;
+
+ISAMBARD_WORK_QUEUE__SERVER( WorkQueue )
+ISAMBARD_PROVIDER( WorkQueue, AS_WORK_QUEUE( WorkQueue ) )
+ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( WorkQueue, RETURN_FUNCTIONS_WORK_QUEUE( WorkQueue ), map_lock, map_stack, 64 * 8 )
+
+// The same queue, for interrupt handlers, which mustn't wait for map_lock. Only a core's
+// interrupt thread may use it, and nothing else runs on that core until it's finished,
+// so it needs no lock, just a stack per core: the start of this_core. Calls from any
+// other thread are refused before the stack is touched (see this_core_interrupt_thread).
+#define INTERRUPT_WORK_STACK_SIZE (32 * 8)
+
+typedef struct { integer_register r; } InterruptWorkQueue;
+
+ISAMBARD_WORK_QUEUE__SERVER( InterruptWorkQueue )
+ISAMBARD_PROVIDER( InterruptWorkQueue, AS_WORK_QUEUE( InterruptWorkQueue ) )
+ISAMBARD_PROVIDER_NO_LOCK_AND_SINGLE_STACK_FOR_THREAD( InterruptWorkQueue, RETURN_FUNCTIONS_WORK_QUEUE( InterruptWorkQueue ), this_core_interrupt_thread, this_core, INTERRUPT_WORK_STACK_SIZE )
+
+// Each map's service directory has its own lock and stack, so lookups don't wait for
+// map_lock, and different maps' lookups run at the same time. The object is the address
+// of the directory.
+#define LOG2_DIRECTORY_SIZE 9
+
+typedef struct {
+  uint64_t lock; // Claimed by the veneer
+  uint64_t stack[(1 << LOG2_DIRECTORY_SIZE) / 8 - 1];
+} __attribute__(( aligned( 1 << LOG2_DIRECTORY_SIZE ) )) service_directory_storage;
+
+typedef struct { integer_register r; } ServiceDirectory;
+
+ISAMBARD_SERVICE_DIRECTORY__SERVER( ServiceDirectory )
+ISAMBARD_PROVIDER( ServiceDirectory, AS_SERVICE_DIRECTORY( ServiceDirectory ) )
+ISAMBARD_PROVIDER_PER_OBJECT_LOCK_AND_STACK( ServiceDirectory, RETURN_FUNCTIONS_SERVICE_DIRECTORY( ServiceDirectory ), LOG2_DIRECTORY_SIZE )
+
 static volatile bool board_initialised = false;
 
 void thread_exit()
@@ -76,22 +137,68 @@ void thread_exit()
 }
 
 #define INT_STACK_SIZE 64
+#define MAX_CORES 4 // Pi 3
+
+// Threads per core making DRIVER_SYSTEM add_timer_callback calls; more than one, so
+// that a callback that blocks doesn't hold up the others due on its core.
+#define TIMER_WORKERS_PER_CORE 2
+#define TIMER_WORKER_STACK_SIZE 64
 
 static uint32_t ticks_per_millisecond = 0;
 
+// Per-core caches of free blocks of the most commonly requested sizes. Blocks
+// are taken from the memory allocator in batches (pre-split from a single,
+// larger, block) and returned to it in batches, when a magazine overflows.
+#define MAGAZINE_CAPACITY 32
+
+typedef struct {
+  uint32_t log2size;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t batch;
+  integer_register block[MAGAZINE_CAPACITY];
+} magazine;
+
+enum { SMALL_PAGES, LARGE_PAGES, NUMBER_OF_MAGAZINES };
+
+// Pages zeroed by the idle thread, ready for ALLOCATE_ZEROED requests
+#define ZEROED_POOL_SIZE 16
+
 extern struct {
+  uint64_t __attribute__(( aligned( 16 ) )) interrupt_work_stack[INTERRUPT_WORK_STACK_SIZE / 8]; // First, see InterruptWorkQueue
+  uint64_t interrupt_thread; // Straight after it, see this_core_interrupt_thread
   uint64_t number;
-  uint64_t last_cval;
   uint64_t interrupts_count;
   uint64_t unidentified_interrupts_count;
+  magazine magazines[NUMBER_OF_MAGAZINES];
+  uint64_t zeroed_count;
+  integer_register zeroed_pages[ZEROED_POOL_SIZE];
   uint64_t __attribute__(( aligned( 16 ) )) interrupt_handler_stack[INT_STACK_SIZE];
+  uint64_t __attribute__(( aligned( 16 ) )) timer_worker_stacks[TIMER_WORKERS_PER_CORE][TIMER_WORKER_STACK_SIZE];
   // The rest is idle thread stack
 } this_core; // Core-specific information
 
+// this_core.interrupt_thread, for the InterruptWorkQueue veneer, which can't use offsetof
+asm ( ".set this_core_interrupt_thread, this_core + " ENSTRING( INTERRUPT_WORK_STACK_SIZE ) );
+_Static_assert( __builtin_offsetof( typeof( this_core ), interrupt_thread ) == INTERRUPT_WORK_STACK_SIZE, "See this_core_interrupt_thread" );
+
 Object memory_manager = 0;
 
 extern integer_register make_special_request( enum Isambard_Special_Request request, ... );
 
+// For locks held by threads that can be preempted, or lower priority than their waiters;
+// the waiters block in the kernel (which lends them to the owner) instead of spinning
+// like atomic.h's claim_lock. Zero is an unclaimed lock.
+static void claim_thread_lock( uint64_t *lock )
+{
+  asm volatile ( "\n\tmov x17, %[lock]" CLAIM_LOCK : : [lock] "r" (lock) : "x13", "x14", "x15", "x16", "x17", "memory" );
+}
+
+static void release_thread_lock( uint64_t *lock )
+{
+  asm volatile ( "\n\tmov x17, %[lock]" RELEASE_LOCK : : [lock] "r" (lock) : "x16", "x17", "memory" );
+}
+
 #define MAX_VMBS 64
 
 static uint64_t vmb_lock = 0;
@@ -103,21 +210,57 @@ struct service {
   NUMBER name_crc;
 };
 
+// Looked up far more often than registered, by any number of maps' service directories
+// at once; registrations (under map_lock) wait for them.
+static rwlock services_lock = { 0 };
 static struct service services[50] = { 0 };
 static int free_service = 0;
 
-static uint64_t ms_ticks = 0;
+static uint64_t ms_timer_start = 0; // CNTPCT_EL0 when the millisecond count started
 
 /* System (Pi 3) specific code */
+// Read by the interrupt thread of every core, changed (under map_lock) by drivers
+static seqlock interrupt_handlers_sequence = 0;
 static INTERRUPT_HANDLER interrupt_handlers[12] = { { .r = 0 } };
 
-void board_remove_interrupt_handler( INTERRUPT_HANDLER handler, unsigned interrupt )
+// A removed handler may still be being called on another core; its interface is only
+// released once every interrupt thread has left board_call_interrupt_handlers since the
+// removal. Removal never waits for that (the interrupt handlers may be waiting for
+// map_lock), a second removal for the same interrupt before then is refused.
+static epoch_domain interrupt_handlers_epoch = { 0 };
+static struct retired_handler {
+  epoch_retired retired; // First
+  INTERRUPT_HANDLER volatile handler;
+} retired_handlers[12] = { { { 0 }, { .r = 0 } } };
+
+static void release_interrupt_handler( epoch_retired *item )
+{
+  struct retired_handler *r = (struct retired_handler *) item;
+  make_special_request( Isambard_System_Service_Release_Interface, r->handler.r );
+  r->handler.r = 0;
+}
+
+// Returns false if the last handler removed for the interrupt hasn't been released yet
+bool board_remove_interrupt_handler( INTERRUPT_HANDLER handler, unsigned interrupt )
 {
-  if (interrupt_handlers[interrupt].r != handler.r) {
+  if (interrupt >= 12 || interrupt_handlers[interrupt].r != handler.r) {
     for (;;) { asm volatile ( "svc 1\n\tbrk 3" ); }
   }
+
+  if (retired_handlers[interrupt].handler.r != 0) {
+    epoch_poll( &interrupt_handlers_epoch );
+    if (retired_handlers[interrupt].handler.r != 0) {
+      return false;
+    }
+  }
+
+  write_seqbegin( &interrupt_handlers_sequence );
   interrupt_handlers[interrupt].r = 0;
-  // FIXME release handler object
+  write_seqend( &interrupt_handlers_sequence );
+
+  retired_handlers[interrupt].handler = handler;
+  epoch_retire( &interrupt_handlers_epoch, &retired_handlers[interrupt].retired, release_interrupt_handler );
+  return true;
 }
 
 void board_register_interrupt_handler( INTERRUPT_HANDLER handler, unsigned interrupt )
@@ -130,7 +273,9 @@ void board_register_interrupt_handler( INTERRUPT_HANDLER handler, unsigned inter
     // Already claimed
     for (;;) { asm volatile ( "svc 1\n\tbrk 4" ); }
   }
+  write_seqbegin( &interrupt_handlers_sequence );
   interrupt_handlers[interrupt] = handler;
+  write_seqend( &interrupt_handlers_sequence );
   // TODO Fix the caller map to a particular core
   // In other boards, it would be reasonable to enable the relevant interrupt at this point
 }
@@ -199,31 +344,30 @@ interrupts_handled[0]+= 0x100000;
 
   memory_read_barrier(); // Completed our reads of device_pages.QA7
 
-  if (0 != (sources & 2)) { // Timer interrupt
-#ifdef QEMU
-    asm ( "mrs %[d], CNTPCT_EL0" : [d] "=r" (this_core.last_cval) );
-    this_core.last_cval += 10 * ticks_per_millisecond;
-#else
-    this_core.last_cval += ticks_per_millisecond;
-#endif
-    asm ( "msr CNTP_CVAL_EL0, %[d]" : : [d] "r" (this_core.last_cval) );
-    ms_ticks ++;
-    gate_function( 0, 0 ); // Special case for interrupt handler thread, releases all threads that timeout this tick
-  }
+  uint32_t epoch = epoch_read_lock( &interrupt_handlers_epoch );
 
   for (int i = 0; sources != 0 && i < 12; i++) {
     if (0 != ((1 << i) & sources)) {
       sources = sources & ~(1 << i);
 
-      if (interrupt_handlers[i].r != 0) {
+      INTERRUPT_HANDLER handler;
+      uint32_t sequence;
+      do {
+        sequence = read_seqbegin( &interrupt_handlers_sequence );
+        handler = interrupt_handlers[i];
+      } while (read_seqretry( &interrupt_handlers_sequence, sequence ));
+
+      if (handler.r != 0) {
 interrupts_handled[i]+=16;
-        INTERRUPT_HANDLER__interrupt( interrupt_handlers[i] );
+        INTERRUPT_HANDLER__interrupt( handler );
       }
       else {
 interrupts_handled[i]+= 0x10000;
       }
     }
   }
+
+  epoch_read_unlock( &interrupt_handlers_epoch, epoch );
 }
 
 uint64_t core_timer_value()
@@ -275,7 +419,7 @@ void MapValue__DRIVER_SYSTEM__get_physical_memory_block( MapValue o, NUMBER star
 
 void MapValue__DRIVER_SYSTEM__map_at( MapValue o, PHYSICAL_MEMORY_BLOCK block, NUMBER start )
 {
-  claim_lock( &vmb_lock );
+  claim_thread_lock( &vmb_lock );
         // FIXME Expand number of blocks
         // FIXME Allow for addresses not in order
         // FIXME Invalid parameters
@@ -297,7 +441,7 @@ void MapValue__DRIVER_SYSTEM__map_at( MapValue o, PHYSICAL_MEMORY_BLOCK block, N
   }
 
   make_special_request( Isambard_System_Service_WriteHeap, o.heap_offset_lsr4 << 4, o.number_of_vmbs * sizeof( VirtualMemoryBlock ), vmbs );
-  release_lock( &vmb_lock );
+  release_thread_lock( &vmb_lock );
 
   MapValue__DRIVER_SYSTEM__map_at__return();
 }
@@ -306,7 +450,7 @@ void MapValue__DRIVER_SYSTEM__unmap( MapValue o, NUMBER start )
 {
   PHYSICAL_MEMORY_BLOCK mapped_block = { .r = 0 };
 
-  claim_lock( &vmb_lock );
+  claim_thread_lock( &vmb_lock );
         // FIXME Expand number of blocks
         // FIXME Allow for addresses not in order
         // FIXME Invalid parameters
@@ -328,7 +472,7 @@ void MapValue__DRIVER_SYSTEM__unmap( MapValue o, NUMBER start )
   }
 
   make_special_request( Isambard_System_Service_WriteHeap, o.heap_offset_lsr4 << 4, o.number_of_vmbs * sizeof( VirtualMemoryBlock ), vmbs );
-  release_lock( &vmb_lock );
+  release_thread_lock( &vmb_lock );
 
   if (mapped_block.r == 0) MapValue__exception( 0xbadc0de3 ); // FIXME
 
@@ -341,6 +485,81 @@ void MapValue__SYSTEM__create_thread( MapValue o, NUMBER code, NUMBER stack_top
   MapValue__SYSTEM__create_thread__return( NUMBER__from_integer_register( make_special_request( Isambard_System_Service_Create_Thread, code.r, stack_top.r, 0 ) ) );
 }
 
+void MapValue__SYSTEM__create_thread_on_core( MapValue o, NUMBER core, NUMBER code, NUMBER stack_top )
+{
+  o = o;
+  MapValue__SYSTEM__create_thread_on_core__return( NUMBER__from_integer_register( make_special_request( Isambard_System_Service_Create_Thread_On_Core, core.r, code.r, stack_top.r ) ) );
+}
+
+void MapValue__SYSTEM__set_affinity( MapValue o, NUMBER cores )
+{
+  o = o;
+  MapValue__SYSTEM__set_affinity__return( NUMBER__from_integer_register( make_special_request( Isambard_System_Service_Set_Affinity, cores.r ) ) );
+}
+
+void MapValue__SYSTEM__set_priority( MapValue o, NUMBER priority )
+{
+  o = o;
+  integer_register previous = 0;
+  if (priority.r >= THREAD_PRIORITY_LOWEST && priority.r <= THREAD_PRIORITY_HIGHEST) {
+    previous = make_special_request( Isambard_System_Service_Set_Priority, priority.r );
+  }
+  MapValue__SYSTEM__set_priority__return( NUMBER__from_integer_register( previous ) );
+}
+
+// Kernel events, with the map that created each, so that no map can fill the kernel heap
+// (or use up the interfaces) with them.
+#define MAX_EVENTS 256
+#define MAX_EVENTS_PER_MAP 32
+
+static struct {
+  integer_register object;
+  uint32_t map;
+} events[MAX_EVENTS];
+static uint32_t number_of_events = 0;
+
+static uint32_t events_of( uint32_t map )
+{
+  uint32_t result = 0;
+  for (uint32_t i = 0; i < number_of_events; i++) {
+    if (events[i].map == map) result++;
+  }
+  return result;
+}
+
+void MapValue__SYSTEM__create_event( MapValue o, NUMBER related )
+{
+  integer_register event = 0;
+  if (number_of_events < MAX_EVENTS
+   && events_of( o.map_object ) < MAX_EVENTS_PER_MAP) {
+    event = make_special_request( Isambard_System_Service_Create_Event, related.r );
+  }
+  if (event != 0) {
+    events[number_of_events].object = event;
+    events[number_of_events].map = o.map_object;
+    number_of_events++;
+    // The handler must be the special value for the kernel to recognise it
+    event = interface_to_return( (void*) System_Service_Event, (void*) event );
+  }
+  MapValue__SYSTEM__create_event__return( NUMBER__from_integer_register( event ) );
+}
+
+void MapValue__SYSTEM__destroy_event( MapValue o, NUMBER event )
+{
+  o = o;
+  integer_register destroyed = make_special_request( Isambard_System_Service_Destroy_Event, event.r );
+  if (destroyed == ~0ull) {
+    MapValue__exception( 0xbadc0de8 ); // FIXME: Not an event of the map, or threads are waiting for it
+  }
+  for (uint32_t i = 0; destroyed != 0 && i < number_of_events; i++) {
+    if (events[i].object == destroyed) {
+      events[i] = events[--number_of_events];
+      break;
+    }
+  }
+  MapValue__SYSTEM__destroy_event__return();
+}
+
 void MapValue__DRIVER_SYSTEM__physical_address_of( MapValue o, NUMBER va )
 {
   o = o; va = va;
@@ -353,23 +572,142 @@ void MapValue__DRIVER_SYSTEM__physical_address_of( MapValue o, NUMBER va )
 void MapValue__SYSTEM__register_service( MapValue o, NUMBER name_crc, NUMBER service, NUMBER type_crc )
 {
   o = o;
-  struct service *s = &services[free_service++]; // FIXME limit! LOCK!!!
+  claim_write_lock( &services_lock );
+  if (free_service == sizeof( services ) / sizeof( services[0] )) {
+    release_write_lock( &services_lock );
+    MapValue__exception( 0xbadc0de6 ); // FIXME
+  }
+  struct service *s = &services[free_service];
   s->name_crc = name_crc;
   s->type_crc = type_crc;
   s->service = service;
+  free_service++;
+  release_write_lock( &services_lock );
   MapValue__SYSTEM__register_service__return();
 }
 
-void MapValue__SYSTEM__get_service( MapValue o, NUMBER name_crc, NUMBER type_crc, NUMBER timeout )
+// Each map gets its own DMA Memory and Memory Accounts interfaces, so that allocations
+// can be charged to it, and it can only restrict its own quotas, but only one of each,
+// however often it asks.
+#define MAX_SERVICE_USERS 64
+
+typedef struct {
+  uint32_t map;
+  uint32_t dma_pool;
+  uint32_t memory_accounts;
+  uint32_t directory;
+} service_user_interfaces;
+
+static service_user_interfaces service_users[MAX_SERVICE_USERS];
+static uint32_t number_of_service_users = 0;
+
+static service_directory_storage service_directories[MAX_SERVICE_USERS];
+
+// Returns 0 if there are too many maps
+static service_user_interfaces *service_user( uint32_t map )
 {
-  o = o; timeout = timeout; // Timeout is tricky to implement, without blocking resources
+  for (uint32_t i = 0; i < number_of_service_users; i++) {
+    if (service_users[i].map == map) {
+      return &service_users[i];
+    }
+  }
+  if (number_of_service_users == MAX_SERVICE_USERS) {
+    return 0;
+  }
+  service_users[number_of_service_users].map = map;
+  return &service_users[number_of_service_users++];
+}
+
+static integer_register dma_pool_interface( uint32_t map )
+{
+  service_user_interfaces *user = service_user( map );
+  if (user == 0) {
+    return 0;
+  }
+  if (user->dma_pool == 0) {
+    DmaPool pool = { .r = map };
+    user->dma_pool = DmaPool__DMA_MEMORY__to_return( (void*) pool.r ).r;
+  }
+  return user->dma_pool;
+}
+
+static integer_register memory_accounts_interface( uint32_t map )
+{
+  service_user_interfaces *user = service_user( map );
+  if (user == 0) {
+    return 0;
+  }
+  if (user->memory_accounts == 0) {
+    MemoryAccounts accounts = { .r = map };
+    user->memory_accounts = MemoryAccounts__MEMORY_ACCOUNTS__to_return( (void*) accounts.r ).r;
+  }
+  return user->memory_accounts;
+}
+
+static integer_register directory_interface( uint32_t map )
+{
+  service_user_interfaces *user = service_user( map );
+  if (user == 0) {
+    return 0;
+  }
+  if (user->directory == 0) {
+    user->directory = ServiceDirectory__SERVICE_DIRECTORY__to_return( &service_directories[user - service_users] ).r;
+  }
+  return user->directory;
+}
+
+static integer_register find_service( NUMBER name_crc, NUMBER type_crc )
+{
+  integer_register found = 0;
+
+  claim_read_lock( &services_lock );
   struct service *s = services;
-  while (s < &services[free_service]) {
+  while (found == 0 && s < &services[free_service]) {
     if (s->name_crc.r == name_crc.r && (type_crc.r == 0 || type_crc.r == s->type_crc.r)) {
-      MapValue__SYSTEM__get_service__return( NUMBER__from_integer_register( duplicate_to_return( s->service.r ) ) );
+      found = s->service.r;
     }
     s++;
   }
+  release_read_lock( &services_lock );
+
+  return found;
+}
+
+void ServiceDirectory__SERVICE_DIRECTORY__find( ServiceDirectory o, NUMBER name_crc, NUMBER type_crc )
+{
+  o = o;
+  integer_register found = find_service( name_crc, type_crc );
+  if (found != 0) {
+    found = duplicate_to_return( found );
+  }
+  ServiceDirectory__SERVICE_DIRECTORY__find__return( NUMBER__from_integer_register( found ) );
+}
+
+void MapValue__SYSTEM__get_service( MapValue o, NUMBER name_crc, NUMBER type_crc, NUMBER timeout )
+{
+  o = o; timeout = timeout; // Timeout is tricky to implement, without blocking resources
+
+  // Services provided by this driver
+  if (name_crc.r == name_code( "Service Directory" ).r) {
+    MapValue__SYSTEM__get_service__return( NUMBER__from_integer_register( directory_interface( o.map_object ) ) );
+  }
+  if (name_crc.r == name_code( "DMA Memory" ).r) {
+    MapValue__SYSTEM__get_service__return( NUMBER__from_integer_register( dma_pool_interface( o.map_object ) ) );
+  }
+  if (name_crc.r == name_code( "Memory Accounts" ).r) {
+    MapValue__SYSTEM__get_service__return( NUMBER__from_integer_register( memory_accounts_interface( o.map_object ) ) );
+  }
+  if (name_crc.r == name_code( "Work Queue" ).r) {
+    MapValue__SYSTEM__get_service__return( NUMBER__from_integer_register( WorkQueue__WORK_QUEUE__to_return( 0 ).r ) );
+  }
+  if (name_crc.r == name_code( "Interrupt Work Queue" ).r) {
+    MapValue__SYSTEM__get_service__return( NUMBER__from_integer_register( InterruptWorkQueue__WORK_QUEUE__to_return( 0 ).r ) );
+  }
+
+  integer_register found = find_service( name_crc, type_crc );
+  if (found != 0) {
+    MapValue__SYSTEM__get_service__return( NUMBER__from_integer_register( duplicate_to_return( found ) ) );
+  }
   MapValue__SYSTEM__get_service__return( NUMBER__from_integer_register( 0 ) );
 }
 
@@ -377,13 +715,431 @@ void MapValue__DRIVER_SYSTEM__set_memory_top( MapValue o, NUMBER top )
 {
   o = o;
 
-  Isambard_20( memory_manager, 0, allocatable_memory_base, top.r ); // Initialise
+  // Only add the new memory, the allocator already owns the rest (some of it
+  // allocated, by now).
+  if (top.r > allocator_memory_top) {
+    Isambard_20( memory_manager, 0, allocator_memory_top, top.r ); // Initialise
+    allocator_memory_top = top.r;
+  }
 
   allocatable_memory_top = top.r;
 
   MapValue__DRIVER_SYSTEM__set_memory_top__return();
 }
 
+static void initialise_magazines()
+{
+  magazine *m = this_core.magazines;
+
+  m[SMALL_PAGES].log2size = 12;
+  m[SMALL_PAGES].count = 0;
+  m[SMALL_PAGES].capacity = MAGAZINE_CAPACITY;
+  m[SMALL_PAGES].batch = 16;    // One 64k block, split
+
+  m[LARGE_PAGES].log2size = 16;
+  m[LARGE_PAGES].count = 0;
+  m[LARGE_PAGES].capacity = 8;
+  m[LARGE_PAGES].batch = 4;     // One 256k block, split
+}
+
+static magazine *magazine_for( integer_register size )
+{
+  for (int i = 0; i < NUMBER_OF_MAGAZINES; i++) {
+    if (size == (1ull << this_core.magazines[i].log2size)) {
+      return &this_core.magazines[i];
+    }
+  }
+  return 0;
+}
+
+static void magazine_refill( magazine *m )
+{
+  // The allocator returns blocks aligned to the largest power of two that fits
+  // the request, so a batch can simply be split.
+  uint32_t batch = m->batch;
+  integer_register r = Isambard_11( memory_manager, 1, batch << m->log2size );
+  if (r == 0) {
+    // Fragmented? Try for just the one block
+    batch = 1;
+    r = Isambard_11( memory_manager, 1, 1 << m->log2size );
+  }
+  if (r != 0) {
+    for (uint32_t i = 0; i < batch; i++) {
+      m->block[m->count++] = r + (i << m->log2size);
+    }
+  }
+}
+
+static void magazine_drain( magazine *m )
+{
+  // Return the oldest (bottom) batch of blocks, in address order, so that
+  // neighbouring blocks can be returned to the allocator in a single call.
+  uint32_t batch = m->batch;
+  integer_register *b = m->block;
+
+  for (uint32_t i = 1; i < batch; i++) {
+    integer_register v = b[i];
+    uint32_t j = i;
+    while (j > 0 && b[j-1] > v) {
+      b[j] = b[j-1];
+      j--;
+    }
+    b[j] = v;
+  }
+
+  integer_register start = b[0];
+  integer_register size = 1ull << m->log2size;
+  for (uint32_t i = 1; i < batch; i++) {
+    if (b[i] == start + size) {
+      size += 1ull << m->log2size;
+    }
+    else {
+      Isambard_20( memory_manager, 2, start, size ); // Free
+      start = b[i];
+      size = 1ull << m->log2size;
+    }
+  }
+  Isambard_20( memory_manager, 2, start, size ); // Free
+
+  for (uint32_t i = batch; i < m->count; i++) {
+    b[i - batch] = b[i];
+  }
+  m->count -= batch;
+}
+
+static integer_register allocate_block( integer_register size )
+{
+  magazine *m = magazine_for( size );
+
+  if (m == 0) {
+    return Isambard_11( memory_manager, 1, size ); // Allocate
+  }
+
+  if (m->count == 0) {
+    magazine_refill( m );
+  }
+
+  if (m->count == 0) {
+    return 0;
+  }
+
+  return m->block[--m->count];
+}
+
+static void free_block( integer_register start, integer_register size )
+{
+  magazine *m = magazine_for( size );
+
+  if (m == 0) {
+    Isambard_20( memory_manager, 2, start, size ); // Free
+    return;
+  }
+
+  if (m->count == m->capacity) {
+    magazine_drain( m );
+  }
+
+  m->block[m->count++] = start;
+}
+
+static integer_register allocate_zeroed_block( integer_register size )
+{
+  if (size == 4096 && this_core.zeroed_count > 0) {
+    return this_core.zeroed_pages[--this_core.zeroed_count];
+  }
+
+  integer_register r = allocate_block( size );
+  if (r != 0) {
+    Isambard_20( memory_manager, 3, r, size ); // Zero
+  }
+  return r;
+}
+
+// The idle thread must never block, so it only tops up the zeroed page pool
+// when no other thread is using the system map.
+static bool try_claim_map_lock()
+{
+  integer_register failed;
+  asm volatile (
+        "\n0:"
+        "\n\tldxr %[f], [%[lock]]"
+        "\n\tcbnz %[f], 1f"
+        "\n\tstxr %w[f], %[thread], [%[lock]]"
+        "\n\tcbnz %w[f], 0b"
+        "\n\tb 2f"
+        "\n1:"
+        "\n\tclrex"
+        "\n2:"
+        : [f] "=&r" (failed)
+        : [lock] "r" (&map_lock), [thread] "r" ((integer_register) this_thread)
+        : "memory" );
+  return failed == 0;
+}
+
+static void release_map_lock()
+{
+  asm volatile ( "mov x17, %[lock]" RELEASE_LOCK : : [lock] "r" (&map_lock) : "x16", "x17", "memory" );
+}
+
+// Returns true if a page was zeroed; false if the pool is full, or the map busy.
+static bool zero_a_page()
+{
+  if (this_core.zeroed_count == ZEROED_POOL_SIZE
+   || allocatable_memory_top == 0
+   || !try_claim_map_lock()) {
+    return false;
+  }
+
+  integer_register r = allocate_block( 4096 );
+  if (r != 0) {
+    Isambard_20( memory_manager, 3, r, 4096 ); // Zero
+    this_core.zeroed_pages[this_core.zeroed_count++] = r;
+  }
+
+  release_map_lock();
+
+  return r != 0;
+}
+
+// Physical memory held by each map. Each allocated block records the account it
+// was charged to, so it is credited correctly, even if released by another map.
+// Quotas are in pages, zero means no limit. Maps over their soft quota may still
+// allocate memory, but straight from the allocator, not from the per-core magazines
+// and zeroed pages, and other maps' blocks won't be moved to make room for them.
+// Once every account is in use, maps without one can't allocate memory.
+#define MAX_ACCOUNTS 64 // ContiguousMemoryBlock.account is six bits
+
+typedef struct {
+  uint32_t map;
+  uint32_t pages;
+  uint32_t peak_pages;
+  uint32_t soft_quota;
+  uint32_t hard_quota;
+  uint32_t refused;
+} account;
+
+static account accounts[MAX_ACCOUNTS]; // Entry 0 is unused, a block's account 0 means not charged
+static uint32_t number_of_accounts = 1;
+
+static uint32_t account_for( uint32_t map )
+{
+  for (uint32_t i = 1; i < number_of_accounts; i++) {
+    if (accounts[i].map == map) {
+      return i;
+    }
+  }
+  if (number_of_accounts == MAX_ACCOUNTS) {
+    return 0; // No account, refused
+  }
+  accounts[number_of_accounts].map = map;
+  return number_of_accounts++;
+}
+
+static bool over_quota( uint32_t a, uint32_t quota, uint32_t pages )
+{
+  return a == 0 || (quota != 0 && accounts[a].pages + pages > quota);
+}
+
+static void charge( uint32_t a, uint32_t pages )
+{
+  if (a != 0) {
+    accounts[a].pages += pages;
+    if (accounts[a].pages > accounts[a].peak_pages) {
+      accounts[a].peak_pages = accounts[a].pages;
+    }
+  }
+}
+
+static void credit( uint32_t a, uint32_t pages )
+{
+  if (a != 0) {
+    accounts[a].pages -= pages;
+  }
+}
+
+// Blocks handed out by allocate_memory and the DMA pool, by the interface returned for
+// them, so that only live blocks can be released, only once, and only to where they
+// came from.
+#define MAX_ALLOCATIONS 1024
+
+enum { FROM_ALLOCATOR, FROM_DMA_POOL };
+
+static struct {
+  uint32_t interface;
+  uint32_t source;
+} allocations[MAX_ALLOCATIONS];
+static uint32_t number_of_allocations = 0;
+
+static bool allocations_full()
+{
+  return number_of_allocations == MAX_ALLOCATIONS;
+}
+
+static void record_allocation( uint32_t interface, uint32_t source )
+{
+  allocations[number_of_allocations].interface = interface;
+  allocations[number_of_allocations].source = source;
+  number_of_allocations++;
+}
+
+static bool is_allocation( uint32_t interface, uint32_t source )
+{
+  for (uint32_t i = 0; i < number_of_allocations; i++) {
+    if (allocations[i].interface == interface) {
+      return allocations[i].source == source;
+    }
+  }
+  return false;
+}
+
+static void forget_allocation( uint32_t interface )
+{
+  for (uint32_t i = 0; i < number_of_allocations; i++) {
+    if (allocations[i].interface == interface) {
+      allocations[i] = allocations[--number_of_allocations];
+      return;
+    }
+  }
+}
+
+// The kernel frees the block's interface, unless it's still mapped or shared, returning
+// the block (or 0).
+static ContiguousMemoryBlock release_allocation( uint32_t interface )
+{
+  claim_thread_lock( &vmb_lock ); // No map_at while the kernel checks the maps
+  ContiguousMemoryBlock cmb;
+  cmb.r = make_special_request( Isambard_System_Service_Release_Memory_Block, interface );
+  release_thread_lock( &vmb_lock );
+
+  if (cmb.r != 0) {
+    forget_allocation( interface );
+  }
+  return cmb;
+}
+
+// Blocks allocated with ALLOCATE_MOVABLE, which may be moved to make space for
+// large allocations.
+#define MAX_MOVABLE_BLOCKS 64
+
+static struct {
+  integer_register start;
+  integer_register size;
+} movable_blocks[MAX_MOVABLE_BLOCKS];
+static uint32_t number_of_movable_blocks = 0;
+
+// Smaller requests failing means memory is simply running out; compaction would
+// only shuffle blocks around.
+#define COMPACTION_MINIMUM (1 << 20)
+
+static bool record_movable( integer_register start, integer_register size )
+{
+  if (number_of_movable_blocks == MAX_MOVABLE_BLOCKS) {
+    return false; // The block will simply stay where it is
+  }
+  movable_blocks[number_of_movable_blocks].start = start;
+  movable_blocks[number_of_movable_blocks].size = size;
+  number_of_movable_blocks++;
+  return true;
+}
+
+static void forget_movable( integer_register start )
+{
+  for (uint32_t i = 0; i < number_of_movable_blocks; i++) {
+    if (movable_blocks[i].start == start) {
+      movable_blocks[i] = movable_blocks[--number_of_movable_blocks];
+      return;
+    }
+  }
+}
+
+static integer_register movable_bytes_in( integer_register start, integer_register end )
+{
+  integer_register result = 0;
+  for (uint32_t i = 0; i < number_of_movable_blocks; i++) {
+    if (movable_blocks[i].start >= start && movable_blocks[i].start + movable_blocks[i].size <= end) {
+      result += movable_blocks[i].size;
+    }
+  }
+  return result;
+}
+
+static void release_unoccupied( integer_register start, integer_register end )
+{
+  // Return everything in the range that isn't (still) occupied by a movable block
+  integer_register p = start;
+  while (p < end) {
+    integer_register next = end;
+    bool occupied = false;
+    for (uint32_t i = 0; i < number_of_movable_blocks; i++) {
+      if (movable_blocks[i].start == p) {
+        p += movable_blocks[i].size;
+        occupied = true;
+        break;
+      }
+      if (movable_blocks[i].start > p && movable_blocks[i].start < next) {
+        next = movable_blocks[i].start;
+      }
+    }
+    if (!occupied) {
+      Isambard_20( memory_manager, 2, p, next - p ); // Free
+      p = next;
+    }
+  }
+}
+
+// Find a naturally aligned window of memory that contains only free memory and
+// movable blocks, take the free memory from the allocator, and move the movable
+// blocks out of it. Each block is read-only in every map while it's copied; the
+// owners' threads that write to it wait until it's in its new place.
+static integer_register compact_for( integer_register size )
+{
+  integer_register window = 1ull << (64 - __builtin_clzll( size - 1 ));
+
+  integer_register best = 0;
+  integer_register least_to_move = ~0ull;
+
+  for (integer_register w = (allocatable_memory_base + window - 1) & ~(window - 1);
+       w + window <= allocatable_memory_top;
+       w += window) {
+    integer_register movable = movable_bytes_in( w, w + window );
+    if (movable < least_to_move
+     && movable + Isambard_21( memory_manager, 4, w, w + window ) == window) {
+      best = w;
+      least_to_move = movable;
+    }
+  }
+
+  if (least_to_move == ~0ull) {
+    return 0;
+  }
+
+  Isambard_20( memory_manager, 5, best, best + window ); // Claim
+
+  for (uint32_t i = 0; i < number_of_movable_blocks; i++) {
+    integer_register old = movable_blocks[i].start;
+    integer_register block_size = movable_blocks[i].size;
+
+    if (old >= best && old + block_size <= best + window) {
+      // Can't be allocated from the window; its free memory has been claimed
+      integer_register new = Isambard_11( memory_manager, 1, block_size ); // Allocate
+      if (new == 0) {
+        release_unoccupied( best, best + window );
+        return 0;
+      }
+      make_special_request( Isambard_System_Service_Freeze_Memory, old >> 12, block_size >> 12 );
+      Isambard_30( memory_manager, 6, new, old, block_size ); // Copy
+      make_special_request( Isambard_System_Service_Relocate_Memory, old >> 12, new >> 12, block_size >> 12 );
+      movable_blocks[i].start = new;
+    }
+  }
+
+  if (window > size) {
+    Isambard_20( memory_manager, 2, best + size, window - size ); // Free
+  }
+
+  return best;
+}
+
 void MapValue__SYSTEM__allocate_memory( MapValue o, NUMBER size )
 {
   o = o;
@@ -393,20 +1149,268 @@ void MapValue__SYSTEM__allocate_memory( MapValue o, NUMBER size )
     MapValue__exception( 0 ); // No memory to allocate. May retry after yield or sleep, but shouldn't happen.
   }
 
-  integer_register r = Isambard_11( memory_manager, 1, size.r ); // Allocate
+  integer_register flags = size.r & ALLOCATE_FLAGS;
+  integer_register pages = ((size.r & ~ALLOCATE_FLAGS) + 4095) >> 12;
+
+  uint32_t a = account_for( o.map_object );
+  if (over_quota( a, accounts[a].hard_quota, pages )
+   || allocations_full()) {
+    accounts[a].refused++;
+    MapValue__SYSTEM__allocate_memory__return( result );
+  }
+
+  bool over_soft_quota = over_quota( a, accounts[a].soft_quota, pages );
+
+  integer_register r;
+  if (over_soft_quota) {
+    r = Isambard_11( memory_manager, 1, pages << 12 ); // Allocate
+    if (r != 0 && 0 != (flags & ALLOCATE_ZEROED)) {
+      Isambard_20( memory_manager, 3, r, pages << 12 ); // Zero
+    }
+  }
+  else if (0 != (flags & ALLOCATE_ZEROED)) {
+    r = allocate_zeroed_block( pages << 12 );
+  }
+  else {
+    r = allocate_block( pages << 12 );
+  }
+
+  if (r == 0 && (pages << 12) >= COMPACTION_MINIMUM
+   && !over_soft_quota) {
+    r = compact_for( pages << 12 );
+    if (r != 0 && 0 != (flags & ALLOCATE_ZEROED)) {
+      Isambard_20( memory_manager, 3, r, pages << 12 ); // Zero
+    }
+  }
+
+  if (r != 0 && 0 != (flags & ALLOCATE_MOVABLE)) {
+    record_movable( r, pages << 12 );
+  }
 
   if (r != 0) {
+    charge( a, pages );
     ContiguousMemoryBlock cmb = { .start_page = r >> 12,
-                                  .page_count = size.r >> 12,
+                                  .page_count = pages,
+                                  .account = a,
                                   .memory_type = Fully_Cacheable };
     // Don't use the ContiguousMemoryBlock_PHYSICAL_MEMORY_BLOCK_to_return routine, the handler must be the
     // special value for the kernel to recognise it.
     result.r = interface_to_return( (void*) System_Service_PhysicalMemoryBlock, (void*) cmb.r );
+    record_allocation( result.r, FROM_ALLOCATOR );
   }
 
   MapValue__SYSTEM__allocate_memory__return( result );
 }
 
+// A region reserved at boot for DMA buffers, so that they don't have to compete
+// with general allocations. Blocks are uncached, and aligned to their size (up to
+// 64k). The region is allocated from below 1GB, so it is visible to the VideoCore.
+#define DMA_POOL_SIZE (16 << 20)
+#define DMA_POOL_PAGES (DMA_POOL_SIZE >> 12)
+#define DMA_POOL_MAX_ALIGNMENT 16 // pages
+
+static integer_register dma_pool_base = 0;
+static uint64_t dma_pool_pages_used[DMA_POOL_PAGES / 64] = { 0 };
+
+static void initialise_dma_pool()
+{
+  dma_pool_base = Isambard_11( memory_manager, 1, DMA_POOL_SIZE ); // Allocate
+
+  // Start clean: zeroed, with no stale lines in the caches
+  Isambard_20( memory_manager, 3, dma_pool_base, DMA_POOL_SIZE ); // Zero
+}
+
+static bool dma_page_used( uint32_t page )
+{
+  return 0 != (dma_pool_pages_used[page / 64] & (1ull << (page % 64)));
+}
+
+static void mark_dma_pages( uint32_t first, uint32_t count, bool used )
+{
+  for (uint32_t page = first; page < first + count; page++) {
+    if (used)
+      dma_pool_pages_used[page / 64] |= (1ull << (page % 64));
+    else
+      dma_pool_pages_used[page / 64] &= ~(1ull << (page % 64));
+  }
+}
+
+static ContiguousMemoryBlock dma_block( PHYSICAL_MEMORY_BLOCK block )
+{
+  ContiguousMemoryBlock cmb;
+  cmb.r = make_special_request( Isambard_System_Service_ReadInterface, block );
+
+  integer_register start = ((integer_register) cmb.start_page) << 12;
+  integer_register size = ((integer_register) cmb.page_count) << 12;
+
+  if (cmb.is_subpage
+   || cmb.memory_type != Non_cacheable
+   || start < dma_pool_base
+   || start + size > dma_pool_base + DMA_POOL_SIZE) {
+    DmaPool__exception( 0xbadc0de5 ); // FIXME
+  }
+
+  return cmb;
+}
+
+void DmaPool__DMA_MEMORY__allocate( DmaPool o, NUMBER size )
+{
+  PHYSICAL_MEMORY_BLOCK result = { 0 };
+
+  uint32_t pages = (size.r + 4095) >> 12;
+
+  if (dma_pool_base == 0 || pages == 0 || pages > DMA_POOL_PAGES) {
+    DmaPool__exception( 0 );
+  }
+
+  uint32_t a = account_for( o.r );
+  if (over_quota( a, accounts[a].hard_quota, pages )
+   || allocations_full()) {
+    accounts[a].refused++;
+    DmaPool__DMA_MEMORY__allocate__return( result );
+  }
+
+  uint32_t alignment = 1;
+  while (alignment < pages && alignment < DMA_POOL_MAX_ALIGNMENT) {
+    alignment = alignment << 1;
+  }
+
+  for (uint32_t first = 0; first + pages <= DMA_POOL_PAGES && result.r == 0; first += alignment) {
+    uint32_t page = first;
+    while (page < first + pages && !dma_page_used( page )) {
+      page++;
+    }
+    if (page == first + pages) {
+      mark_dma_pages( first, pages, true );
+      charge( a, pages );
+      ContiguousMemoryBlock cmb = { .start_page = (dma_pool_base >> 12) + first,
+                                    .page_count = pages,
+                                    .account = a,
+                                    .memory_type = Non_cacheable };
+      // As in MapValue__SYSTEM__allocate_memory, the kernel must recognise the block
+      result.r = interface_to_return( (void*) System_Service_PhysicalMemoryBlock, (void*) cmb.r );
+      record_allocation( result.r, FROM_DMA_POOL );
+    }
+  }
+
+  DmaPool__DMA_MEMORY__allocate__return( result );
+}
+
+void DmaPool__DMA_MEMORY__bus_address( DmaPool o, PHYSICAL_MEMORY_BLOCK block )
+{
+  o = o;
+  ContiguousMemoryBlock cmb = dma_block( block );
+
+  // The VideoCore's uncached alias of ARM memory
+  DmaPool__DMA_MEMORY__bus_address__return( NUMBER__from_integer_register( (((integer_register) cmb.start_page) << 12) | 0xc0000000 ) );
+}
+
+void DmaPool__DMA_MEMORY__release( DmaPool o, PHYSICAL_MEMORY_BLOCK block )
+{
+  o = o;
+  // Only blocks allocated from the pool, and not yet released, once nothing maps or
+  // shares them.
+  if (!is_allocation( block.r, FROM_DMA_POOL )) {
+    DmaPool__exception( 0xbadc0de5 ); // FIXME
+  }
+
+  ContiguousMemoryBlock cmb = release_allocation( block.r );
+  if (cmb.r == 0) {
+    DmaPool__exception( 0xbadc0de7 ); // FIXME: Still in use
+  }
+
+  mark_dma_pages( cmb.start_page - (dma_pool_base >> 12), cmb.page_count, false );
+  credit( cmb.account, cmb.page_count );
+
+  DmaPool__DMA_MEMORY__release__return();
+}
+
+void MemoryAccounts__MEMORY_ACCOUNTS__number_of_accounts( MemoryAccounts o )
+{
+  o = o;
+  MemoryAccounts__MEMORY_ACCOUNTS__number_of_accounts__return( NUMBER__from_integer_register( number_of_accounts - 1 ) );
+}
+
+void MemoryAccounts__MEMORY_ACCOUNTS__map( MemoryAccounts o, NUMBER index )
+{
+  o = o;
+  if (index.r >= number_of_accounts - 1) {
+    MemoryAccounts__exception( 0 );
+  }
+  MemoryAccounts__MEMORY_ACCOUNTS__map__return( NUMBER__from_integer_register( accounts[index.r + 1].map ) );
+}
+
+static account *existing_account( NUMBER map )
+{
+  for (uint32_t i = 1; i < number_of_accounts; i++) {
+    if (accounts[i].map == map.r) {
+      return &accounts[i];
+    }
+  }
+  MemoryAccounts__exception( 0 );
+  __builtin_unreachable();
+}
+
+void MemoryAccounts__MEMORY_ACCOUNTS__pages_held( MemoryAccounts o, NUMBER map )
+{
+  o = o;
+  MemoryAccounts__MEMORY_ACCOUNTS__pages_held__return( NUMBER__from_integer_register( existing_account( map )->pages ) );
+}
+
+void MemoryAccounts__MEMORY_ACCOUNTS__peak_pages( MemoryAccounts o, NUMBER map )
+{
+  o = o;
+  MemoryAccounts__MEMORY_ACCOUNTS__peak_pages__return( NUMBER__from_integer_register( existing_account( map )->peak_pages ) );
+}
+
+void MemoryAccounts__MEMORY_ACCOUNTS__refused_requests( MemoryAccounts o, NUMBER map )
+{
+  o = o;
+  MemoryAccounts__MEMORY_ACCOUNTS__refused_requests__return( NUMBER__from_integer_register( existing_account( map )->refused ) );
+}
+
+void MemoryAccounts__MEMORY_ACCOUNTS__set_quota( MemoryAccounts o, NUMBER map, NUMBER soft_pages, NUMBER hard_pages )
+{
+  // A map may only restrict its own quotas, never relax them (zero is no limit)
+  uint32_t a = account_for( map.r );
+  if (a == 0
+   || map.r != o.r
+   || soft_pages.r == 0 || hard_pages.r == 0
+   || (accounts[a].soft_quota != 0 && soft_pages.r > accounts[a].soft_quota)
+   || (accounts[a].hard_quota != 0 && hard_pages.r > accounts[a].hard_quota)) {
+    MemoryAccounts__exception( 0 );
+  }
+  accounts[a].soft_quota = soft_pages.r;
+  accounts[a].hard_quota = hard_pages.r;
+  MemoryAccounts__MEMORY_ACCOUNTS__set_quota__return();
+}
+
+void MapValue__SYSTEM__release_memory( MapValue o, PHYSICAL_MEMORY_BLOCK block )
+{
+  o = o;
+  // Only whole blocks returned by allocate_memory, and not yet released, may be
+  // released, by the map they were returned to, once nothing maps or shares them.
+  if (!is_allocation( block.r, FROM_ALLOCATOR )) {
+    MapValue__exception( 0xbadc0de4 ); // FIXME
+  }
+
+  ContiguousMemoryBlock cmb = release_allocation( block.r );
+  if (cmb.r == 0) {
+    MapValue__exception( 0xbadc0de7 ); // FIXME: Still in use
+  }
+
+  integer_register start = ((integer_register) cmb.start_page) << 12;
+  integer_register size = ((integer_register) cmb.page_count) << 12;
+
+  forget_movable( start );
+
+  credit( cmb.account, cmb.page_count );
+
+  free_block( start, size );
+
+  MapValue__SYSTEM__release_memory__return();
+}
+
 void MapValue__DRIVER_SYSTEM__get_core_interrupts_count( MapValue o )
 {
   o = o;
@@ -416,7 +1420,9 @@ void MapValue__DRIVER_SYSTEM__get_core_interrupts_count( MapValue o )
 void MapValue__DRIVER_SYSTEM__get_ms_timer_ticks( MapValue o )
 {
   o = o;
-  MapValue__DRIVER_SYSTEM__get_ms_timer_ticks__return( NUMBER__from_integer_register( ms_ticks ) );
+  uint64_t now;
+  asm volatile ( "mrs %[d], CNTPCT_EL0" : [d] "=r" (now) );
+  MapValue__DRIVER_SYSTEM__get_ms_timer_ticks__return( NUMBER__from_integer_register( (now - ms_timer_start) / ticks_per_millisecond ) );
 }
 
 void MapValue__DRIVER_SYSTEM__get_core_timer_value( MapValue o )
@@ -425,6 +1431,18 @@ void MapValue__DRIVER_SYSTEM__get_core_timer_value( MapValue o )
   MapValue__DRIVER_SYSTEM__get_core_timer_value__return( NUMBER__from_integer_register( core_timer_value() ) );
 }
 
+void MapValue__DRIVER_SYSTEM__get_ipi_statistic( MapValue o, NUMBER core, NUMBER statistic )
+{
+  o = o;
+  MapValue__DRIVER_SYSTEM__get_ipi_statistic__return( NUMBER__from_integer_register( make_special_request( Isambard_System_Service_IPI_Statistics, core.r, statistic.r ) ) );
+}
+
+void MapValue__DRIVER_SYSTEM__get_wake_latency( MapValue o, NUMBER thread, NUMBER statistic )
+{
+  o = o;
+  MapValue__DRIVER_SYSTEM__get_wake_latency__return( NUMBER__from_integer_register( make_special_request( Isambard_System_Service_Wake_Latency, thread.r, statistic.r ) ) );
+}
+
 void MapValue__DRIVER_SYSTEM__register_interrupt_handler( MapValue o, INTERRUPT_HANDLER handler, NUMBER interrupt )
 {
   o = o;
@@ -435,7 +1453,9 @@ void MapValue__DRIVER_SYSTEM__register_interrupt_handler( MapValue o, INTERRUPT_
 void MapValue__DRIVER_SYSTEM__remove_interrupt_handler( MapValue o, INTERRUPT_HANDLER handler, NUMBER interrupt )
 {
   o = o;
-  board_remove_interrupt_handler( handler, interrupt.r );
+  if (!board_remove_interrupt_handler( handler, interrupt.r )) {
+    MapValue__exception( 0 ); // May retry after yield or sleep
+  }
   MapValue__DRIVER_SYSTEM__remove_interrupt_handler__return();
 }
 
@@ -492,10 +1512,260 @@ void __attribute__(( noreturn )) ContiguousMemoryBlock__PHYSICAL_MEMORY_BLOCK__s
   ContiguousMemoryBlock__PHYSICAL_MEMORY_BLOCK__subblock__return( result );
 }
 
+// Timer callbacks, one table for all cores; each core's workers only make the calls
+// registered on that core.
+#define MAX_TIMER_CALLBACKS 32
+
+static uint64_t timer_callbacks_lock = 0;
+
+static struct {
+  integer_register handler;     // 0 if the entry is free
+  uint32_t method;
+  uint32_t core;
+  uint64_t deadline;            // CNTPCT_EL0
+  uint64_t period;              // Generic timer ticks, 0 for a one-shot callback
+  uint32_t generation;          // Incremented when the entry is re-used, part of the timer code
+} timer_callbacks[MAX_TIMER_CALLBACKS] = { { 0 } };
+
+static struct {
+  uint32_t watching;            // The worker sleeping until the next deadline, 0 if none
+  uint32_t spare_count;
+  uint32_t spare[TIMER_WORKERS_PER_CORE]; // Workers waiting until they're needed
+} timer_workers[MAX_CORES] = { { 0 } };
+
+static inline uint64_t counter_now()
+{
+  uint64_t now;
+  asm volatile ( "mrs %[d], CNTPCT_EL0" : [d] "=r" (now) );
+  return now;
+}
+
+static inline uint64_t counter_frequency()
+{
+  uint64_t frequency;
+  asm ( "mrs %[freq], CNTFRQ_EL0" : [freq] "=r" (frequency) );
+  return frequency;
+}
+
+static uint64_t microseconds_to_counter_ticks( uint64_t us )
+{
+  uint64_t frequency = counter_frequency();
+  return (us / 1000000) * frequency + ((us % 1000000) * frequency) / 1000000;
+}
+
+// Rounded up, so a worker doesn't wake before the deadline
+static uint64_t counter_ticks_to_microseconds( uint64_t ticks )
+{
+  uint64_t frequency = counter_frequency();
+  return (ticks / frequency) * 1000000 + ((ticks % frequency) * 1000000 + frequency - 1) / frequency;
+}
+
+// One of the workers on a core sleeps until the next deadline, the others wait until
+// one of them takes a callback to call.
+void __attribute__(( noreturn )) timer_worker_thread()
+{
+  uint32_t core = this_core.number;
+
+  for (;;) {
+    integer_register handler = 0;
+    uint32_t method = 0;
+    uint64_t next = ~0ull;
+    uint32_t to_wake = 0;
+    bool spare = false;
+
+    claim_thread_lock( &timer_callbacks_lock );
+
+    uint64_t now = counter_now();
+    for (int i = 0; i < MAX_TIMER_CALLBACKS && handler == 0; i++) {
+      if (timer_callbacks[i].handler == 0 || timer_callbacks[i].core != core) continue;
+
+      if (timer_callbacks[i].deadline <= now) {
+        handler = timer_callbacks[i].handler;
+        method = timer_callbacks[i].method;
+        if (timer_callbacks[i].period == 0) {
+          timer_callbacks[i].handler = 0;
+        }
+        else {
+          timer_callbacks[i].deadline += timer_callbacks[i].period;
+          // Calls missed while the core was busy are not made up
+          if (timer_callbacks[i].deadline <= now) timer_callbacks[i].deadline = now + timer_callbacks[i].period;
+        }
+      }
+      else if (timer_callbacks[i].deadline < next) {
+        next = timer_callbacks[i].deadline;
+      }
+    }
+
+    if (handler != 0) {
+      // Another worker keeps watch while this one makes the call
+      if (timer_workers[core].watching == this_thread) timer_workers[core].watching = 0;
+      if (timer_workers[core].watching == 0 && timer_workers[core].spare_count > 0) {
+        to_wake = timer_workers[core].spare[--timer_workers[core].spare_count];
+        timer_workers[core].watching = to_wake;
+      }
+    }
+    else if (timer_workers[core].watching == 0 || timer_workers[core].watching == this_thread) {
+      timer_workers[core].watching = this_thread;
+    }
+    else {
+      timer_workers[core].spare[timer_workers[core].spare_count++] = this_thread;
+      spare = true;
+    }
+
+    release_thread_lock( &timer_callbacks_lock );
+
+    if (handler != 0) {
+      if (to_wake != 0) wake_thread( to_wake );
+      Isambard_00( handler, method );
+    }
+    else if (spare || next == ~0ull) {
+      wait_until_woken();
+    }
+    else {
+      sleep_us( counter_ticks_to_microseconds( next - now ) );
+    }
+  }
+}
+
+static void create_timer_workers()
+{
+  // Like the interrupt thread, created by the idle thread, and staying on this core
+  for (int i = 0; i < TIMER_WORKERS_PER_CORE; i++) {
+    make_special_request( Isambard_System_Service_Create_Thread_On_Core, this_core.number, timer_worker_thread, (uint64_t*) &this_core.timer_worker_stacks[i][TIMER_WORKER_STACK_SIZE] );
+  }
+}
+
+void MapValue__DRIVER_SYSTEM__add_timer_callback( MapValue o, NUMBER handler, NUMBER method, NUMBER delay, NUMBER period )
+{
+  o = o;
+  if (handler.r == 0 || this_core.number >= MAX_CORES) {
+    MapValue__exception( 0 );
+  }
+
+  integer_register timer = 0;
+
+  claim_thread_lock( &timer_callbacks_lock );
+
+  for (int i = 0; i < MAX_TIMER_CALLBACKS && timer == 0; i++) {
+    if (timer_callbacks[i].handler == 0) {
+      timer_callbacks[i].handler = handler.r;
+      timer_callbacks[i].method = method.r;
+      timer_callbacks[i].core = this_core.number;
+      timer_callbacks[i].deadline = counter_now() + microseconds_to_counter_ticks( delay.r );
+      timer_callbacks[i].period = microseconds_to_counter_ticks( period.r );
+      timer = ((integer_register) ++timer_callbacks[i].generation << 8) | (i + 1);
+    }
+  }
+
+  // The new deadline may be earlier than the one being waited for
+  uint32_t watching = timer_workers[this_core.number].watching;
+
+  release_thread_lock( &timer_callbacks_lock );
+
+  if (timer == 0) {
+    MapValue__exception( 0 ); // Too many callbacks
+  }
+
+  if (watching != 0) wake_thread( watching );
+
+  MapValue__DRIVER_SYSTEM__add_timer_callback__return( NUMBER__from_integer_register( timer ) );
+}
+
+void MapValue__DRIVER_SYSTEM__remove_timer_callback( MapValue o, NUMBER timer )
+{
+  o = o;
+  uint32_t i = (timer.r & 0xff) - 1;
+
+  // Removing a one-shot callback that's already been called is harmless; one being
+  // called at the time completes, but the callback isn't called again.
+  claim_thread_lock( &timer_callbacks_lock );
+  if (i < MAX_TIMER_CALLBACKS && timer_callbacks[i].generation == (timer.r >> 8)) {
+    timer_callbacks[i].handler = 0;
+  }
+  release_thread_lock( &timer_callbacks_lock );
+
+  MapValue__DRIVER_SYSTEM__remove_timer_callback__return();
+}
+
+// Work queued by drivers (typically by their interrupt handlers), done by a thread per
+// core, whichever is free; a burst of work is spread over the cores.
+#define WORK_THREAD_STACK_SIZE 64
+
+typedef struct {
+  integer_register handler;
+  integer_register method;
+  integer_register argument;
+} work_item;
+
+DEFINE_MPMC_QUEUE( work, work_item, 64 )
+
+static work_queue work_items = { 0 };
+
+// Not in this_core; a work thread may move to another core while doing work in another map
+static uint64_t __attribute__(( aligned( 16 ) )) work_thread_stacks[MAX_CORES][WORK_THREAD_STACK_SIZE];
+
+void __attribute__(( noreturn )) work_thread()
+{
+  for (;;) {
+    work_item item = work_pop( &work_items );
+    Isambard_10( item.handler, item.method, item.argument );
+  }
+}
+
+static void create_work_thread()
+{
+  if (this_core.number < MAX_CORES) {
+    make_special_request( Isambard_System_Service_Create_Thread, work_thread, (uint64_t*) &work_thread_stacks[this_core.number][WORK_THREAD_STACK_SIZE], 0 );
+  }
+}
+
+// Never waits
+static bool queue_work( NUMBER handler, NUMBER method, NUMBER argument )
+{
+  work_item item = { .handler = handler.r, .method = method.r, .argument = argument.r };
+  if (handler.r == 0 || !work_try_push( &work_items, item )) {
+    return false;
+  }
+  queue_wake_waiter( work_items.waiting_consumers );
+  return true;
+}
+
+void WorkQueue__WORK_QUEUE__queue( WorkQueue o, NUMBER handler, NUMBER method, NUMBER argument )
+{
+  o = o;
+  if (!queue_work( handler, method, argument )) {
+    WorkQueue__exception( 0 ); // Queue full
+  }
+  WorkQueue__WORK_QUEUE__queue__return();
+}
+
+void WorkQueue__WORK_QUEUE__try_queue( WorkQueue o, NUMBER handler, NUMBER method, NUMBER argument )
+{
+  o = o;
+  WorkQueue__WORK_QUEUE__try_queue__return( NUMBER__from_integer_register( queue_work( handler, method, argument ) ) );
+}
+
+// Only reached by the interrupt thread, see the veneer
+void InterruptWorkQueue__WORK_QUEUE__queue( InterruptWorkQueue o, NUMBER handler, NUMBER method, NUMBER argument )
+{
+  o = o;
+  if (!queue_work( handler, method, argument )) {
+    InterruptWorkQueue__exception( 0 );
+  }
+  InterruptWorkQueue__WORK_QUEUE__queue__return();
+}
+
+void InterruptWorkQueue__WORK_QUEUE__try_queue( InterruptWorkQueue o, NUMBER handler, NUMBER method, NUMBER argument )
+{
+  o = o;
+  InterruptWorkQueue__WORK_QUEUE__try_queue__return( NUMBER__from_integer_register( queue_work( handler, method, argument ) ) );
+}
+
 extern void subsequent_core_system_thread();
 
 void __attribute__(( noreturn )) interrupt_handler_thread()
 {
+  this_core.interrupt_thread = this_thread;
   for (;;) {
     make_special_request( Isambard_System_Service_Set_Interrupt_Thread );
     board_call_interrupt_handlers();
@@ -531,10 +1801,8 @@ static void start_ms_timer()
   device_pages.QA7.Core_IRQ_Source[2] = 0x00d; // (1 << 8);
   device_pages.QA7.Core_IRQ_Source[3] = 0x00d; // (1 << 8);
 
-  device_pages.QA7.Core_timers_Interrupt_control[this_core.number] = 2; // The interrupt that's triggered by the generic ARM timer
+  asm volatile ( "mrs %[d], CNTPCT_EL0" : [d] "=r" (ms_timer_start) );
 
-  // Establish 1ms timer, using generic timer (implemented in QEMU, unlike the above)
-  uint64_t now;
   uint32_t frequency;
   asm ( "mrs %[freq], CNTFRQ_EL0" : [freq] "=r" (frequency) );
   ticks_per_millisecond = frequency / 1000;
@@ -542,11 +1810,6 @@ static void start_ms_timer()
 #ifdef QEMU
   ticks_per_millisecond = frequency / 100; // Slow it down, in case we're logging
 #endif
-
-  asm ( "mrs %[d], CNTPCT_EL0" : [d] "=r" (now) );
-  this_core.last_cval = now + ticks_per_millisecond; // Match in a millisecond
-  asm ( "msr CNTP_CVAL_EL0, %[d]" : : [d] "r" (this_core.last_cval) );
-  asm ( "msr CNTP_CTL_EL0, %[w]" : : [w] "r" (5) ); // Enable interrupts
 }
 
 void __attribute__(( noreturn )) idle_thread_entry( Object system_interface,
@@ -560,14 +1823,20 @@ void __attribute__(( noreturn )) idle_thread_entry( Object system_interface,
 
   this_core.number = core_number;
 
+  initialise_magazines();
+  this_core.zeroed_count = 0;
+
   if (core_number == 0) {
     memory_manager = memory_manager_map;
 
     board_initialise();
 
   Isambard_20( memory_manager, 0, allocatable_memory_base, 256 * 1024 * 1024 ); // Initialise
+  allocator_memory_top = 256 * 1024 * 1024;
 
   allocatable_memory_top = 512 * 1024 * 1024;
+
+  initialise_dma_pool();
     board_initialised = true;
 
     asm volatile ( "dsb sy\n\tsev" );
@@ -579,18 +1848,32 @@ void __attribute__(( noreturn )) idle_thread_entry( Object system_interface,
   }
 
   create_interrupt_handler_thread();
+  create_timer_workers();
+  create_work_thread();
 
   if (core_number == 0) {
     // Other timers will be available, but 1ms seems reasonable for timing events,
     // considering a 2MHz computer used 10ms ticks, in 1982.
     start_ms_timer();
+    asm volatile ( "dsb sy\n\tsev" );
   }
+  else {
+    while (*(uint32_t volatile *) &ticks_per_millisecond == 0) { asm volatile ( "wfe" ); }
+  }
+
+  // Each core's generic timer is programmed by the kernel, for thread timeouts and time slices
+
+  // From now on, only run when there's nothing else to do
+  make_special_request( Isambard_System_Service_Set_Priority, THREAD_PRIORITY_IDLE );
 
   for (;;) {
-    if (!yield())
+    if (!yield()
+     && !make_special_request( Isambard_System_Service_Adopt_Threads )
+     && !make_special_request( Isambard_System_Service_Steal_Thread )
+     && !epoch_poll( &interrupt_handlers_epoch )
+     && !zero_a_page())
     {
-      // Nothing else running on this core.
-      // TODO: Ask other cores if there's something we can do
+      // Nothing else running on this core, or waiting on another.
       asm volatile ( "wfi" );
     }
   }
@@ -109,7 +109,6 @@ void __attribute__(( noreturn, noinline )) c_el3_nommu( Core *core, unsigned num
   // But use local variables with care, if at all!
   memset( core, 0, sizeof( Core ) );
 
-if (number != 0) { for (;;) { asm ( "wfi" ); } } // TODO TODO TODO!!
   // Note: the address of the present array will be an offset from _start.
   el3_synchronised_initialise( core, number, present_bits );
 
@@ -387,6 +387,7 @@ void __attribute__(( noreturn )) el3_synchronised_initialise( EL_PARAMETERS )
   __builtin_unreachable();
 }
 
+#ifdef WATCHDOG_CORE
 static void watchdog()
 {
 #ifdef QEMU
@@ -404,15 +405,18 @@ static uint32_t *const screen_address = (void*) 0x0e400000;
     screen_address[n++] = (old_value == new_value) ? 0xffff0000 : 0xffffff00;
   }
 }
+#endif
 
 
 void roll_call( core_types volatile *present, unsigned number )
 {
-  if (number == 3) {
+#ifdef WATCHDOG_CORE
+  if (number == WATCHDOG_CORE) {
     // Watchdog core
     present[number] = SPECIAL; // Tell the caller we won't be returning
     watchdog();
   }
+#endif
 
 
   // EL2 and EL3 are a simple veneer to switch between Secure and Non-Secure
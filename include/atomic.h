@@ -45,35 +45,64 @@ static inline void clear_exclusive()
   asm volatile ( "\n\tclrex" );
 }
 
+static inline void __attribute__(( always_inline ))dsb()
+{
+  asm volatile ( "dsb sy" );
+}
+
+// Ticket locks: the top half of the lock is the next ticket to be issued, the
+// bottom half the ticket being served. Zero is an unclaimed lock.
+// Waiters are served in order, and sleep in wfe between checks; the releasing
+// core's store to the lock clears their exclusive monitors, waking them.
+
+static inline uint32_t volatile *lock_serving( volatile uint64_t *lock )
+{
+  return (uint32_t volatile *) lock; // Little-endian
+}
+
 static inline void claim_lock( volatile uint64_t *lock )
 {
   uint64_t v;
-  uint64_t me;
-
-  // The stack pointer is associated with this core.
-  asm volatile ( "\n\tmov %[me], sp" : [me] "=r" (me) );
 
-  for (;;) {
+  do {
     v = load_exclusive_dword( lock );
-    if (v == 0) {
-      if (store_exclusive_dword( lock, me ))
-        return;
-    }
-    else
-      clear_exclusive();
-    // asm volatile( "wfe" ); maybe?
-  };
+  } while (!store_exclusive_dword( lock, v + (1ull << 32) ));
+
+  uint32_t ticket = v >> 32;
+
+  if ((uint32_t) v != ticket) {
+    asm volatile ( "sevl" );
+    do {
+      asm volatile ( "wfe" );
+    } while (load_exclusive_word( lock_serving( lock ) ) != ticket);
+    clear_exclusive();
+  }
+
+  dsb();
 }
 
-static inline void release_lock( volatile uint64_t *lock )
+static inline bool try_claim_lock( volatile uint64_t *lock )
 {
-  *lock = 0;
-  asm volatile ( "dsb sy\nsevl" );
+  uint64_t v = load_exclusive_dword( lock );
+
+  if ((uint32_t) v != (v >> 32)) {
+    clear_exclusive();
+    return false;
+  }
+
+  if (!store_exclusive_dword( lock, v + (1ull << 32) )) {
+    return false;
+  }
+
+  dsb();
+  return true;
 }
 
-static inline void __attribute__(( always_inline ))dsb()
+static inline void release_lock( volatile uint64_t *lock )
 {
-  asm volatile ( "dsb sy" );
+  dsb();
+  // Only the owner writes this half
+  *lock_serving( lock ) = *lock_serving( lock ) + 1;
 }
 #endif
 #endif
@@ -1,6 +1,7 @@
 /* Copyright (c) 2020 Simon Willcocks */
 
 #include "types.h"
+#include "thread_priorities.h"
 
 typedef uint32_t interface_index;
 
@@ -14,6 +15,14 @@ typedef struct {
 
 typedef struct thread_context thread_context;
 
+// Bucket n counts wake-up latencies below 64 << 2n CNTPCT_EL0 ticks (3.3us, 13us, 53us,
+// ... at 19.2MHz), the last bucket the rest.
+#define WAKE_LATENCY_BUCKETS 8
+
+// Locks with threads waiting for them that a thread can own at once, and still keep the
+// priorities they lend it separately
+#define LENT_PRIORITY_LOCKS 4
+
 struct thread_context {
   thread_context *next;
   thread_context *prev;
@@ -34,11 +43,36 @@ struct thread_context {
   interface_index current_map;
   struct FPContext *fp; // Null if thread not using FP
 
+  uint64_t affinity; // Cores the thread may run on, one bit per core
+  uint64_t last_ran; // CNTPCT_EL0 when the thread last stopped running
+  uint64_t woken_at; // CNTPCT_EL0 when the thread was last woken, zero once it has run
+  uint64_t wake_latency_max; // Longest time from being woken to running, in CNTPCT_EL0 ticks
+  uint32_t wake_latency[WAKE_LATENCY_BUCKETS]; // Histogram of those times, see started_running
+  uint32_t priority; // THREAD_PRIORITY_*, selects the run queue
+  uint32_t base_priority; // As set by the thread; priority may be higher while it owns a lock a more urgent thread waits for
+  // The most urgent priority lent by threads blocked on each lock the thread owns (lock 0
+  // for an unused entry), see lend_priority_to_lock_owner
+  struct { uint64_t lock; uint32_t priority; } lent[LENT_PRIORITY_LOCKS];
+  uint32_t quantum;  // Timer ticks left before giving way to other threads of the same priority
+
   inter_map_call_stack_element *stack_pointer;
   inter_map_call_stack_element *stack_limit;
   inter_map_call_stack_element stack[6]; // Replace with variable size, shortly.
 };
 
+#include "timer_wheel.h"
+
+// Up to 32 kernel events, allocated from the kernel heap for the system driver; a thread
+// can wait for any of the events in a set (see svc_handling.h). Sets whose events have
+// all been destroyed are re-used, never returned to the heap.
+typedef struct event_set {
+  uint64_t volatile lock;   // Ticket lock
+  uint32_t signalled;       // Events signalled with no thread waiting for them
+  uint32_t in_use;          // Bit n set if event n exists
+  thread_context *waiters;  // Blocked threads, in the order they started waiting
+  struct event_set *next_free;
+} event_set;
+
 typedef union Interface {
   struct __attribute__(( packed )) {
     interface_index user;
@@ -71,9 +105,20 @@ struct isambard_core {
   FPContext *fp; // Null if no thread using FP (including thread ending when holding fp)
   thread_context *finished_threads;     // Store of threads that have completed
   thread_context *interrupt_thread;     // Thread that calls interrupt handlers (with interrupts disabled)
-  thread_context *blocked_with_timeout;
+  timer_wheel timeouts;                 // Threads blocked on this core with a timeout
+  uint64_t timer_cval;                  // Last value written to CNTP_CVAL_EL0
+  uint64_t slice_tick;                  // CNTPCT_EL0 of the next time slice tick, zero if none
   struct isambard_core *physical_address;      // Physical address of this struct
   struct isambard_core *low_virtual_address;       // Virtual address of this struct, offset from _start
+  uint32_t volatile incoming;           // Code of the first of a list of threads created by other cores
+  uint64_t volatile runnable_lock;      // Ticket lock, held by this core while in the kernel, or by another core stealing a thread
+  thread_context *run_queues[THREAD_PRIORITY_LEVELS]; // Runnable threads, a circular list per priority
+  uint32_t run_queues_present;          // Bit n set if run_queues[n] isn't empty
+  // Inter-processor interrupts, using QA7 mailbox 0
+  uint64_t volatile ipi_sent;           // CNTPCT_EL0 when the last one was sent to this core
+  uint64_t ipis_received;
+  uint64_t ipi_latency_total;           // In CNTPCT_EL0 ticks
+  uint64_t ipi_latency_max;
   // Virtual machine
   struct {
     uint64_t data[8];
@@ -84,6 +129,6 @@ struct isambard_core {
   // Keep the following at the top of a page (CORE_STACK_SIZE is calculated by build.sh)
   uint64_t __attribute__(( aligned( 16 ) )) stack[CORE_STACK_SIZE];
   struct isambard_core *core; // Pointer to the start of this structure
-  thread_context *runnable; // Never null - at least the idle thread will be in this list
+  thread_context *runnable; // The running thread, at the head of its run queue. Never null
 };
 
@@ -34,7 +34,22 @@ ISAMBARD_INTERFACE( DRIVER_SYSTEM )
 ISAMBARD_INTERFACE( SERVICE )
 ISAMBARD_INTERFACE( PHYSICAL_MEMORY_BLOCK )
 ISAMBARD_INTERFACE( INTERRUPT_HANDLER )
+ISAMBARD_INTERFACE( SERVICE_DIRECTORY )
 #include "interfaces/client/SYSTEM.h"
+#include "interfaces/client/SERVICE_DIRECTORY.h"
+
+// The map's service directory, used by the <INTERFACE>__get_service routines
+extern SERVICE_DIRECTORY service_directory_interface;
+
+static inline SERVICE_DIRECTORY service_directory()
+{
+  if (service_directory_interface.r == 0) {
+    // Every thread asking gets the same interface
+    service_directory_interface.r = SYSTEM__get_service( system, name_code( "Service Directory" ), NUMBER__from_integer_register( 0 ), NUMBER__from_integer_register( 0 ) ).r;
+  }
+  return service_directory_interface;
+}
+
 #include "interfaces/client/DRIVER_SYSTEM.h"
 #include "interfaces/client/PHYSICAL_MEMORY_BLOCK.h"
 
@@ -45,11 +60,42 @@ static inline DRIVER_SYSTEM driver_system() { return DRIVER_SYSTEM__from_integer
 
 extern bool yield();
 
+// Flags for SYSTEM__allocate_memory, in the low bits of the size (which is
+// rounded up to whole pages, anyway).
+#define ALLOCATE_ZEROED 1
+// The block may be moved (copied, and re-mapped at the same virtual address) to
+// make space for large allocations; don't pass its physical address to hardware.
+// While it moves, threads writing to it wait, so don't write to it from an interrupt
+// handler, or keep locks or futexes in it.
+#define ALLOCATE_MOVABLE 2
+#define ALLOCATE_FLAGS 0xf
+
 static inline integer_register create_thread( void *code, uint64_t *stack_top )
 {
   return SYSTEM__create_thread( system, NUMBER__from_integer_register( (integer_register) code ), NUMBER__from_integer_register( (integer_register) stack_top ) ).r;
 }
 
+// Restricts the calling thread to the cores in the mask (one bit per core), which
+// must include the current core. Threads are otherwise free to move to idle cores.
+static inline bool set_affinity( uint64_t cores )
+{
+  return 0 != SYSTEM__set_affinity( system, NUMBER__from_integer_register( cores ) ).r;
+}
+
+// Sets the calling thread's priority, THREAD_PRIORITY_LOWEST to THREAD_PRIORITY_HIGHEST
+// (see isambard_syscalls.h); returns the previous priority, or 0 if out of range.
+// Threads start with their creator's priority.
+static inline integer_register set_priority( unsigned priority )
+{
+  return SYSTEM__set_priority( system, NUMBER__from_integer_register( priority ) ).r;
+}
+
+// Returns 0 if there is no such core
+static inline integer_register create_thread_on_core( unsigned core, void *code, uint64_t *stack_top )
+{
+  return SYSTEM__create_thread_on_core( system, NUMBER__from_integer_register( core ), NUMBER__from_integer_register( (integer_register) code ), NUMBER__from_integer_register( (integer_register) stack_top ) ).r;
+}
+
 /* Accesses to the same peripheral will always arrive and return in-order. It is only when
  * switching from one peripheral to another that data can arrive out-of-order. The simplest way
  * to make sure that data is processed in-order is to place a memory barrier instruction at critical
@@ -90,7 +136,55 @@ static inline integer_register sleep_unless_woken( integer_register timeout )
   return gate_function( 0, timeout );
 }
 
+// Wakes the thread, then waits to be woken, with a single system call; returns as
+// wait_until_woken. For request/response exchanges between threads. A thread of zero
+// wakes nobody.
+extern integer_register wake_and_wait_function( uint32_t thread, integer_register timeout );
+
+static inline integer_register wake_and_wait( uint32_t thread )
+{
+  return wake_and_wait_function( thread, 0 );
+}
+
+// Kernel events (see SYSTEM create_event), which threads of any map holding the event can
+// signal or wait for, without calling another map. A signal wakes the first thread
+// waiting for the event, or is remembered until one waits; a broadcast wakes every
+// waiting thread, and isn't remembered. Interrupt handlers may signal, but not wait.
+// Signals return zero, or -2 if event isn't an event held by the map.
+extern integer_register signal_event( uint32_t event );
+extern integer_register broadcast_event( uint32_t event );
+
+// Waits for any of the events of event's set in the mask (bit n for event n, zero for
+// just event); timeout as for sleep_unless_woken. Returns the events signalled, -1 if
+// it timed out, or -2 if event isn't an event held by the map.
+extern integer_register wait_for_events( uint32_t event, uint32_t mask, integer_register timeout );
+
+static inline void wait_for_event( uint32_t event )
+{
+  wait_for_events( event, 0, 0 );
+}
+
+// Futexes, for condition variables, semaphores, completion flags and the like, keyed by
+// physical address so that they work between maps sharing memory. Only call them when
+// the word says a thread has to wait or may have to be woken.
+//
+// Waits until woken by futex_wake on the same word, unless it no longer contains
+// expected; timeout as for sleep_unless_woken. Returns 0 if woken, 1 if the word didn't
+// contain expected, -1 if it timed out, or -2 if word isn't aligned, or readable.
+extern integer_register futex_wait( uint32_t volatile *word, uint32_t expected, integer_register timeout );
+
+// Wakes up to count threads waiting on the word (zero for all of them), returns the
+// number woken, or -2 as for futex_wait.
+extern integer_register futex_wake( uint32_t volatile *word, uint32_t count );
+
 static inline bool sleep_ms( integer_register timeout )
 {
   if (timeout <= 0) { yield(); return false; } else { return -1ull != gate_function( 0, timeout ); }
 }
+
+// Returns true if woken before timeout. The kernel's timers have a resolution of about
+// 50us (1024 ticks of the system counter).
+static inline bool sleep_us( integer_register timeout )
+{
+  if (timeout <= 0) { yield(); return false; } else { return -1ull != gate_function( 0, timeout | GATE_TIMEOUT_MICROSECONDS ); }
+}
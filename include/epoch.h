@@ -0,0 +1,202 @@
+/* Copyright (c) 2021 Simon Willcocks */
+
+// Epoch based reclamation, for driver data that is read without locks, from any core.
+//
+// Readers bracket their accesses with epoch_read_lock/epoch_read_unlock, which only
+// increment counters (there's no waiting, and no system call). A writer unpublishes an
+// entry, then retires it; it is reclaimed once every reader that might have seen it has
+// left its read section.
+//
+// The counters are in two sets, selected by the parity of the domain's sequence number;
+// each reader counts its entry and exit in the set that was current when it entered.
+// The sequence is only advanced (the current set flipped) once the readers of the other
+// set have all left, so anything retired two advances ago can no longer be seen.
+//
+// Advances are attempted at quiescent points (e.g. the system driver's idle loop, calling
+// epoch_poll), or by a writer that can wait, in epoch_synchronise.
+//
+// Readers may block or be moved to another core within a read section; the counter slot
+// is chosen from the thread code, not the core, so entry and exit are counted in the same
+// place. The slots spread the counters of threads on different cores across cache lines.
+//
+// Include after drivers.h (for this_thread and yield).
+
+#define EPOCH_SLOTS 8
+
+typedef struct epoch_retired epoch_retired;
+
+struct epoch_retired {
+  epoch_retired *next;
+  uint32_t sequence;    // When it was retired
+  void (*reclaim)( epoch_retired *item );
+};
+
+typedef struct {
+  struct {
+    uint64_t volatile entries;
+    uint64_t volatile exits;
+  } __attribute__(( aligned( 64 ) )) counters[2][EPOCH_SLOTS];
+  uint32_t volatile sequence;
+  uint32_t volatile advancing;          // Claimed by the thread trying to advance the sequence
+  epoch_retired *volatile retired;
+} epoch_domain;
+
+static inline void epoch_increment( uint64_t volatile *counter )
+{
+  uint64_t v;
+  uint32_t failed;
+  do {
+    asm volatile ( "ldxr %[v], [%[c]]"
+                   "\n\tadd %[v], %[v], #1"
+                   "\n\tstxr %w[f], %[v], [%[c]]"
+                   : [v] "=&r" (v), [f] "=&r" (failed)
+                   : [c] "r" (counter)
+                   : "memory" );
+  } while (failed);
+}
+
+static inline uint32_t epoch_slot()
+{
+  return (this_thread ^ (this_thread >> 7)) % EPOCH_SLOTS;
+}
+
+// Returns the value to pass to epoch_read_unlock.
+static inline uint32_t epoch_read_lock( epoch_domain *domain )
+{
+  uint32_t set = domain->sequence & 1;
+  epoch_increment( &domain->counters[set][epoch_slot()].entries );
+  asm volatile ( "dmb ish" : : : "memory" ); // Count the entry before reading anything
+  return set;
+}
+
+static inline void epoch_read_unlock( epoch_domain *domain, uint32_t set )
+{
+  asm volatile ( "dmb ish" : : : "memory" ); // Finish reading before counting the exit
+  epoch_increment( &domain->counters[set][epoch_slot()].exits );
+}
+
+// Reads the exits before the entries; every exit counted has had its entry counted,
+// so equal sums mean no reader that had entered before the call is still in the set.
+static inline bool epoch_readers_gone( epoch_domain *domain, uint32_t set )
+{
+  uint64_t exits = 0;
+  uint64_t entries = 0;
+  for (int i = 0; i < EPOCH_SLOTS; i++) {
+    exits += domain->counters[set][i].exits;
+  }
+  asm volatile ( "dmb ish" : : : "memory" );
+  for (int i = 0; i < EPOCH_SLOTS; i++) {
+    entries += domain->counters[set][i].entries;
+  }
+  return entries == exits;
+}
+
+// To be reclaimed, by calling item->reclaim( item ), once no reader can still see it.
+// The item must already be unreachable by new readers.
+static inline void epoch_retire( epoch_domain *domain, epoch_retired *item, void (*reclaim)( epoch_retired *item ) )
+{
+  item->reclaim = reclaim;
+  asm volatile ( "dmb ish" : : : "memory" ); // Unpublished before the sequence is read
+  item->sequence = domain->sequence;
+
+  epoch_retired *head;
+  uint32_t failed;
+  do {
+    asm volatile ( "ldxr %[h], [%[l]]" : [h] "=&r" (head) : [l] "r" (&domain->retired) );
+    item->next = head;
+    asm volatile ( "stxr %w[f], %[i], [%[l]]" : [f] "=&r" (failed) : [i] "r" (item), [l] "r" (&domain->retired) : "memory" );
+  } while (failed);
+}
+
+static inline bool epoch_try_claim_advance( epoch_domain *domain )
+{
+  uint32_t v;
+  uint32_t failed;
+  asm volatile ( "ldxr %w[v], [%[a]]" : [v] "=&r" (v) : [a] "r" (&domain->advancing) );
+  if (v != 0) {
+    asm volatile ( "clrex" );
+    return false;
+  }
+  asm volatile ( "stxr %w[f], %w[t], [%[a]]" : [f] "=&r" (failed) : [t] "r" (this_thread), [a] "r" (&domain->advancing) : "memory" );
+  asm volatile ( "dmb ish" : : : "memory" );
+  return !failed;
+}
+
+// Advance the sequence, if the readers of the set about to become current have left
+static inline void epoch_try_advance( epoch_domain *domain )
+{
+  uint32_t sequence = domain->sequence;
+  if (epoch_readers_gone( domain, (sequence + 1) & 1 )) {
+    asm volatile ( "dmb ish" : : : "memory" );
+    domain->sequence = sequence + 1;
+  }
+}
+
+static inline bool epoch_reclaim_old_items( epoch_domain *domain )
+{
+  bool reclaimed = false;
+  epoch_retired *list;
+  uint32_t failed;
+  do {
+    asm volatile ( "ldxr %[h], [%[l]]" : [h] "=&r" (list) : [l] "r" (&domain->retired) );
+    asm volatile ( "stxr %w[f], xzr, [%[l]]" : [f] "=&r" (failed) : [l] "r" (&domain->retired) : "memory" );
+  } while (failed);
+
+  asm volatile ( "dmb ish" : : : "memory" );
+
+  while (list != 0) {
+    epoch_retired *next = list->next;
+    if (domain->sequence - list->sequence >= 2) {
+      list->reclaim( list );
+      reclaimed = true;
+    }
+    else {
+      // Too recent, put it back
+      epoch_retired *head;
+      do {
+        asm volatile ( "ldxr %[h], [%[l]]" : [h] "=&r" (head) : [l] "r" (&domain->retired) );
+        list->next = head;
+        asm volatile ( "stxr %w[f], %[i], [%[l]]" : [f] "=&r" (failed) : [i] "r" (list), [l] "r" (&domain->retired) : "memory" );
+      } while (failed);
+    }
+    list = next;
+  }
+
+  return reclaimed;
+}
+
+// Never waits; suitable for threads that mustn't block. Returns true if anything was
+// reclaimed.
+static inline bool epoch_poll( epoch_domain *domain )
+{
+  if (domain->retired == 0 || !epoch_try_claim_advance( domain )) {
+    return false;
+  }
+
+  epoch_try_advance( domain );
+  bool result = epoch_reclaim_old_items( domain );
+
+  asm volatile ( "dmb ish" : : : "memory" );
+  domain->advancing = 0;
+
+  return result;
+}
+
+// Waits until every reader that entered before the call has left (yielding to them).
+static inline void epoch_synchronise( epoch_domain *domain )
+{
+  while (!epoch_try_claim_advance( domain )) {
+    yield();
+  }
+
+  uint32_t start = domain->sequence;
+  while (domain->sequence - start < 2) {
+    epoch_try_advance( domain );
+    if (domain->sequence - start < 2) yield();
+  }
+
+  epoch_reclaim_old_items( domain );
+
+  asm volatile ( "dmb ish" : : : "memory" );
+  domain->advancing = 0;
+}
@@ -17,10 +17,12 @@ static inline bool store_exclusive( uint64_t volatile *mem, uint64_t value )
   return !blocked;
 }
 
+#ifndef ISAMBARD_ATOMIC
 static inline void clear_exclusive()
 {
   asm volatile ( "\n\tclrex" );
 }
+#endif
 /*
 static inline void __attribute__(( always_inline )) dsb()
 {
@@ -47,19 +49,13 @@ static void setbit( uint64_t volatile *var, int bit )
 }
 
 #ifdef ISAMBARD_LOCK_WAIT
+#ifndef ISAMBARD_ATOMIC
 static void claim_lock( uint64_t volatile *var )
 {
 	// FIXME: will try to block even if it's the owner of the lock
-  asm ( "\n\tmov x17, %[lock]"
-        "\n\t2:"
-        "\n\tldxr x16, [x17]"
-        "\n\tcbz x16, 0f"
-        "\n\tsvc #"ENSTRING( ISAMBARD_LOCK_WAIT )
-        "\n\tb 1f"
-        "\n0:"
-        "\n\tstxr w16, x18, [x17]"
-        "\n\tcbnz x16, 2b"
-        "\n1:" : : [lock] "r" (var) );
+  // Spins for a while, before waiting in the kernel, see CLAIM_LOCK
+  asm volatile ( "\n\tmov x17, %[lock]"
+        CLAIM_LOCK : : [lock] "r" (var) : "x13", "x14", "x15", "x16", "x17", "memory" );
 }
 
 static void release_lock( uint64_t volatile *var )
@@ -78,3 +74,123 @@ static void release_lock( uint64_t volatile *var )
         "\n1:" : : [lock] "r" (var) );
 }
 #endif
+
+// Reader-writer locks. Readers and writers only enter the kernel when they have to wait,
+// or to let a waiting thread in. Initialise to zero, 16-byte aligned.
+typedef struct {
+  uint64_t state;               // See isambard_syscalls.h
+  uint32_t blocked_readers;     // Only written by the kernel
+  uint32_t blocked_writers;
+} __attribute__(( aligned( 16 ) )) rwlock;
+
+static inline void claim_read_lock( rwlock *lock )
+{
+  asm volatile ( "\n\tmov x17, %[lock]"
+        "\n0:"
+        "\n\tldxr x16, [x17]"
+        "\n\ttst x16, %[busy]"
+        "\n\tb.ne 1f"
+        "\n\tadd x15, x16, %[reader]"
+        "\n\tstxr w16, x15, [x17]"
+        "\n\tcbnz w16, 0b"
+        "\n\tb 2f"
+        "\n1:"
+        "\n\tsvc #"ENSTRING( ISAMBARD_RWLOCK_READ_WAIT )
+        "\n2:"
+        : : [lock] "r" (lock),
+            [busy] "r" (RWLOCK_WRITER_MASK | RWLOCK_WRITERS_BLOCKED | RWLOCK_READERS_BLOCKED),
+            [reader] "r" (RWLOCK_READER)
+        : "x15", "x16", "x17", "memory" );
+}
+
+static inline void release_read_lock( rwlock *lock )
+{
+  // The last reader out lets a blocked writer in
+  asm volatile ( "\n\tmov x17, %[lock]"
+        "\n0:"
+        "\n\tldxr x16, [x17]"
+        "\n\tsub x15, x16, %[reader]"
+        "\n\ttst x15, %[readers]"
+        "\n\tb.ne 1f"
+        "\n\ttst x15, %[writers_blocked]"
+        "\n\tb.ne 3f"
+        "\n1:"
+        "\n\tstxr w16, x15, [x17]"
+        "\n\tcbnz w16, 0b"
+        "\n\tb 2f"
+        "\n3:"
+        "\n\tsvc #"ENSTRING( ISAMBARD_RWLOCK_RELEASE )
+        "\n2:"
+        : : [lock] "r" (lock),
+            [reader] "r" (RWLOCK_READER),
+            [readers] "r" (RWLOCK_READERS_MASK),
+            [writers_blocked] "r" (RWLOCK_WRITERS_BLOCKED)
+        : "x15", "x16", "x17", "memory" );
+}
+
+static inline void claim_write_lock( rwlock *lock )
+{
+  asm volatile ( "\n\tmov x17, %[lock]"
+        "\n0:"
+        "\n\tldxr x16, [x17]"
+        "\n\tcbnz x16, 1f"
+        "\n\tstxr w16, x18, [x17]"
+        "\n\tcbnz w16, 0b"
+        "\n\tb 2f"
+        "\n1:"
+        "\n\tsvc #"ENSTRING( ISAMBARD_RWLOCK_WRITE_WAIT )
+        "\n2:"
+        : : [lock] "r" (lock)
+        : "x16", "x17", "memory" );
+}
+
+static inline void release_write_lock( rwlock *lock )
+{
+  asm volatile ( "\n\tmov x17, %[lock]"
+        "\n0:"
+        "\n\tldxr x16, [x17]"
+        "\n\tcmp x16, x18"
+        "\n\tb.ne 1f"
+        "\n\tstxr w16, xzr, [x17]"
+        "\n\tcbnz w16, 0b"
+        "\n\tb 2f"
+        "\n1:"
+        "\n\tsvc #"ENSTRING( ISAMBARD_RWLOCK_RELEASE )
+        "\n2:"
+        : : [lock] "r" (lock)
+        : "x16", "x17", "memory" );
+}
+#endif
+
+// Sequence locks, for data read often, from any core, and written rarely. Writers must
+// exclude each other by other means; readers never write, but retry if a write overlapped:
+//   do { s = read_seqbegin( &seq ); copy = data; } while (read_seqretry( &seq, s ));
+typedef uint32_t volatile seqlock;
+
+static inline uint32_t read_seqbegin( seqlock *seq )
+{
+  uint32_t result;
+  while (0 != ((result = *seq) & 1)) {
+    asm volatile ( "yield" );
+  }
+  asm volatile ( "dmb ishld" : : : "memory" );
+  return result;
+}
+
+static inline bool read_seqretry( seqlock *seq, uint32_t start )
+{
+  asm volatile ( "dmb ishld" : : : "memory" );
+  return *seq != start;
+}
+
+static inline void write_seqbegin( seqlock *seq )
+{
+  *seq = *seq + 1;
+  asm volatile ( "dmb ishst" : : : "memory" );
+}
+
+static inline void write_seqend( seqlock *seq )
+{
+  asm volatile ( "dmb ishst" : : : "memory" );
+  *seq = *seq + 1;
+}
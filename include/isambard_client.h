@@ -22,12 +22,56 @@ extern Object interface_to_pass_to( Object user, void *handler, void * value );
 
 #define ISAMBARD_STACK( name, size_in_dwords ) uint64_t __attribute__(( aligned( 16 ) )) name[size_in_dwords]
 
+// Adaptive lock claim: a busy lock is spun on (in wfe, woken by the owner's release, or
+// the kernel's event stream) for up to isambard_lock_spin_budget timer ticks, before
+// waiting in the kernel. Claims that succeed while spinning move the budget towards twice
+// the time spent waiting, spinning in vain shrinks it.
+// Clobbers x13-x16, x17 -> lock, x18 = thread code.
+extern uint64_t isambard_lock_spin_budget;
+
+#define ISAMBARD_LOCK_SPIN_INITIAL 192  // Timer ticks, 10us at 19.2MHz
+#define ISAMBARD_LOCK_SPIN_MIN 16
+#define ISAMBARD_LOCK_SPIN_MAX 3840     // 200us
+
 #define CLAIM_LOCK \
         "\n\t2:" \
         "\n\tldxr x16, [x17]" \
         "\n\tcbz x16, 0f" \
+        "\n\tadr x13, isambard_lock_spin_budget" \
+        "\n\tldr x14, [x13]" \
+        "\n\tmrs x15, CNTPCT_EL0" \
+        "\n3:" \
+        "\n\twfe" \
+        "\n4:" \
+        "\n\tldxr x16, [x17]" \
+        "\n\tcbz x16, 5f" \
+        "\n\tmrs x16, CNTPCT_EL0" \
+        "\n\tsub x16, x16, x15" \
+        "\n\tcmp x16, x14" \
+        "\n\tb.lo 3b" \
+        "\n\tsub x14, x14, x14, lsr #3" \
+        "\n\tmov x16, #" ENSTRING( ISAMBARD_LOCK_SPIN_MIN ) \
+        "\n\tcmp x14, x16" \
+        "\n\tcsel x14, x14, x16, hs" \
+        "\n\tstr x14, [x13]" \
         "\n\tsvc #"ENSTRING( ISAMBARD_LOCK_WAIT ) \
         "\n\tb 1f" \
+        "\n5:" \
+        "\n\tstxr w16, x18, [x17]" \
+        "\n\tcbnz w16, 4b" \
+        "\n\tmrs x16, CNTPCT_EL0" \
+        "\n\tsub x16, x16, x15" \
+        "\n\tlsl x16, x16, #1" \
+        "\n\tsub x16, x16, x14" \
+        "\n\tadd x14, x14, x16, asr #3" \
+        "\n\tmov x16, #" ENSTRING( ISAMBARD_LOCK_SPIN_MIN ) \
+        "\n\tcmp x14, x16" \
+        "\n\tcsel x14, x14, x16, hs" \
+        "\n\tmov x16, #" ENSTRING( ISAMBARD_LOCK_SPIN_MAX ) \
+        "\n\tcmp x14, x16" \
+        "\n\tcsel x14, x14, x16, ls" \
+        "\n\tstr x14, [x13]" \
+        "\n\tb 1f" \
         "\n0:" \
         "\n\tstxr w16, x18, [x17]" \
         "\n\tcbnz x16, 2b" \
@@ -165,6 +209,36 @@ extern Object interface_to_pass_to( Object user, void *handler, void * value );
         "\n\tsvc #"ENSTRING( ISAMBARD_RETURN ) \
         "\n\t.previous" );
 
+// As ISAMBARD_PROVIDER_NO_LOCK_AND_SINGLE_STACK, for a stack that belongs to one thread, whose
+// code is in the 32-bit word at owner; calls from any other thread throw an exception
+// before the stack is touched.
+#define ISAMBARD_PROVIDER_NO_LOCK_AND_SINGLE_STACK_FOR_THREAD( type, return_functions, owner, stack, stack_size ) \
+        asm ( "\t.section .text" \
+        "\n"#type"__veneer: adr x17, "#owner \
+        "\n\tldr w17, [x17]" \
+        "\n\tcmp w17, w18" \
+        "\n\tb.eq 0f" \
+        "\n\tldr w0, badly_written_driver_exception" \
+        "\n\tsvc #"ENSTRING( ISAMBARD_EXCEPTION ) \
+        "\n0:\tadr x17, "#stack \
+        "\n\tadd sp, x17, #" ENSTRING( stack_size ) \
+        STACK_CALLEE_SAVED_REGISTERS \
+        "\n\tbl "#type"__call_handler" \
+        "\n\tldr w0, badly_written_driver_exception" \
+        "\n"#type"__exception:" \
+        "\n\tadr x17, "#stack \
+        "\n\tadd sp, x17, #" ENSTRING( stack_size ) "-" ENSTRING( STORED_REGISTER_SPACE ) \
+        RESTORE_CALLEE_SAVED_REGISTERS \
+"\nmov x27, x0" \
+        "\n\tsvc #"ENSTRING( ISAMBARD_EXCEPTION ) \
+        return_functions \
+        "\n"#type"__return:" \
+        "\n\tadr x17, "#stack \
+        "\n\tadd sp, x17, #" ENSTRING( stack_size ) "-" ENSTRING( STORED_REGISTER_SPACE ) \
+        RESTORE_CALLEE_SAVED_REGISTERS \
+        "\n\tsvc #"ENSTRING( ISAMBARD_RETURN ) \
+        "\n\t.previous" );
+
 #define ISAMBARD_PROVIDER_SHARED_LOCK_AND_STACK( type, return_functions, lock, stack, stack_size ) \
         asm ( "\t.section .text" \
         "\n"#type"__veneer: adr x17, "#stack \
@@ -195,53 +269,37 @@ extern Object interface_to_pass_to( Object user, void *handler, void * value );
 // Provides a type, a veneer, type-specific return and exception routines, macros for declaring
 // object values.
 // PER_OBJECT_LOCK_AND_STACK
-//   __storage_unit : struct { uint64_t stack[...]; type object; [padding] uint64_t lock; uint64_t stacktop; }
-//   __veneer: takes object pointer to initialise SP, claims lock, calls _handler
-//   __return: takes unknown parameters, releases lock, and requests an inter-map return
-//   __exception: takes unknown exception code in x0, releases lock, throws an inter-map exception
+//   The object is the address of its storage: (1 << log2_total_size) bytes, aligned to that
+//   size (at most 4096), starting with its lock; the rest is the stack for calls to it. Calls
+//   to different objects run at the same time.
+//   __veneer: claims the object's lock, sets SP to the top of its storage, calls _handler
+//   __return: finds the storage from SP, releases the lock, and requests an inter-map return
+//   __exception: as __return, but throws the exception code in x0
 //
 // It is the responsibility of the code to release all other locks claimed during the call
-// before calling the return or exception routines. (TODO: a variation, where [padding] includes
-// a call-local head of a list of claimed lock variables.
-//   struct safelock { uint64_t lock; struct safelock *next; })
-// The stack has to be aligned to log2_total_size, the bottom word = offset of object.
-// One instruction overhead to store top of stack at top of object storage (for restoration
-// of callee-saved registers).
-// Lock should be 16 bytes before the end of the structure
-
-struct ippolas_veneer_data {
-  uint64_t lock;
-  void *obj;
-};
-
+// before calling the return or exception routines.
 #define ISAMBARD_PROVIDER_PER_OBJECT_LOCK_AND_STACK( type, return_functions, log2_total_size ) \
-        struct type##_storage __attribute__(( aligned( 1 << log2_total_size ) )) { \
-          uint64_t stack[((1 << log2_total_size) - sizeof( type ) - sizeof( ippolas_veneer_data ))/16]; \
-          type object; \
-          ippolas_veneer_data veneer_data; \
-        }; \
         asm ( "\t.section .text" \
-        "\n"#type"__veneer:" \
-        "\n\tmov sp, x0" \
-        "\n\torr x17, sp, #(1 << "#log2_total_size") - 15" \
-        "\n\tstr x0, [x17, #8]" \
+        "\n"#type"__veneer: add x17, x0, #(1 << "#log2_total_size")" \
+        "\n\tmov sp, x17" \
+        "\n\tmov x17, x0" \
         CLAIM_LOCK \
+        STACK_CALLEE_SAVED_REGISTERS \
         "\n\tbl "#type"__call_handler" \
         "\n\tldr w0, badly_written_driver_exception" \
-        \
         "\n"#type"__exception:" \
-        "\n\torr x17, sp, #(1 << "#log2_total_size") - 15" \
-        "\n\tldr x16, [x17, #8]" \
-        "\n\tsub sp, x16, #"ENSTRING( STORED_REGISTER_SPACE ) \
+        "\n\tmov x17, sp" \
+        "\n\tand x17, x17, #-(1 << "#log2_total_size")" \
+        "\n\tadd sp, x17, #(1 << "#log2_total_size") - " ENSTRING( STORED_REGISTER_SPACE ) \
         RESTORE_CALLEE_SAVED_REGISTERS \
         RELEASE_LOCK \
+"\nmov x27, x0" \
         "\n\tsvc #"ENSTRING( ISAMBARD_EXCEPTION ) \
-        \
         return_functions \
         "\n"#type"__return:" \
-        "\n\torr x17, sp, #(1 << "#log2_total_size") - 15" \
-        "\n\tldr x16, [x17, #8]" \
-        "\n\tsub sp, x16, #"ENSTRING( STORED_REGISTER_SPACE ) \
+        "\n\tmov x17, sp" \
+        "\n\tand x17, x17, #-(1 << "#log2_total_size")" \
+        "\n\tadd sp, x17, #(1 << "#log2_total_size") - " ENSTRING( STORED_REGISTER_SPACE ) \
         RESTORE_CALLEE_SAVED_REGISTERS \
         RELEASE_LOCK \
         "\n\tsvc #"ENSTRING( ISAMBARD_RETURN ) \
@@ -1,6 +1,8 @@
 // Copyright (c) Simon Willcocks 2021
 
 #define ISAMBARD_GATE 0xf001
+// Set in a gate timeout (x1) given in microseconds, rather than milliseconds
+#define GATE_TIMEOUT_MICROSECONDS (1ull << 62)
 #define ISAMBARD_DUPLICATE_TO_RETURN 0xf002
 #define ISAMBARD_DUPLICATE_TO_PASS 0xf003
 #define ISAMBARD_INTERFACE_TO_RETURN 0xf004
@@ -23,3 +25,33 @@
 
 // Only usable by system driver:
 #define ISAMBARD_SYSTEM_REQUEST 0xf010
+
+// Reader-writer locks, x17 -> lock, x18 = thread code (see exclusive.h)
+#define ISAMBARD_RWLOCK_READ_WAIT 0xf011
+#define ISAMBARD_RWLOCK_WRITE_WAIT 0xf012
+#define ISAMBARD_RWLOCK_RELEASE 0xf013
+
+// The state dword of a reader-writer lock: the writer's thread code, the number of
+// readers, and flags set by the kernel while threads are blocked. New readers wait
+// while any writer is blocked, so writers aren't starved.
+#define RWLOCK_WRITER_MASK 0xffffffffull
+#define RWLOCK_READER 0x100000000ull
+#define RWLOCK_READERS_MASK 0x3fffffff00000000ull
+#define RWLOCK_WRITERS_BLOCKED (1ull << 62)
+#define RWLOCK_READERS_BLOCKED (1ull << 63)
+
+// x0 = thread to wake, x1 = timeout for the following wait (as ISAMBARD_GATE)
+#define ISAMBARD_WAKE_AND_WAIT 0xf014
+
+// Kernel events (see SYSTEM create_event), x0 = event
+#define ISAMBARD_EVENT_SIGNAL 0xf015
+#define ISAMBARD_EVENT_BROADCAST 0xf016
+// x1 = events of the same set to wait for (zero for just x0), x2 = timeout (as ISAMBARD_GATE)
+#define ISAMBARD_EVENT_WAIT 0xf017
+
+// x0 = address of a word, x1 = value expected in it, x2 = timeout (as ISAMBARD_GATE)
+#define ISAMBARD_FUTEX_WAIT 0xf018
+// x0 = address of a word, x1 = the most threads to wake (zero for all)
+#define ISAMBARD_FUTEX_WAKE 0xf019
+
+#include "thread_priorities.h"
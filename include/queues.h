@@ -0,0 +1,233 @@
+/* Copyright (c) 2021 Simon Willcocks */
+
+// Bounded lock-free ring queues, for handing items between threads (or between an
+// interrupt handler and a thread) in a driver.
+//
+//   DEFINE_SPSC_QUEUE( name, type, capacity )
+//     One producer, one consumer.
+//   DEFINE_MPMC_QUEUE( name, type, capacity )
+//     Any number of producers and consumers (D. Vyukov's bounded MPMC queue, with each
+//     slot's sequence number stored relative to its index, so that zeroed memory is an
+//     empty queue).
+//
+// Both define a type name##_queue, which may be statically allocated, zero initialised,
+// and functions:
+//   bool name##_try_push( name##_queue *q, type item );   // false if full
+//   bool name##_try_pop( name##_queue *q, type *item );   // false if empty
+//   void name##_push( name##_queue *q, type item );       // Waits while full
+//   type name##_pop( name##_queue *q );                   // Waits while empty
+//
+// The waiting functions block on the thread's gate (wait_until_woken); the other side
+// wakes a registered waiter after each push or pop. The try functions never block, and
+// may be used from interrupt handlers. Capacity must be a power of two.
+//
+// Built on load_exclusive, store_exclusive and clear_exclusive from exclusive.h, and
+// the gate functions from drivers.h, which should be included first.
+
+#ifndef BEING_TESTED
+static inline void queue_barrier()
+{
+  asm volatile ( "dmb ish" : : : "memory" );
+}
+#endif
+
+static inline bool queue_compare_and_swap( uint64_t volatile *p, uint64_t old, uint64_t replacement )
+{
+  for (;;) {
+    if (load_exclusive( p ) != old) {
+      clear_exclusive();
+      return false;
+    }
+    if (store_exclusive( p, replacement )) {
+      return true;
+    }
+  }
+}
+
+// At most one waiting consumer and one waiting producer. The waiter registers, then
+// checks again, the other side makes its change, then checks for a waiter; the barriers
+// between ensure at least one of them sees the other.
+#define DEFINE_SPSC_QUEUE( name, type, capacity ) \
+typedef struct { \
+  uint32_t volatile head;                 /* Only written by the producer */ \
+  uint32_t volatile producer_waiting; \
+  uint32_t volatile __attribute__(( aligned( 64 ) )) tail;  /* Only written by the consumer */ \
+  uint32_t volatile consumer_waiting; \
+  type __attribute__(( aligned( 64 ) )) entries[capacity]; \
+} name##_queue; \
+static inline bool name##_try_push( name##_queue *q, type item ) \
+{ \
+  _Static_assert( 0 == ((capacity) & ((capacity) - 1)), "Capacity must be a power of two" ); \
+  uint32_t head = q->head; \
+  if (head - q->tail == (capacity)) return false; \
+  queue_barrier(); /* The consumer has finished with the entry */ \
+  q->entries[head % (capacity)] = item; \
+  queue_barrier(); \
+  q->head = head + 1; \
+  return true; \
+} \
+static inline bool name##_try_pop( name##_queue *q, type *item ) \
+{ \
+  uint32_t tail = q->tail; \
+  if (q->head == tail) return false; \
+  queue_barrier(); /* The producer has finished with the entry */ \
+  *item = q->entries[tail % (capacity)]; \
+  queue_barrier(); \
+  q->tail = tail + 1; \
+  return true; \
+} \
+static inline void name##_wake( uint32_t volatile *waiting ) \
+{ \
+  queue_barrier(); \
+  uint32_t thread = *waiting; \
+  if (thread != 0) { \
+    *waiting = 0; \
+    wake_thread( thread ); \
+  } \
+} \
+static inline void name##_push( name##_queue *q, type item ) \
+{ \
+  while (!name##_try_push( q, item )) { \
+    q->producer_waiting = this_thread; \
+    queue_barrier(); \
+    if (name##_try_push( q, item )) { \
+      q->producer_waiting = 0; \
+      break; \
+    } \
+    wait_until_woken(); \
+  } \
+  name##_wake( &q->consumer_waiting ); \
+} \
+static inline type name##_pop( name##_queue *q ) \
+{ \
+  type result; \
+  while (!name##_try_pop( q, &result )) { \
+    q->consumer_waiting = this_thread; \
+    queue_barrier(); \
+    if (name##_try_pop( q, &result )) { \
+      q->consumer_waiting = 0; \
+      break; \
+    } \
+    wait_until_woken(); \
+  } \
+  name##_wake( &q->producer_waiting ); \
+  return result; \
+}
+
+// Waiting threads register in one of a few slots, and are woken one at a time. If all
+// the slots are taken, a thread polls, sleeping for a millisecond between attempts.
+#define QUEUE_WAITER_SLOTS 4
+
+static inline bool queue_register_waiter( uint64_t volatile *slots )
+{
+  for (int i = 0; i < QUEUE_WAITER_SLOTS; i++) {
+    if (slots[i] == 0 && queue_compare_and_swap( &slots[i], 0, this_thread )) {
+      queue_barrier();
+      return true;
+    }
+  }
+  return false;
+}
+
+// If the slot has already been emptied, a wake is on its way, and will be absorbed by
+// a later wait_until_woken (which will then return early, and retry).
+static inline void queue_deregister_waiter( uint64_t volatile *slots )
+{
+  for (int i = 0; i < QUEUE_WAITER_SLOTS; i++) {
+    if (slots[i] == this_thread && queue_compare_and_swap( &slots[i], this_thread, 0 )) {
+      return;
+    }
+  }
+}
+
+static inline void queue_wake_waiter( uint64_t volatile *slots )
+{
+  queue_barrier();
+  for (int i = 0; i < QUEUE_WAITER_SLOTS; i++) {
+    uint64_t thread = slots[i];
+    if (thread != 0 && queue_compare_and_swap( &slots[i], thread, 0 )) {
+      wake_thread( thread );
+      return;
+    }
+  }
+}
+
+#define DEFINE_MPMC_QUEUE( name, type, capacity ) \
+typedef struct { \
+  uint64_t volatile enqueue_position; \
+  uint64_t volatile waiting_producers[QUEUE_WAITER_SLOTS]; \
+  uint64_t volatile __attribute__(( aligned( 64 ) )) dequeue_position; \
+  uint64_t volatile waiting_consumers[QUEUE_WAITER_SLOTS]; \
+  struct { \
+    uint64_t volatile sequence; /* Relative to the index of the cell */ \
+    type value; \
+  } __attribute__(( aligned( 64 ) )) cells[capacity]; \
+} name##_queue; \
+static inline bool name##_try_push( name##_queue *q, type item ) \
+{ \
+  _Static_assert( 0 == ((capacity) & ((capacity) - 1)), "Capacity must be a power of two" ); \
+  for (;;) { \
+    uint64_t position = q->enqueue_position; \
+    uint64_t index = position % (capacity); \
+    queue_barrier(); \
+    int64_t difference = (int64_t) (q->cells[index].sequence + index - position); \
+    if (difference < 0) return false; /* Full */ \
+    if (difference == 0 \
+     && queue_compare_and_swap( &q->enqueue_position, position, position + 1 )) { \
+      q->cells[index].value = item; \
+      queue_barrier(); \
+      q->cells[index].sequence = position + 1 - index; \
+      return true; \
+    } \
+  } \
+} \
+static inline bool name##_try_pop( name##_queue *q, type *item ) \
+{ \
+  for (;;) { \
+    uint64_t position = q->dequeue_position; \
+    uint64_t index = position % (capacity); \
+    queue_barrier(); \
+    int64_t difference = (int64_t) (q->cells[index].sequence + index - (position + 1)); \
+    if (difference < 0) return false; /* Empty */ \
+    if (difference == 0 \
+     && queue_compare_and_swap( &q->dequeue_position, position, position + 1 )) { \
+      queue_barrier(); \
+      *item = q->cells[index].value; \
+      queue_barrier(); \
+      q->cells[index].sequence = position + (capacity) - index; \
+      return true; \
+    } \
+  } \
+} \
+static inline void name##_push( name##_queue *q, type item ) \
+{ \
+  while (!name##_try_push( q, item )) { \
+    if (!queue_register_waiter( q->waiting_producers )) { \
+      sleep_ms( 1 ); \
+      continue; \
+    } \
+    if (name##_try_push( q, item )) { \
+      queue_deregister_waiter( q->waiting_producers ); \
+      break; \
+    } \
+    wait_until_woken(); \
+  } \
+  queue_wake_waiter( q->waiting_consumers ); \
+} \
+static inline type name##_pop( name##_queue *q ) \
+{ \
+  type result; \
+  while (!name##_try_pop( q, &result )) { \
+    if (!queue_register_waiter( q->waiting_consumers )) { \
+      sleep_ms( 1 ); \
+      continue; \
+    } \
+    if (name##_try_pop( q, &result )) { \
+      queue_deregister_waiter( q->waiting_consumers ); \
+      break; \
+    } \
+    wait_until_woken(); \
+  } \
+  queue_wake_waiter( q->waiting_producers ); \
+  return result; \
+}
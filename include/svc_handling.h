@@ -1,6 +1,102 @@
 #include "isambard_syscalls.h"
 
 #ifndef WITHOUT_GATE
+static const int32_t THREAD_WAITING = -1;
+static const int32_t THREAD_WAITING_FOR_EVENT = -2; // Not woken by wake_thread
+static const int32_t THREAD_WAITING_FOR_MEMORY = -3; // Nor this, see moving_memory
+
+// Starts measuring how long the blocked thread waits to run (see started_running)
+static inline void woken( thread_context *thread )
+{
+  thread->woken_at = counter_now();
+}
+
+// The gate and timer wheel of a thread that blocked on another core belong to
+// that core, and are protected by its runnable_lock.
+//
+// Returns the core, with its runnable_lock claimed instead of this core's; call
+// release_blocked_threads_core when finished with it.
+static inline Core *claim_blocked_threads_core( Core *core, thread_context *thread )
+{
+  Core *core0 = core - core->core_number;
+  Core *target;
+
+  release_runnable_lock( core ); // The other core may be waking one of ours
+
+  for (;;) {
+    uint32_t number = thread->current_core;
+    target = core0 + number;
+    claim_runnable_lock( target );
+    if (thread->current_core == number) break;
+    release_runnable_lock( target ); // Moved while we were waiting for the lock
+  }
+
+  return target;
+}
+
+static inline void release_blocked_threads_core( Core *core, Core *target )
+{
+  if (target != core) {
+    release_runnable_lock( target );
+    claim_runnable_lock( core );
+  }
+}
+
+static inline void wake_thread_on_other_core( Core *core, thread_context *waker, thread_context *thread )
+{
+  Core *target = claim_blocked_threads_core( core, thread );
+
+  bool passed = false;
+
+  if (thread->gate == THREAD_WAITING) {
+    if (waker->current_map != thread->current_map) {
+      BSOD( __LINE__ ); // Threads not blocked in same map
+    }
+    thread->gate = 0;
+    timer_wheel_remove( &target->timeouts, thread );
+    woken( thread );
+    if (target == core) {
+      make_runnable_first( core, thread );
+    }
+    else {
+      pass_thread_to_core( target, thread );
+      passed = true;
+    }
+  }
+  else if (thread->gate >= 0 && thread->gate < 0x7fffffff) { // Not waiting for an event
+    thread->gate++;
+  }
+
+  release_blocked_threads_core( core, target );
+
+  if (passed) {
+    send_ipi( target, IPI_RESCHEDULE );
+  }
+}
+
+// Files a blocked thread in the core's timer wheel, to be released timeout milliseconds
+// (microseconds, with GATE_TIMEOUT_MICROSECONDS set) after now. The wheel must already
+// have been brought up to now.
+static inline void insert_timeout( Core *core, thread_context *thread, integer_register timeout, uint64_t now )
+{
+  uint64_t frequency = counter_frequency();
+
+  uint64_t duration;
+  if (0 != (timeout & GATE_TIMEOUT_MICROSECONDS)) {
+    timeout &= ~GATE_TIMEOUT_MICROSECONDS;
+    if (timeout > 0xffffffffull) timeout = 0xffffffffull; // Over an hour
+    duration = (timeout * (frequency / 1000)) / 1000;
+  }
+  else {
+    if (timeout > 0xffffffffull) timeout = 0xffffffffull; // Over a month
+    duration = timeout * (frequency / 1000);
+  }
+
+  // Rounded up, so it won't time out early
+  uint64_t deadline = (now + duration + (1 << TIMER_WHEEL_SHIFT) - 1) >> TIMER_WHEEL_SHIFT;
+  timer_wheel_insert( &core->timeouts, thread, deadline );
+}
+
 static inline thread_switch handle_svc_gate( Core *core, thread_context *thread )
 {
   thread_switch result = { .then = thread, .now = thread }; // By default, stay with the same thread
@@ -9,24 +105,19 @@ if (thread->partner == 0 && ((thread->spsr & 0x1e) == 8 || 0 != (thread->spsr &
   asm ( "smc 5" );
 }
 
-  static const int32_t THREAD_WAITING = -1;
-
   // Thread parameter x0: 0 = this thread should wait, <>0 thread to wake
-  // Timeout parameter x1: 0 => wait forever, > 0 => wait this many ticks
-  //
-  // Exception to above, thread = interrupt thread => timer tick, but only
-  // from system driver.
+  // Timeout parameter x1: 0 => wait forever, > 0 => wait this many milliseconds
+  // (microseconds, with GATE_TIMEOUT_MICROSECONDS set)
   //
-  // Timeout queue is implemented using x16 and x17; threads are only
-  // put in the queue if they've called wake_until_woken, which means
-  // they're not expecting those registers to be preserved.
+  // Threads waiting with a timeout are kept in the core's timer wheel, using
+  // x1, x16 and x17 (see timer_wheel.h); threads are only put in the wheel
+  // if they've called wait_until_woken, which means they're not expecting
+  // those registers to be preserved.
   //
   // The gate value can be modified by other threads, so a regular
   // thread register cannot be used. (The other thread has to be in
   // the same map as the blocked one.)
   //
-  // Ticks to wait after the previous entry times out will be preserved in x1.
-  //
   // wait_until_woken( timeout ) returns
   // A > 0 if it happened without needing to be blocked (the number of
   //       times it was released)
@@ -36,65 +127,30 @@ if (thread->partner == 0 && ((thread->spsr & 0x1e) == 8 || 0 != (thread->spsr &
   // wake_thread( thread ) returns the previous value of gate
   if (thread->regs[0] == 0) { // Wait for gate, or timer tick
     if (thread == core->interrupt_thread) {
-      if (thread->current_map != system_map_index) {
-        BSOD( __LINE__ ); // FIXME: Throw an exception, an interrupt handler tried to wait!
-      }
-      // Timer tick
-      if (core->blocked_with_timeout != 0) {
-        thread_context *blocked_list_head = core->blocked_with_timeout;
-#ifdef QEMU
-  core->blocked_with_timeout->regs[1] = 1;
-#endif
-        if (--core->blocked_with_timeout->regs[1] == 0) {
-          do {
-            blocked_list_head->regs[0] = -1; // C
-            blocked_list_head->gate = 0; // No longer blocked
-            insert_new_thread_after_old( blocked_list_head, thread );
-            blocked_list_head = (void*) blocked_list_head->regs[17];
-          } while (blocked_list_head != 0 && blocked_list_head->regs[1] == 0);
-          core->blocked_with_timeout = blocked_list_head;
-          if (blocked_list_head != 0) {
-            // Pointer back to the pointer pointing to the head :)
-            blocked_list_head->regs[16] = (integer_register) &core->blocked_with_timeout;
-          }
-        }
-      }
+      BSOD( __LINE__ ); // FIXME: Throw an exception, an interrupt handler tried to wait!
     }
     else if (thread->gate > 0) {
       thread->regs[0] = thread->gate; // A
       thread->gate = 0;
     }
     else {
-      result.now = thread->next;
-      core->runnable = thread->next;
-      remove_thread( thread );
+      make_unrunnable( core, thread );
       thread->gate = THREAD_WAITING;
+      thread->current_core = core->core_number; // Whose timer wheel it's in
       thread->regs[0] = 0; // B (when it finally returns)
+      thread->regs[16] = 0; // Not in the timer wheel
 
-      if (thread->regs[1] > 0) {
-        thread_context **prev = &core->blocked_with_timeout;
-        thread_context *blocked_thread = *prev;
-        integer_register remaining = thread->regs[1];
-        while (blocked_thread != 0 && remaining > blocked_thread->regs[1]) {
-          remaining -= blocked_thread->regs[1];
-          prev = (void*) &blocked_thread->regs[17];
-          blocked_thread = *prev;
-        }
-        thread->regs[1] = remaining;
-        thread->regs[17] = (integer_register) blocked_thread; // Next in list, if any
-        thread->regs[16] = (integer_register) prev; // Pointer to pointer to this thread
-        *prev = thread;
-
-        if (blocked_thread != 0) {
-          // The next thread has remaining fewer ticks to wait, once this thread times out
-          blocked_thread->regs[1] -= remaining;
-          blocked_thread->regs[16] = (integer_register) &thread->regs[17];
-        }
-      }
-      else {
-        thread->regs[16] = 0; // Not in blocked_with_timeout queue
-        thread->regs[17] = 0; // Not in blocked_with_timeout queue
+      integer_register timeout = thread->regs[1];
+      if (timeout > 0) {
+        uint64_t now = counter_now();
+
+        // Brings the wheel up to date, so the new deadline is filed in the right place
+        release_timed_out_threads( core, now );
+
+        insert_timeout( core, thread, timeout, now );
       }
+
+      result.now = highest_priority_thread( core );
     }
   }
   else if (is_real_thread( thread->regs[0] )) {
@@ -102,21 +158,16 @@ if (thread->partner == 0 && ((thread->spsr & 0x1e) == 8 || 0 != (thread->spsr &
 
     thread_context *release_thread = thread_from_code( thread->regs[0] );
 
-    if (release_thread->gate == THREAD_WAITING) {
+    if (release_thread->current_core != core->core_number) {
+      wake_thread_on_other_core( core, thread, release_thread );
+    }
+    else if (release_thread->gate == THREAD_WAITING) {
       if (thread->current_map == release_thread->current_map) { // More checks?
         // Indicates the thread is blocked 
-        insert_new_thread_after_old( release_thread, thread );
+        make_runnable_first( core, release_thread );
         release_thread->gate = 0;
-        if (release_thread->regs[16] != 0) {
-          // The blocked thread is in a timeout list
-          thread_context **prevp = (thread_context **) release_thread->regs[16];
-          thread_context *next = (thread_context *) release_thread->regs[17];
-          *prevp = next;
-          if (next != 0) {
-            next->regs[1] += release_thread->regs[1];
-            next->regs[16] = release_thread->regs[16];
-          }
-        }
+        timer_wheel_remove( &core->timeouts, release_thread );
+        woken( release_thread );
       }
       else {
         invalidate_all_caches();
@@ -124,9 +175,12 @@ if (thread->partner == 0 && ((thread->spsr & 0x1e) == 8 || 0 != (thread->spsr &
         BSOD( __LINE__ ); // Threads not blocked in same map
       }
     }
-    else if (release_thread->gate < 0x7fffffff) { // No more than that, which is certainly an error, or an attack
+    else if (release_thread->gate >= 0 && release_thread->gate < 0x7fffffff) { // No more than that, which is certainly an error, or an attack
       release_thread->gate++;
     }
+
+    // A woken thread more urgent than the waker runs straight away
+    result.now = highest_priority_thread( core );
   }
   else {
     BSOD( __LINE__ ); // Not real thread
@@ -134,6 +188,477 @@ if (thread->partner == 0 && ((thread->spsr & 0x1e) == 8 || 0 != (thread->spsr &
 
   return result;
 }
+
+// wake_thread( x0 ) followed by wait_until_woken( x1 ), in one kernel entry. A thread
+// woken on this core goes ahead of the others of its priority, so, once the caller has
+// blocked, it runs next (unless something more urgent is runnable). With no thread to
+// wake (x0 = 0), it's just the wait.
+static inline thread_switch handle_svc_wake_and_wait( Core *core, thread_context *thread )
+{
+  if (thread->regs[0] != 0) {
+    handle_svc_gate( core, thread );
+  }
+
+  thread->regs[0] = 0;
+  return handle_svc_gate( core, thread );
+}
+
+#ifndef WITHOUT_EVENTS
+// Kernel events, created by the system driver (Isambard_System_Service_Create_Event).
+// An event is an interface provided by the system map, with the handler
+// System_Service_Event; its object is the code of its event_set plus its number in the
+// set. Any map holding the interface can signal it or wait for it directly, without
+// calling another map.
+//
+// Signal wakes the first thread waiting for the event or, if there are none, is
+// remembered until a thread waits for it. Broadcast wakes every thread waiting for it,
+// and isn't remembered.
+//
+// A thread waiting for events is in its set's list of waiters, not in a run queue, with
+// its gate THREAD_WAITING_FOR_EVENT, the events it's waiting for in x2, the code of the
+// set in x3 (zero once a signaller has claimed it), and zero in x4 (see futexes, below).
+// A signaller wakes the threads it has claimed after releasing the set's lock, linked
+// through x2, so that the set's lock is never claimed before a core's runnable_lock.
+
+static inline event_set *event_from_interface( uint32_t map, integer_register index, uint32_t *event )
+{
+  Interface *interface = interface_from_index( index );
+  if (interface == 0
+   || index == 0
+   || interface->free.marker == free_marker
+   || interface->user != map
+   || interface->provider != system_map_index
+   || interface->handler != System_Service_Event) {
+    return 0;
+  }
+
+  *event = interface->object.as_number & 31;
+  return event_set_from_code( interface->object.as_number & ~31ull );
+}
+
+static inline void append_event_waiter( event_set *set, thread_context *thread )
+{
+  thread_context *first = set->waiters;
+  thread->list = 0;
+  if (first == 0) {
+    thread->next = thread;
+    thread->prev = thread;
+    set->waiters = thread;
+  }
+  else {
+    thread->next = first;
+    thread->prev = first->prev;
+    first->prev->next = thread;
+    first->prev = thread;
+  }
+}
+
+static inline void remove_event_waiter( event_set *set, thread_context *thread )
+{
+  if (thread->next == thread) {
+    set->waiters = 0;
+  }
+  else {
+    if (set->waiters == thread) set->waiters = thread->next;
+    thread->next->prev = thread->prev;
+    thread->prev->next = thread->next;
+    thread->next = thread;
+    thread->prev = thread;
+  }
+}
+
+// Called for each thread released by the core's timer wheel; false if a signaller has
+// already claimed the thread, and will wake it.
+static bool event_wait_timed_out( thread_context *thread )
+{
+  if (thread->gate != THREAD_WAITING_FOR_EVENT) return true;
+
+  event_set *set = event_set_from_code( thread->regs[3] );
+  if (set == 0) return false;
+
+  claim_lock( &set->lock );
+  bool waiting = (thread->regs[3] != 0);
+  if (waiting) {
+    remove_event_waiter( set, thread );
+    thread->regs[3] = 0;
+  }
+  release_lock( &set->lock );
+
+  return waiting;
+}
+
+static inline void wake_event_waiter( Core *core, thread_context *thread )
+{
+  Core *target = claim_blocked_threads_core( core, thread );
+
+  if (thread->gate != THREAD_WAITING_FOR_EVENT) {
+    BSOD( __LINE__ ); // Claimed threads stay blocked until woken here
+  }
+
+  thread->gate = 0;
+  timer_wheel_remove( &target->timeouts, thread );
+  woken( thread );
+  if (target == core) {
+    make_runnable_first( core, thread );
+  }
+  else {
+    pass_thread_to_core( target, thread );
+  }
+
+  release_blocked_threads_core( core, target );
+
+  if (target != core) {
+    send_ipi( target, IPI_RESCHEDULE );
+  }
+}
+
+// Unlinks up to count (zero for no limit) of the set's waiters for any of the events in
+// bits, on the futex key (zero for events), giving them result. Call with the set's lock
+// claimed, and wake the threads returned with wake_claimed_waiters after releasing it.
+static inline thread_context *claim_event_waiters( event_set *set, uint32_t bits, uint64_t key, uint32_t count, integer_register result )
+{
+  thread_context *claimed = 0;
+  thread_context **tail = &claimed;
+
+  thread_context *waiter = set->waiters;
+  if (waiter != 0) {
+    thread_context *last = waiter->prev;
+    for (;;) {
+      thread_context *next = waiter->next;
+      bool done = (waiter == last);
+
+      if (0 != (waiter->regs[2] & bits) && waiter->regs[4] == key) {
+        remove_event_waiter( set, waiter );
+        waiter->regs[0] = result;
+        waiter->regs[2] = 0;
+        waiter->regs[3] = 0; // Claimed
+        *tail = waiter;
+        tail = (thread_context **) &waiter->regs[2];
+        if (--count == 0) break;
+      }
+
+      if (done) break;
+      waiter = next;
+    }
+  }
+
+  return claimed;
+}
+
+// Returns the number of threads woken
+static inline uint32_t wake_claimed_waiters( Core *core, thread_context *claimed )
+{
+  uint32_t woken = 0;
+  while (claimed != 0) {
+    thread_context *next = (void*) claimed->regs[2];
+    wake_event_waiter( core, claimed );
+    claimed = next;
+    woken++;
+  }
+  return woken;
+}
+
+// Returned by signal and wait, if x0 isn't an event of the caller's map
+#define NOT_AN_EVENT ((integer_register) -2)
+
+// x0: event. Returns 0, or NOT_AN_EVENT.
+static inline thread_switch handle_svc_event_signal( Core *core, thread_context *thread, bool broadcast )
+{
+  thread_switch result = { .then = thread, .now = thread };
+
+  uint32_t event;
+  event_set *set = event_from_interface( thread->current_map, thread->regs[0], &event );
+  if (set == 0) {
+    thread->regs[0] = NOT_AN_EVENT;
+    return result;
+  }
+  thread->regs[0] = 0;
+
+  uint32_t bit = 1u << event;
+
+  claim_lock( &set->lock );
+
+  thread_context *claimed = claim_event_waiters( set, bit, 0, broadcast ? 0 : 1, bit );
+  if (claimed == 0 && !broadcast) {
+    set->signalled |= bit;
+  }
+
+  release_lock( &set->lock );
+
+  wake_claimed_waiters( core, claimed );
+
+  // A woken thread more urgent than the signaller runs straight away
+  result.now = highest_priority_thread( core );
+
+  return result;
+}
+
+// x0: event, x1: the events of its set to wait for (bit n for event n), zero for just
+// x0, x2: timeout, as for the gate. Returns the events that were signalled, -1 on
+// timeout, or NOT_AN_EVENT. Doesn't preserve x1 to x4, x16 or x17.
+static inline thread_switch handle_svc_event_wait( Core *core, thread_context *thread )
+{
+  thread_switch result = { .then = thread, .now = thread };
+
+  uint32_t event;
+  event_set *set = event_from_interface( thread->current_map, thread->regs[0], &event );
+  if (set == 0) {
+    thread->regs[0] = NOT_AN_EVENT;
+    return result;
+  }
+  if (thread == core->interrupt_thread) {
+    BSOD( __LINE__ ); // FIXME: Throw an exception, an interrupt handler tried to wait!
+  }
+
+  uint32_t events = (thread->regs[1] == 0) ? (1u << event) : (uint32_t) thread->regs[1];
+  integer_register timeout = thread->regs[2];
+
+  // Brings the wheel up to date before claiming the set's lock; releasing threads
+  // waiting for events claims their sets' locks.
+  uint64_t now = counter_now();
+  if (timeout > 0) {
+    release_timed_out_threads( core, now );
+  }
+
+  claim_lock( &set->lock );
+
+  uint32_t signalled = set->signalled & events;
+  if (signalled != 0) {
+    set->signalled &= ~signalled;
+    thread->regs[0] = signalled;
+  }
+  else {
+    make_unrunnable( core, thread );
+    thread->gate = THREAD_WAITING_FOR_EVENT;
+    thread->current_core = core->core_number; // Whose timer wheel it's in
+    thread->regs[16] = 0; // Not in the timer wheel
+    if (timeout > 0) {
+      insert_timeout( core, thread, timeout, now );
+    }
+    thread->regs[2] = events;
+    thread->regs[3] = event_set_code( set );
+    thread->regs[4] = 0; // Not a futex
+    append_event_waiter( set, thread );
+
+    result.now = highest_priority_thread( core );
+  }
+
+  release_lock( &set->lock );
+
+  return result;
+}
+
+// Sets with no events left, for re-use. Only changed by system driver requests, which
+// are made by one core at a time.
+static event_set *free_event_sets = 0;
+
+// Returns the object of a new event, in the same set as the event interface related
+// (of the map), or a new set if related is zero; zero if the set is full, or related
+// isn't an event of the map.
+static integer_register create_event( uint32_t map, integer_register related )
+{
+  if (related == 0) {
+    event_set *set = free_event_sets;
+    if (set != 0) {
+      free_event_sets = set->next_free;
+    }
+    else {
+      set = allocate_heap( sizeof( event_set ) );
+    }
+    set->lock = 0;
+    set->signalled = 0;
+    set->in_use = 1;
+    set->waiters = 0;
+    return event_set_code( set );
+  }
+
+  uint32_t event;
+  event_set *set = event_from_interface( map, related, &event );
+  if (set == 0) {
+    return 0;
+  }
+
+  integer_register result = 0;
+
+  claim_lock( &set->lock );
+  if (set->in_use != ~0u) {
+    uint32_t number = __builtin_ctz( ~set->in_use );
+    set->in_use |= (1u << number);
+    result = event_set_code( set ) | number;
+  }
+  release_lock( &set->lock );
+
+  return result;
+}
+
+// Frees the map's event interface index. The event itself is destroyed once no other
+// interface refers to it, and its set re-used once all its events are destroyed.
+// Returns ~0 if index isn't an event of the map, or threads are waiting for the event
+// (nothing is freed), the object of the event if it was destroyed, or zero.
+// A thread signalling the event while it's destroyed may signal a re-used event instead.
+static integer_register destroy_event( uint32_t map, integer_register index )
+{
+  uint32_t event;
+  event_set *set = event_from_interface( map, index, &event );
+  if (set == 0) {
+    return ~0ull;
+  }
+
+  Interface *interface = interface_from_index( index );
+  integer_register object = interface->object.as_number;
+
+  Interface *ii = interfaces();
+  for (uint32_t i = 1; i < kernel_last_interface; i++) {
+    if (i != index
+     && ii[i].free.marker != free_marker
+     && ii[i].provider == system_map_index
+     && ii[i].handler == System_Service_Event
+     && ii[i].object.as_number == object) {
+      free_interface( interface ); // Another map (or this one) can still use the event
+      return 0;
+    }
+  }
+
+  uint32_t bit = 1u << event;
+
+  claim_lock( &set->lock );
+
+  thread_context *waiter = set->waiters;
+  if (waiter != 0) {
+    do {
+      if (0 != (waiter->regs[2] & bit)) {
+        release_lock( &set->lock );
+        return ~0ull;
+      }
+      waiter = waiter->next;
+    } while (waiter != set->waiters);
+  }
+
+  set->in_use &= ~bit;
+  set->signalled &= ~bit;
+  bool unused = (set->in_use == 0 && set->waiters == 0);
+
+  release_lock( &set->lock );
+
+  free_interface( interface );
+
+  if (unused) {
+    set->next_free = free_event_sets;
+    free_event_sets = set;
+  }
+
+  return object;
+}
+
+#ifndef WITHOUT_FUTEXES
+// Futexes: threads wait until a word of memory has been changed by another, keyed by its
+// physical address, so they work between maps sharing memory. The user code only makes
+// the calls when the word's value says there are (or may be) threads to wake, or when it
+// has to wait.
+//
+// A thread waiting on a futex is in the list of waiters of one of the futex_buckets, as
+// if it were waiting for event 0 of that set, with the physical address in x4.
+#define NUMBER_OF_FUTEX_BUCKETS 64
+static event_set futex_buckets[NUMBER_OF_FUTEX_BUCKETS] = { { 0 } };
+
+static inline event_set *futex_bucket( uint64_t pa )
+{
+  return &futex_buckets[((pa >> 2) ^ (pa >> 12)) % NUMBER_OF_FUTEX_BUCKETS];
+}
+
+// Returned by wait and wake, if x0 isn't a word aligned address the caller can read
+#define NOT_A_FUTEX ((integer_register) -2)
+
+// The physical address of the word, or ~0 if it isn't one
+static inline uint64_t futex_key( Core *core, thread_context *thread, uint64_t address )
+{
+  if (0 != (address & 3)) {
+    return ~0ull;
+  }
+
+  return user_physical_address( core, thread, address );
+}
+
+// x0: address of the word, x1: the value it's expected to contain, x2: timeout, as for
+// the gate. Returns 0 when woken, 1 if the word didn't contain the value, -1 on
+// timeout, or NOT_A_FUTEX. Doesn't preserve x1 to x4, x16 or x17.
+static inline thread_switch handle_svc_futex_wait( Core *core, thread_context *thread )
+{
+  thread_switch result = { .then = thread, .now = thread };
+
+  uint64_t address = thread->regs[0];
+  uint64_t pa = futex_key( core, thread, address );
+  if (pa == ~0ull) {
+    thread->regs[0] = NOT_A_FUTEX;
+    return result;
+  }
+  if (thread == core->interrupt_thread) {
+    BSOD( __LINE__ ); // FIXME: Throw an exception, an interrupt handler tried to wait!
+  }
+
+  integer_register timeout = thread->regs[2];
+
+  // As for events, the wheel is brought up to date before claiming the bucket's lock
+  uint64_t now = counter_now();
+  if (timeout > 0) {
+    release_timed_out_threads( core, now );
+  }
+
+  event_set *bucket = futex_bucket( pa );
+
+  claim_lock( &bucket->lock );
+
+  // The thread's map is loaded, and the word is mapped (by futex_key)
+  if (*(uint32_t volatile *) address != (uint32_t) thread->regs[1]) {
+    thread->regs[0] = 1;
+  }
+  else {
+    make_unrunnable( core, thread );
+    thread->gate = THREAD_WAITING_FOR_EVENT;
+    thread->current_core = core->core_number; // Whose timer wheel it's in
+    thread->regs[16] = 0; // Not in the timer wheel
+    if (timeout > 0) {
+      insert_timeout( core, thread, timeout, now );
+    }
+    thread->regs[2] = 1; // Event 0
+    thread->regs[3] = event_set_code( bucket );
+    thread->regs[4] = pa;
+    append_event_waiter( bucket, thread );
+
+    result.now = highest_priority_thread( core );
+  }
+
+  release_lock( &bucket->lock );
+
+  return result;
+}
+
+// x0: address of the word, x1: the most threads to wake, zero for all of them. Returns
+// the number of threads woken, or NOT_A_FUTEX.
+static inline thread_switch handle_svc_futex_wake( Core *core, thread_context *thread )
+{
+  thread_switch result = { .then = thread, .now = thread };
+
+  uint64_t pa = futex_key( core, thread, thread->regs[0] );
+  if (pa == ~0ull) {
+    thread->regs[0] = NOT_A_FUTEX;
+    return result;
+  }
+  event_set *bucket = futex_bucket( pa );
+
+  claim_lock( &bucket->lock );
+  thread_context *claimed = claim_event_waiters( bucket, 1, pa, thread->regs[1], 0 );
+  release_lock( &bucket->lock );
+
+  thread->regs[0] = wake_claimed_waiters( core, claimed );
+
+  // A woken thread more urgent than the waker runs straight away
+  result.now = highest_priority_thread( core );
+
+  return result;
+}
+#endif
+#endif
 #endif
 
 #ifndef WITHOUT_INTERFACE_CREATION
@@ -222,7 +747,116 @@ static inline thread_switch handle_svc_interface_to_return( Core *core, thread_c
 #endif
 
 #ifndef WITHOUT_LOCKS
-static thread_context *blocked = 0; // A fake list head, for creating blocked lists
+// The threads blocked on a lock form a circular list, linked through next and prev,
+// with the first thread's code in the upper half of the lock. The lists are protected
+// by kernel ticket locks (see atomic.h), chosen by a hash of the lock's address, so that cores blocking
+// on, or releasing, different locks rarely wait for each other.
+// The user lock word itself is only changed with exclusive accesses, or when the
+// owner is releasing it with other threads blocked (when nothing at EL0 can change it).
+
+// FIXME: This is only safe while the lock address is not shared across maps
+// Question: should locks be sharable between maps?
+
+#define NUMBER_OF_LOCK_LIST_SPINLOCKS 64
+static uint64_t volatile lock_list_spinlocks[NUMBER_OF_LOCK_LIST_SPINLOCKS] = { 0 };
+
+static inline uint64_t volatile *lock_list_spinlock( uint64_t lock_address )
+{
+  return &lock_list_spinlocks[((lock_address >> 3) ^ (lock_address >> 11)) % NUMBER_OF_LOCK_LIST_SPINLOCKS];
+}
+
+static inline void append_blocked_thread( thread_context *first, thread_context *thread )
+{
+  thread->next = first;
+  thread->prev = first->prev;
+  first->prev->next = thread;
+  first->prev = thread;
+  thread->list = 0;
+}
+
+// Returns the new first blocked thread, or 0
+static inline thread_context *remove_first_blocked_thread( thread_context *first )
+{
+  thread_context *next = first->next;
+  if (next == first) return 0;
+
+  first->prev->next = next;
+  next->prev = first->prev;
+  first->next = first;
+  first->prev = first;
+  return next;
+}
+
+// A thread blocking on a lock lends its priority, and the rest of its time slice, to the
+// owner, if that's waiting to run on the same core, and the owner runs next instead of
+// waiting its turn behind the other threads. The priority is recorded against the lock,
+// and given back when the owner releases that lock (contended releases are the only ones
+// the kernel sees, and the only way a blocked thread stops waiting); priorities lent for
+// the other locks it owns are kept. Owners on other cores, or not runnable, or virtual
+// machines, are left alone.
+static inline void record_lent_priority( thread_context *owner, uint64_t lock, uint32_t priority )
+{
+  int entry = -1;
+  for (int i = 0; i < LENT_PRIORITY_LOCKS; i++) {
+    if (owner->lent[i].lock == lock) {
+      entry = i;
+      break;
+    }
+    if (entry < 0 && owner->lent[i].lock == 0) {
+      entry = i;
+    }
+  }
+  if (entry < 0) {
+    // Too many locks; the least urgent lender's priority may be given back early
+    entry = 0;
+    for (int i = 1; i < LENT_PRIORITY_LOCKS; i++) {
+      if (owner->lent[i].priority < owner->lent[entry].priority) entry = i;
+    }
+    if (owner->lent[entry].priority >= priority) return;
+  }
+  else if (owner->lent[entry].lock == lock && owner->lent[entry].priority >= priority) {
+    return;
+  }
+  owner->lent[entry].lock = lock;
+  owner->lent[entry].priority = priority;
+}
+
+// Forgets the priorities lent for the lock, returns the priority the thread keeps
+static inline uint32_t give_back_lent_priority( thread_context *thread, uint64_t lock )
+{
+  uint32_t priority = thread->base_priority;
+  for (int i = 0; i < LENT_PRIORITY_LOCKS; i++) {
+    if (thread->lent[i].lock == lock) {
+      thread->lent[i].lock = 0;
+    }
+    else if (thread->lent[i].lock != 0 && thread->lent[i].priority > priority) {
+      priority = thread->lent[i].priority;
+    }
+  }
+  return priority;
+}
+
+static inline void lend_priority_to_lock_owner( Core *core, thread_context *thread, thread_context *owner )
+{
+  if (owner->current_core != core->core_number
+   || owner->list == 0
+   || owner->partner != 0) return;
+
+  uint32_t priority = owner->priority;
+  if (thread->priority > owner->base_priority && thread->priority < THREAD_PRIORITY_INTERRUPT) {
+    record_lent_priority( owner, thread->regs[17], thread->priority );
+    if (thread->priority > priority) {
+      priority = thread->priority;
+    }
+  }
+
+  make_unrunnable( core, owner );
+  owner->priority = priority;
+  make_runnable_as_head( core, owner );
+  if (thread->quantum != 0) {
+    owner->quantum = thread->quantum;
+  }
+}
 
 static inline thread_switch handle_svc_wait_for_lock( Core *core, thread_context *thread )
 {
@@ -237,14 +871,13 @@ static inline thread_switch handle_svc_wait_for_lock( Core *core, thread_context
     BSOD( __LINE__ ); // thread code invalid (releasing).
   }
   else {
-    // FIXME: This is only safe with single core (IRQs disabled, so nothing can write to the lock)
-    // FIXME: This is only safe while maps are not shared across cores
-    // FIXME: This is only safe while the lock address is not shared across maps
-    // Question: should locks be sharable between maps?
-    uint64_t lock_value;
-    uint32_t write_failed;
-    do {
-      write_failed = false; // until proven otherwise
+    uint64_t volatile *spinlock = lock_list_spinlock( x17 );
+    claim_lock( spinlock );
+
+    bool done = false;
+    while (!done) {
+      uint64_t lock_value;
+      uint32_t write_failed;
 
 #ifdef DEBUG_ASM
       lock_value = LDXR( x17 );
@@ -253,25 +886,13 @@ static inline thread_switch handle_svc_wait_for_lock( Core *core, thread_context
 #endif
 
       if (lock_value == 0) {
+        // Released since the thread looked at it, take it
 #ifdef DEBUG_ASM
         write_failed = STXR( x17, x18 );
 #else
         asm volatile ( "stxr %w[w], %[lv], [%[l]]" : [w] "=&r" (write_failed) : [lv] "r" (x18), [l] "r" (x17) );
 #endif
-
-        if (!write_failed && result.now != thread) {
-          // We've blocked ourselves, but the lock owner has released the lock, thinking there was no-one blocked
-          // So, we've now got the lock: unblock the thread.
- 
-          result.now = thread;
-
-          if (blocked != thread) {
-            BSOD( __LINE__ );
-          }
-
-          remove_thread( thread );
-          insert_thread_as_head( &core->runnable, result.now );
-        }
+        done = !write_failed;
       }
       else if (lock_value == x18) {
         // Will this ever happen?
@@ -280,10 +901,9 @@ static inline thread_switch handle_svc_wait_for_lock( Core *core, thread_context
 #else
         asm volatile ( "clrex" ); // We won't be writing to the lock
 #endif
+        done = true;
       }
       else {
-              // What happens on second go through?
-              if (result.now != thread) BSOD( 4 );
         uint32_t blocked_thread_code = lock_value >> 32;
         uint32_t locking_thread_code = 0xffffffff & lock_value;
 
@@ -295,46 +915,51 @@ static inline thread_switch handle_svc_wait_for_lock( Core *core, thread_context
           BSOD( __LINE__ ); // Invalid lock value - throw exception, blocked not zero, not real thread
         }
 
-        result.now = thread->next;
-        core->runnable = result.now;
-        if (result.now == thread) {
-          BSOD( __LINE__ ); // This is the only runnable thread on this core, what happened to the idle thread?
-        }
-        remove_thread( thread ); // No longer runnable
-
         if (blocked_thread_code == 0) {
-          blocked = 0;
-          insert_thread_as_head( &blocked, thread );
-          lock_value |= x18 << 32;
-
+          // The first blocked thread has to be recorded in the lock, which may
+          // have been released at EL0 since it was read.
 #ifdef DEBUG_ASM
-          write_failed = STXR( x17, lock_value );
+          write_failed = STXR( x17, lock_value | (x18 << 32) );
 #else
-          asm volatile ( "stxr %w[w], %[lv], [%[l]]" : [w] "=&r" (write_failed) : [lv] "r" (lock_value), [l] "r" (x17) );
+          asm volatile ( "stxr %w[w], %[lv], [%[l]]" : [w] "=&r" (write_failed) : [lv] "r" (lock_value | (x18 << 32)), [l] "r" (x17) );
 #endif
+          if (write_failed) continue;
         }
         else {
-          // If there is already a (list of) blocked thread(s), the lock value doesn't change.
+          // If there is already a (list of) blocked thread(s), the lock value doesn't change,
+          // and the lock can't be released without taking the spin lock.
 #ifdef DEBUG_ASM
           CLREX();
 #else
           asm volatile ( "clrex" ); // We won't be writing to the lock
 #endif
+        }
+
+        make_unrunnable( core, thread );
+        lend_priority_to_lock_owner( core, thread, thread_from_code( locking_thread_code ) );
+        result.now = highest_priority_thread( core );
+        thread->current_core = core->core_number; // Where it will be released to
 
+        if (blocked_thread_code == 0) {
+          thread->next = thread;
+          thread->prev = thread;
+          thread->list = 0;
+        }
+        else {
           thread_context *first_blocked_thread = thread_from_code( blocked_thread_code );
-          blocked = first_blocked_thread;
 
-          if (first_blocked_thread != 0 && first_blocked_thread->regs[17] != x17) {
+          if (first_blocked_thread->regs[17] != x17) {
             BSOD( __LINE__ ); // Invalid lock value - throw exception, they should all be blocked on the same VA
           }
-          // TODO Should the blocking thread be re-scheduled, if runnable?
-          // The current thread is doing what I've asked it to, so it should bump up the urgency...
-          insert_thread_at_tail( &blocked, thread );
+          append_blocked_thread( first_blocked_thread, thread );
           // TODO deadlock checks? (Return with V set?)
         }
+
+        done = true;
       }
-    } while (write_failed);
-    dsb();
+    }
+
+    release_lock( spinlock );
   }
 
   return result;
@@ -353,12 +978,10 @@ static inline thread_switch handle_svc_release_lock( Core *core, thread_context
     BSOD( __LINE__ ); // thread code invalid (releasing).
   }
   else {
-    // FIXME: This is only safe with single core (IRQs disabled, so nothing can write to the lock)
-    // FIXME: This is only safe while maps are not shared across cores
-    // FIXME: This is only safe while the lock address is not shared across maps
-    // Question: should locks be sharable between maps?
-    // TODO Spin lock for claim and release
-    uint64_t lock_value = *(uint64_t*) x17; // Protected by kernel spin lock
+    uint64_t volatile *spinlock = lock_list_spinlock( x17 );
+    claim_lock( spinlock );
+
+    uint64_t lock_value = *(uint64_t volatile *) x17; // Only this thread can change it, now
 
     if (lock_value == 0) {
       BSOD( __LINE__ ); // Throw exception: trying to unlock unlocked lock
@@ -369,7 +992,9 @@ static inline thread_switch handle_svc_release_lock( Core *core, thread_context
       BSOD( __LINE__ ); // Throw exception: trying to unlock someone else's lock
     }
 
+    // The first blocked thread (if any) becomes the owner
     uint64_t new_value = blocked_thread_code;
+    thread_context *new_owner = 0;
 
     if (blocked_thread_code != 0) {
       // It seems unlikely this will not be the case, but it could happen if there's an
@@ -377,29 +1002,307 @@ static inline thread_switch handle_svc_release_lock( Core *core, thread_context
       if (!is_real_thread( blocked_thread_code )) {
         BSOD( __LINE__ ); // Invalid lock value - throw exception, blocked not zero, not real thread
       }
-      thread_context *first_blocked_thread = thread_from_code( blocked_thread_code );
+      new_owner = thread_from_code( blocked_thread_code );
+
+      thread_context *still_blocked = remove_first_blocked_thread( new_owner );
+      new_value |= (((uint64_t) thread_code( still_blocked )) << 32);
+    }
 
-      if (first_blocked_thread == first_blocked_thread->next) {
-        // Only one blocked thread
+#ifdef DEBUG_ASM
+    STR( x17, new_value );
+#else
+    *(uint64_t volatile *) x17 = new_value;
+#endif
+    release_lock( spinlock );
+
+    uint32_t priority = give_back_lent_priority( thread, x17 );
+    if (thread->priority != priority) {
+      // Give back the priority lent by the threads that were waiting for this lock
+      uint32_t quantum = thread->quantum;
+      make_unrunnable( core, thread );
+      thread->priority = priority;
+      make_runnable_as_head( core, thread );
+      thread->quantum = quantum;
+      result.now = highest_priority_thread( core );
+    }
+
+    if (new_owner != 0) {
+      if (new_owner->current_core == core->core_number) {
+        // The newly unblocked thread gets a go, unless it's less urgent than this one
+        if (new_owner->priority < thread->priority) {
+          make_runnable_first( core, new_owner );
+        }
+        else {
+          make_runnable_as_head( core, new_owner );
+        }
+        result.now = highest_priority_thread( core );
       }
       else {
-        blocked = first_blocked_thread->next; // Fake list head for all blocked threads
+        // Back to the core it blocked on, which may have its FP registers
+        Core *target = core - core->core_number + new_owner->current_core;
+        pass_thread_to_core( target, new_owner );
+        send_ipi( target, IPI_RESCHEDULE );
+      }
+    }
+  }
+
+  return result;
+}
+
+// Reader-writer locks: the state dword (see isambard_syscalls.h) is followed by the codes
+// of the first blocked reader and the first blocked writer, which only the kernel writes,
+// under the same list spin lock as a simple lock at the same address would use.
+// The state may be changed at EL0 at any time, by readers, so it's only ever changed
+// here with exclusive accesses.
 
-        remove_thread( first_blocked_thread ); // Not at head of list
-        new_value |= (((uint64_t) thread_code( blocked )) << 32);
+static inline uint64_t load_exclusive_user( uint64_t address )
+{
+#ifdef DEBUG_ASM
+  return LDXR( address );
+#else
+  uint64_t result;
+  asm volatile ( "ldxr %[v], [%[a]]" : [v] "=r" (result) : [a] "r" (address) );
+  return result;
+#endif
+}
+
+static inline bool store_exclusive_user( uint64_t address, uint64_t value )
+{
+#ifdef DEBUG_ASM
+  return !STXR( address, value );
+#else
+  uint32_t failed;
+  asm volatile ( "stxr %w[w], %[v], [%[a]]" : [w] "=&r" (failed) : [v] "r" (value), [a] "r" (address) : "memory" );
+  return !failed;
+#endif
+}
+
+static inline void clear_exclusive_user()
+{
+#ifdef DEBUG_ASM
+  CLREX();
+#else
+  asm volatile ( "clrex" );
+#endif
+}
+
+static inline bool valid_rwlock( Core *core, thread_context *thread )
+{
+  uint64_t x17 = thread->regs[17];
+  return 0 == (x17 & 15)
+      && address_is_user_writable( core, thread, x17 )
+      && thread_from_code( thread->regs[18] ) == thread;
+}
+
+static inline void block_on_rwlock( Core *core, thread_context *thread, thread_switch *result, uint32_t volatile *first )
+{
+  make_unrunnable( core, thread );
+  result->now = highest_priority_thread( core );
+  thread->current_core = core->core_number; // Where it will be released to
+
+  if (*first == 0) {
+    thread->next = thread;
+    thread->prev = thread;
+    thread->list = 0;
+    *first = thread_code( thread );
+  }
+  else {
+    if (!is_real_thread( *first )) {
+      BSOD( __LINE__ ); // Corrupted lock
+    }
+    thread_context *first_blocked_thread = thread_from_code( *first );
+    if (first_blocked_thread->regs[17] != thread->regs[17]) {
+      BSOD( __LINE__ ); // They should all be blocked on the same VA
+    }
+    append_blocked_thread( first_blocked_thread, thread );
+  }
+}
+
+// A thread unblocked by a thread running on this core runs after it (or before it, if
+// it's more urgent), otherwise it goes back to the core it blocked on.
+static inline void resume_unblocked_thread( Core *core, thread_context *thread, thread_switch *result )
+{
+  if (thread->current_core == core->core_number) {
+    make_runnable_first( core, thread );
+    result->now = highest_priority_thread( core );
+  }
+  else {
+    Core *target = core - core->core_number + thread->current_core;
+    pass_thread_to_core( target, thread );
+    send_ipi( target, IPI_RESCHEDULE );
+  }
+}
+
+static inline thread_switch handle_svc_rwlock_read_wait( Core *core, thread_context *thread )
+{
+  thread_switch result = { .then = thread, .now = thread };
+
+  if (!valid_rwlock( core, thread )) {
+    BSOD( __LINE__ );
+    return result;
+  }
+
+  uint64_t x17 = thread->regs[17];
+  uint32_t volatile *blocked = (uint32_t volatile *) (x17 + 8); // Readers, writers
+  uint64_t volatile *spinlock = lock_list_spinlock( x17 );
+  claim_lock( spinlock );
+
+  for (;;) {
+    uint64_t state = load_exclusive_user( x17 );
+
+    if (0 == (state & (RWLOCK_WRITER_MASK | RWLOCK_WRITERS_BLOCKED))) {
+      if (store_exclusive_user( x17, state + RWLOCK_READER )) break;
+    }
+    else if (0 == (state & RWLOCK_READERS_BLOCKED)) {
+      if (store_exclusive_user( x17, state | RWLOCK_READERS_BLOCKED )) {
+        block_on_rwlock( core, thread, &result, &blocked[0] );
+        break;
+      }
+    }
+    else {
+      clear_exclusive_user();
+      block_on_rwlock( core, thread, &result, &blocked[0] );
+      break;
+    }
+  }
+
+  release_lock( spinlock );
+
+  return result;
+}
+
+static inline thread_switch handle_svc_rwlock_write_wait( Core *core, thread_context *thread )
+{
+  thread_switch result = { .then = thread, .now = thread };
+
+  if (!valid_rwlock( core, thread )) {
+    BSOD( __LINE__ );
+    return result;
+  }
+
+  uint64_t x17 = thread->regs[17];
+  uint64_t x18 = thread->regs[18];
+  uint32_t volatile *blocked = (uint32_t volatile *) (x17 + 8); // Readers, writers
+  uint64_t volatile *spinlock = lock_list_spinlock( x17 );
+  claim_lock( spinlock );
+
+  for (;;) {
+    uint64_t state = load_exclusive_user( x17 );
+
+    if (state == 0) {
+      if (store_exclusive_user( x17, x18 )) break;
+    }
+    else if ((state & RWLOCK_WRITER_MASK) == x18) {
+      clear_exclusive_user();
+      BSOD( __LINE__ ); // Already the writer
+      break;
+    }
+    else if (0 == (state & RWLOCK_WRITERS_BLOCKED)) {
+      if (store_exclusive_user( x17, state | RWLOCK_WRITERS_BLOCKED )) {
+        block_on_rwlock( core, thread, &result, &blocked[1] );
+        break;
       }
+    }
+    else {
+      clear_exclusive_user();
+      block_on_rwlock( core, thread, &result, &blocked[1] );
+      break;
+    }
+  }
+
+  release_lock( spinlock );
 
-      result.now = first_blocked_thread;
+  return result;
+}
 
-      // The newly unblocked thread gets a go...?
-      insert_thread_as_head( &core->runnable, result.now );
+// Called by the writer, or by the last reader when a writer is blocked.
+// A releasing writer lets all the blocked readers in, if there are any, otherwise the
+// first blocked writer. The last reader out lets the first blocked writer in.
+static inline thread_switch handle_svc_rwlock_release( Core *core, thread_context *thread )
+{
+  thread_switch result = { .then = thread, .now = thread };
+
+  if (!valid_rwlock( core, thread )) {
+    BSOD( __LINE__ );
+    return result;
+  }
+
+  uint64_t x17 = thread->regs[17];
+  uint64_t x18 = thread->regs[18];
+  uint32_t volatile *blocked = (uint32_t volatile *) (x17 + 8); // Readers, writers
+  uint64_t volatile *spinlock = lock_list_spinlock( x17 );
+  claim_lock( spinlock );
+
+  thread_context *readers = (blocked[0] == 0) ? 0 : thread_from_code( blocked[0] );
+  thread_context *writer = (blocked[1] == 0) ? 0 : thread_from_code( blocked[1] );
+  thread_context *next_writer = 0;
+  bool wake_readers = false;
+  bool wake_writer = false;
+
+  for (;;) {
+    uint64_t state = load_exclusive_user( x17 );
+    uint64_t new_state;
+
+    wake_readers = false;
+    wake_writer = false;
+
+    if ((state & RWLOCK_WRITER_MASK) == x18) {
+      if (readers != 0) {
+        wake_readers = true;
+        new_state = RWLOCK_READER * count_thread_entries( readers );
+        if (writer != 0) new_state |= RWLOCK_WRITERS_BLOCKED;
+      }
+      else if (writer != 0) {
+        wake_writer = true;
+        new_state = thread_code( writer );
+        if (writer->next != writer) new_state |= RWLOCK_WRITERS_BLOCKED;
+      }
+      else {
+        new_state = 0;
+      }
+    }
+    else if ((state & RWLOCK_WRITER_MASK) == 0 && (state & RWLOCK_READERS_MASK) != 0) {
+      new_state = state - RWLOCK_READER;
+      if (0 == (new_state & RWLOCK_READERS_MASK)) {
+        if (writer != 0) {
+          wake_writer = true;
+          new_state = (new_state & RWLOCK_READERS_BLOCKED) | thread_code( writer );
+          if (writer->next != writer) new_state |= RWLOCK_WRITERS_BLOCKED;
+        }
+        else {
+          new_state &= ~RWLOCK_WRITERS_BLOCKED;
+        }
+      }
     }
+    else {
+      clear_exclusive_user();
+      BSOD( __LINE__ ); // Not holding the lock
+      break;
+    }
+
+    if (store_exclusive_user( x17, new_state )) break;
+  }
 
-    *(uint64_t*) x17 = new_value;
-    dsb();
-    // TODO release kernel lock
+  if (wake_readers) {
+    blocked[0] = 0;
+    thread_context *reader = readers;
+    do {
+      thread_context *next = reader->next;
+      reader->next = reader;
+      reader->prev = reader;
+      resume_unblocked_thread( core, reader, &result );
+      reader = next;
+    } while (reader != readers);
   }
 
+  if (wake_writer) {
+    next_writer = remove_first_blocked_thread( writer );
+    blocked[1] = thread_code( next_writer );
+    resume_unblocked_thread( core, writer, &result );
+  }
+
+  release_lock( spinlock );
+
   return result;
 }
 #endif
@@ -415,6 +1318,18 @@ static inline thread_switch handle_svc( Core *core, thread_context *thread, int
     return result;
   case ISAMBARD_GATE: // gate (wait_until_woken or wake_thread)
     return handle_svc_gate( core, thread );
+  case ISAMBARD_WAKE_AND_WAIT: // wake_thread, then wait_until_woken
+    return handle_svc_wake_and_wait( core, thread );
+  case ISAMBARD_EVENT_SIGNAL:
+    return handle_svc_event_signal( core, thread, false );
+  case ISAMBARD_EVENT_BROADCAST:
+    return handle_svc_event_signal( core, thread, true );
+  case ISAMBARD_EVENT_WAIT:
+    return handle_svc_event_wait( core, thread );
+  case ISAMBARD_FUTEX_WAIT:
+    return handle_svc_futex_wait( core, thread );
+  case ISAMBARD_FUTEX_WAKE:
+    return handle_svc_futex_wake( core, thread );
   case ISAMBARD_DUPLICATE_TO_RETURN:
     return handle_svc_duplicate_to_return( core, thread );
   case ISAMBARD_DUPLICATE_TO_PASS:
@@ -428,18 +1343,19 @@ static inline thread_switch handle_svc( Core *core, thread_context *thread, int
     return handle_svc_wait_for_lock( core, thread );
   case ISAMBARD_LOCK_RELEASE: // Release blocked x17 -> lock variable
     return handle_svc_release_lock( core, thread );
+  case ISAMBARD_RWLOCK_READ_WAIT:
+    return handle_svc_rwlock_read_wait( core, thread );
+  case ISAMBARD_RWLOCK_WRITE_WAIT:
+    return handle_svc_rwlock_write_wait( core, thread );
+  case ISAMBARD_RWLOCK_RELEASE:
+    return handle_svc_rwlock_release( core, thread );
   case ISAMBARD_YIELD: // Well tested
   {
-    // Yield
-    if (thread->next != thread) {
-      // Another thread is runnable, yield returns True, eventually
-      thread->regs[0] = true;
-      result.now = thread->next;
-      core->runnable = result.now;
-    }
-    else {
-      thread->regs[0] = false;
-    }
+    // Yield, to the next thread of the same priority (there's none more urgent)
+    rotate_run_queue( core, thread );
+    result.now = highest_priority_thread( core );
+    // Another thread is runnable, yield returns True, eventually
+    thread->regs[0] = (result.now != thread);
     return result;
   }
   case ISAMBARD_EXCEPTION: // Like return, but one parameter and V flag set in thread
@@ -515,6 +1431,11 @@ asm ( "mov x26, %[r0]\nmov x27, %[r1]\nmov x28, %[r2]\nmov x29, %[r30]\nsmc 4" :
       }
     }
 
+    if (interface->provider == system_map_index
+     && interface->handler == System_Service_Event) {
+      BSOD( __LINE__ ); // Events are used with their own system calls
+    }
+
     if (interface->user != thread->current_map) { asm ( "mov x24, %[u]\n\tmov x25, %[i]\n\tmov x26, %[v]\n\tmov x27, %[p]\n\tmov x28, %[l]" : : [u] "r" (interface->user), [i] "r" (thread->regs[0]), [p] "r" (thread->regs[2]), [v] "r" (thread->regs[1]), [l] "r" (thread->regs[30]) ); BSOD( __LINE__ ); }
 
     thread->regs[0] = interface->object.as_number;
@@ -544,12 +1465,22 @@ asm ( "mov x26, %[r0]\nmov x27, %[r1]\nmov x28, %[r2]\nmov x29, %[r30]\nsmc 4" :
       if (thread->current_map != thread->partner->current_map) BSOD( __LINE__ );
 
       // These members are only affected by secure el1.
+      // The partner takes the thread's place, at the head of its run queue.
       thread->partner->next = thread->next;
       thread->partner->prev = thread->prev;
-      thread->next->prev = thread->partner;
-      thread->prev->next = thread->partner;
+      thread->partner->list = thread->list;
+      if (thread->next == thread) {
+        thread->partner->next = thread->partner;
+        thread->partner->prev = thread->partner;
+      }
+      else {
+        thread->next->prev = thread->partner;
+        thread->prev->next = thread->partner;
+      }
+      *thread->list = thread->partner;
       thread->next = thread;
       thread->prev = thread;
+      thread->list = 0;
       result.now = thread->partner;
       core->runnable = result.now;
 
@@ -29,6 +29,39 @@ enum Isambard_Special_Request {
 , Isambard_System_Service_Thread_Make_Partner
 
 , Isambard_System_Service_Create_Thread
+
+, Isambard_System_Service_Relocate_Memory
+          // Physical memory (copied by the caller) has moved; update all the blocks referring to it,
+          // and let threads waiting to write to it (see Freeze_Memory) carry on
+
+, Isambard_System_Service_Create_Thread_On_Core
+          // As Create_Thread, but the thread will run on the given core
+, Isambard_System_Service_Adopt_Threads
+          // Make threads created for this core by other cores runnable (idle thread only)
+
+, Isambard_System_Service_Steal_Thread
+          // Take a waiting thread from another core's runnable list (idle thread only)
+, Isambard_System_Service_Set_Affinity
+          // Restrict the calling thread to the cores in the mask, which must include the current core
+
+, Isambard_System_Service_IPI_Statistics
+          // Core, statistic (0: number received, 1: total latency, 2: maximum latency, in CNTPCT_EL0 ticks)
+, Isambard_System_Service_Set_Priority
+          // Move the calling thread to another run queue, returns the old priority (0 if not allowed)
+, Isambard_System_Service_Create_Event
+          // A new event, related to an event interface of the caller's map (or 0), returns the object for its interface
+          // (0 if the set is full, or related isn't an event of the map)
+, Isambard_System_Service_Wake_Latency
+          // Thread code, statistic (0 to WAKE_LATENCY_BUCKETS-1: histogram bucket, WAKE_LATENCY_BUCKETS: maximum, in CNTPCT_EL0 ticks)
+, Isambard_System_Service_Release_Memory_Block
+          // Free a PhysicalMemoryBlock interface of the caller's map that's no longer mapped or shared, returns its object (0 if refused)
+, Isambard_System_Service_Release_Interface
+          // Free an interface to another map's object, used by the system map, that it will never use again
+, Isambard_System_Service_Destroy_Event
+          // Free an event interface of the caller's map, returns ~0 if refused, the event's object if it no longer exists, or 0
+, Isambard_System_Service_Freeze_Memory
+          // Start page, page count: make the blocks in the range read-only in every map, until relocated.
+          // Threads writing to them wait.
 };
 
 // Entry points into System driver, known only to the kernel and the driver
@@ -36,7 +69,8 @@ enum {
   System_Enter_Core0 = 0,
   System_Service_ThreadExit = 4,
   System_Service_Map = 8,
-  System_Service_PhysicalMemoryBlock = 12
+  System_Service_PhysicalMemoryBlock = 12,
+  System_Service_Event = 16 // Not an entry point, the kernel refuses calls to events
 };
 
 // The only system service intercepted by the kernel. Needs EL1 to be efficient
@@ -51,7 +85,9 @@ typedef union {
     uint64_t start_page:24;     // Max 16GB memory
     uint64_t page_count:20;     // Max 4GB memory in one block
     uint64_t read_only:1;
-    uint64_t reserved:15;
+    uint64_t account:6;         // Map charged for the memory (system driver use only)
+    uint64_t moving:1;          // Read-only in every map until relocated (kernel use only)
+    uint64_t reserved:8;
     uint64_t is_subpage:1;      // There's another CMB which includes this one
     uint64_t memory_type:3;     // index into MAIR
   };
@@ -0,0 +1,11 @@
+// Copyright (c) Simon Willcocks 2021
+
+// Thread priorities: the highest priority runnable thread on a core runs. The idle
+// thread only runs when nothing else can, and the interrupt thread pre-empts everything;
+// other threads may choose from the levels between (see SYSTEM set_priority).
+#define THREAD_PRIORITY_LEVELS 8
+#define THREAD_PRIORITY_IDLE 0
+#define THREAD_PRIORITY_LOWEST 1
+#define THREAD_PRIORITY_DEFAULT 3
+#define THREAD_PRIORITY_HIGHEST 6
+#define THREAD_PRIORITY_INTERRUPT 7
@@ -0,0 +1,154 @@
+/* Copyright (c) 2021 Simon Willcocks */
+
+// A hierarchical timer wheel, holding the threads blocked on a core's gates with a
+// timeout. Insertion and removal take constant time; expiring is proportional to the
+// number of threads expired (or moved to a lower level), not to the time passed.
+//
+// Level 0 has a slot per wheel tick, each level above has slots 64 times as wide as the
+// one below. A thread waiting until tick x is in the slot of the lowest level whose
+// range covers x; when the time reaches the start of a higher level slot, its threads
+// are moved down (cascaded), so each thread moves at most TIMER_WHEEL_LEVELS-1 times.
+// Deadlines beyond the top level's range are parked in it, and re-filed as it turns.
+//
+// The units of a tick are up to the user (the kernel uses a power of two counter ticks).
+//
+// A thread in the wheel has its deadline in regs[1], a pointer to the pointer to it in
+// regs[16] (zero when not in the wheel) and the next thread in the slot in regs[17]; a
+// thread calling wait_until_woken doesn't expect them to be preserved.
+//
+// Include after the definition of thread_context.
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct {
+  thread_context *slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  uint64_t occupied[TIMER_WHEEL_LEVELS]; // Bit n set if slot[level][n] isn't empty
+  uint64_t now;                          // Every deadline up to this tick has expired
+} timer_wheel;
+
+// The wheel should have been expired up to the current time, first.
+static inline void timer_wheel_insert( timer_wheel *wheel, thread_context *thread, uint64_t deadline )
+{
+  thread->regs[1] = deadline;
+
+  // Where it is filed; the deadline is kept, for when it's cascaded
+  uint64_t limit = (1ull << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1;
+  uint64_t when = deadline;
+  if (when <= wheel->now) when = wheel->now + 1;
+  if (when - wheel->now > limit) when = wheel->now + limit;
+
+  int level = 0;
+  while (when - wheel->now >= (1ull << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+    level++;
+  }
+  uint32_t index = (when >> (level * TIMER_WHEEL_SLOT_BITS)) % TIMER_WHEEL_SLOTS;
+
+  thread_context **slot = &wheel->slot[level][index];
+  thread_context *next = *slot;
+  thread->regs[17] = (integer_register) next;
+  thread->regs[16] = (integer_register) slot;
+  if (next != 0) {
+    next->regs[16] = (integer_register) &thread->regs[17];
+  }
+  *slot = thread;
+  wheel->occupied[level] |= (1ull << index);
+}
+
+static inline void timer_wheel_remove( timer_wheel *wheel, thread_context *thread )
+{
+  if (thread->regs[16] == 0) return; // Not in the wheel
+
+  thread_context **prevp = (thread_context **) thread->regs[16];
+  thread_context *next = (thread_context *) thread->regs[17];
+  *prevp = next;
+  if (next != 0) {
+    next->regs[16] = thread->regs[16];
+  }
+  else if (prevp >= &wheel->slot[0][0] && prevp < &wheel->slot[TIMER_WHEEL_LEVELS][0]) {
+    // It was the only thread in the slot
+    uint32_t n = prevp - &wheel->slot[0][0];
+    wheel->occupied[n / TIMER_WHEEL_SLOTS] &= ~(1ull << (n % TIMER_WHEEL_SLOTS));
+  }
+  thread->regs[16] = 0;
+}
+
+// The tick at which the wheel next has something to do (expire or cascade a slot),
+// ~0 if it's empty.
+static inline uint64_t timer_wheel_next_event( timer_wheel *wheel )
+{
+  uint64_t result = ~0ull;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t occupied = wheel->occupied[level];
+    if (occupied == 0) continue;
+
+    // The first occupied slot after the current one, going round
+    uint32_t shift = level * TIMER_WHEEL_SLOT_BITS;
+    uint32_t start = ((wheel->now >> shift) + 1) % TIMER_WHEEL_SLOTS;
+    uint64_t rotated = (occupied >> start) | (occupied << ((TIMER_WHEEL_SLOTS - start) % TIMER_WHEEL_SLOTS));
+    uint64_t event = ((wheel->now >> shift) + 1 + __builtin_ctzll( rotated )) << shift;
+    if (event < result) result = event;
+  }
+  return result;
+}
+
+// Removes the slot's threads from the wheel, adding them to the list at *tail. Returns
+// the new tail.
+static inline thread_context **timer_wheel_take_slot( timer_wheel *wheel, int level, uint32_t index, thread_context **tail )
+{
+  thread_context *thread = wheel->slot[level][index];
+  wheel->slot[level][index] = 0;
+  wheel->occupied[level] &= ~(1ull << index);
+
+  *tail = thread;
+  while (thread != 0) {
+    thread->regs[16] = 0;
+    tail = (thread_context **) &thread->regs[17];
+    thread = *tail;
+  }
+  return tail;
+}
+
+// Advances the wheel to the tick now, returning the threads whose deadlines have been
+// reached, linked through regs[17].
+static inline thread_context *timer_wheel_expire( timer_wheel *wheel, uint64_t now )
+{
+  thread_context *expired = 0;
+  thread_context **tail = &expired;
+
+  uint64_t event;
+  while ((event = timer_wheel_next_event( wheel )) <= now) {
+    wheel->now = event;
+
+    // Higher levels first, their threads may be due in this tick's level 0 slot
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+      uint32_t shift = level * TIMER_WHEEL_SLOT_BITS;
+      if (0 != (event & ((1ull << shift) - 1))) continue;
+
+      uint32_t index = (event >> shift) % TIMER_WHEEL_SLOTS;
+      if (0 == (wheel->occupied[level] & (1ull << index))) continue;
+
+      thread_context *cascade = 0;
+      timer_wheel_take_slot( wheel, level, index, &cascade );
+      while (cascade != 0) {
+        thread_context *next = (thread_context *) cascade->regs[17];
+        if (cascade->regs[1] <= event) {
+          *tail = cascade;
+          cascade->regs[17] = 0;
+          tail = (thread_context **) &cascade->regs[17];
+        }
+        else {
+          timer_wheel_insert( wheel, cascade, cascade->regs[1] );
+        }
+        cascade = next;
+      }
+    }
+
+    tail = timer_wheel_take_slot( wheel, 0, event % TIMER_WHEEL_SLOTS, tail );
+  }
+
+  if (now > wheel->now) wheel->now = now;
+
+  return expired;
+}
@@ -123,6 +123,14 @@ void initialise_shared_isambard_kernel_tables( Core *core0, int cores )
     entry = Aarch64_VMSA_write_back_memory( entry );
     kernel_tt_l3[i] = entry;
   }
+
+  // Finally, the QA7 local interrupt controller, in the last 2MB, for the core mailboxes
+  Aarch64_VMSA_entry qa7 = Aarch64_VMSA_block_at( 0x40000000 );
+  qa7 = Aarch64_VMSA_priv_rw_( qa7, 1 );
+  qa7.access_flag = 1;
+  qa7 = Aarch64_VMSA_global( qa7 );
+  qa7 = Aarch64_VMSA_device_memory( qa7 );
+  kernel_tt_l2[15] = qa7;
 }
 
 void *himem_address( void *offset )
@@ -20,6 +20,10 @@ static const unsigned number_of_system_maps = 2;
 
 #include "kernel_translation_tables.h"
 
+#include "qa7.h"
+// Mapped by initialise_shared_isambard_kernel_tables
+static typeof( device_pages.QA7 ) *const qa7 = (void*) (himem_offset + (15 << 21));
+
 void VBAR_SEL1();
 
 // A place to store the secure mode registers,
@@ -56,12 +60,184 @@ static inline thread_context *thread_from_code( uint32_t c )
   return (thread_context*) (start_address() + c);
 }
 
+// Event sets are allocated from the heap, so their codes are multiples of 32
+static inline uint32_t event_set_code( event_set *s )
+{
+  return ((uint8_t*) s) - start_address();
+}
+
+static inline event_set *event_set_from_code( uint32_t c )
+{
+  if (c == 0) return 0;
+  return (event_set*) (start_address() + c);
+}
+
 #include "doubly_linked_lists.h"
 DEFINE_DOUBLE_LINKED_LIST( thread, thread_context, next, prev, list );
 
 #define BSOD_TOSTRING( n ) #n
 #define BSOD( n ) asm ( "0: smc " BSOD_TOSTRING( n ) "\n\tb 0b" );
 
+// Each core's runnable threads are in one list per priority, with a bit set in
+// run_queues_present for each list that isn't empty, so the highest priority runnable
+// thread is found with a CLZ. The running thread is always at the head of its list;
+// threads of equal priority take turns when it yields.
+
+// Milliseconds that a thread may run before the next thread of the same priority gets a
+// turn; zero to only switch when threads yield or block. The core's timer only ticks
+// (every millisecond) while other threads are waiting to run; the tick also wakes an idle
+// core to steal one of them, including those waiting behind a more urgent thread. With n
+// CPU-bound threads of the same priority, each waits no more than n-1 time slices for its turn.
+#ifndef TIME_SLICE_TICKS
+#define TIME_SLICE_TICKS 10
+#endif
+
+static inline void make_runnable( Core *core, thread_context *thread )
+{
+  thread->quantum = TIME_SLICE_TICKS;
+  insert_thread_at_tail( &core->run_queues[thread->priority], thread );
+  core->run_queues_present |= (1 << thread->priority);
+}
+
+static inline void make_runnable_as_head( Core *core, thread_context *thread )
+{
+  thread->quantum = TIME_SLICE_TICKS;
+  insert_thread_as_head( &core->run_queues[thread->priority], thread );
+  core->run_queues_present |= (1 << thread->priority);
+}
+
+// Runs before any thread of the same priority except the running one. While the
+// interrupt thread is running, that puts a woken thread ahead of the interrupted one.
+static inline void make_runnable_first( Core *core, thread_context *thread )
+{
+  thread_context *head = core->run_queues[thread->priority];
+  if (head != 0 && head == core->runnable) {
+    insert_new_thread_after_old( thread, head );
+  }
+  else {
+    make_runnable_as_head( core, thread );
+  }
+}
+
+static inline void make_unrunnable( Core *core, thread_context *thread )
+{
+  thread_context **queue = thread->list;
+  remove_thread( thread );
+  thread->list = 0; // Not runnable
+  if (*queue == 0) {
+    core->run_queues_present &= ~(1 << thread->priority);
+  }
+}
+
+// True if a thread other than the running one is waiting to run on this core
+static inline bool others_waiting( Core *core, thread_context *running )
+{
+  uint32_t others = core->run_queues_present & ~(1 << running->priority) & ~(1 << THREAD_PRIORITY_IDLE);
+  return running->next != running || others != 0;
+}
+
+static inline thread_context *highest_priority_thread( Core *core )
+{
+  uint32_t present = core->run_queues_present;
+  if (present == 0) {
+    BSOD( __LINE__ ); // What happened to the idle thread?
+  }
+  uint32_t leading_zeros;
+  asm ( "clz %w[z], %w[p]" : [z] "=r" (leading_zeros) : [p] "r" (present) );
+  return core->run_queues[31 - leading_zeros];
+}
+
+// The running thread goes to the back of its queue
+static inline void rotate_run_queue( Core *core, thread_context *thread )
+{
+  thread->quantum = TIME_SLICE_TICKS;
+  core->run_queues[thread->priority] = thread->next;
+}
+
+// Called on each time slice tick, for the interrupted thread. A thread that has used up
+// its time slice goes to the back of its queue (it may not be the head, if the interrupt
+// has released other threads). Returns true if it did.
+static inline bool time_slice_tick( Core *core, thread_context *thread )
+{
+  if (TIME_SLICE_TICKS == 0 || thread->list == 0) return false;
+
+  if (--thread->quantum == 0) {
+    make_unrunnable( core, thread );
+    make_runnable( core, thread );
+    return true;
+  }
+  return false;
+}
+
+// Gate timeouts are kept in a timer wheel per core, and the core's timer is programmed
+// (one-shot) for the wheel's next event or the next time slice tick, whichever is sooner.
+// A core with nothing to time takes no timer interrupts.
+//
+// A wheel tick is 1 << TIMER_WHEEL_SHIFT counter ticks (53us at 19.2MHz).
+#define TIMER_WHEEL_SHIFT 10
+
+static inline uint64_t counter_now()
+{
+  uint64_t now;
+  asm volatile ( "mrs %[t], CNTPCT_EL0" : [t] "=r" (now) );
+  return now;
+}
+
+static inline uint64_t counter_frequency()
+{
+  uint64_t frequency;
+  asm ( "mrs %[f], CNTFRQ_EL0" : [f] "=r" (frequency) );
+  return frequency;
+}
+
+// Kernel events, see svc_handling.h
+static bool event_wait_timed_out( thread_context *thread );
+static integer_register create_event( uint32_t map, integer_register related );
+static integer_register destroy_event( uint32_t map, integer_register index );
+
+// Memory being moved by the system driver is read-only in every map, from
+// Isambard_System_Service_Freeze_Memory until Isambard_System_Service_Relocate_Memory.
+// Threads writing to it wait in this list (with the gate THREAD_WAITING_FOR_MEMORY) then
+// retry the write, so its owners can't change it while it's copied.
+static struct {
+  uint64_t volatile lock;
+  thread_context *waiters;
+} moving_memory = { 0, 0 };
+
+static void wake_moving_memory_waiters( Core *core, thread_context *waiters );
+
+static void release_timed_out_threads( Core *core, uint64_t now )
+{
+  thread_context *thread = timer_wheel_expire( &core->timeouts, now >> TIMER_WHEEL_SHIFT );
+  while (thread != 0) {
+    thread_context *next = (void*) thread->regs[17];
+    if (event_wait_timed_out( thread )) {
+      thread->regs[0] = -1; // Timed out
+      thread->gate = 0; // No longer blocked
+      make_runnable_as_head( core, thread );
+    }
+    thread = next;
+  }
+}
+
+// On the way out of the kernel, once core->runnable is the thread about to run.
+static inline void update_core_timer( Core *core )
+{
+  uint64_t cval = timer_wheel_next_event( &core->timeouts );
+  if (cval != ~0ull) cval = cval << TIMER_WHEEL_SHIFT;
+
+  thread_context *running = core->runnable;
+  if (core->slice_tick == 0 && others_waiting( core, running )) {
+    core->slice_tick = counter_now() + counter_frequency() / 1000;
+  }
+  if (core->slice_tick != 0 && core->slice_tick < cval) cval = core->slice_tick;
+
+  if (cval != core->timer_cval) {
+    core->timer_cval = cval;
+    asm volatile ( "msr CNTP_CVAL_EL0, %[cval]" : : [cval] "r" (cval) );
+  }
+}
+
 static inline
 uint32_t __attribute__(( always_inline )) core_number()
 {
@@ -314,9 +490,11 @@ static void free_interface( Interface *i )
 {
   i->free.marker = free_marker;
   do {
-    do {
+    for (;;) {
       i->free.next = load_exclusive_word( &kernel_free_interface );
-    } while (i->free.next == 0);
+      if (i->free.next != 0) break;
+      asm volatile ( "wfe" ); // Until the refilling core stores to the list head
+    }
   } while (!store_exclusive_word( &kernel_free_interface, index_from_interface( i ) ));
 }
 
@@ -339,10 +517,13 @@ static Interface *obtain_interface()
   Interface *result;
   interface_index head;
   do {
-    do {
+    for (;;) {
       head = load_exclusive_word( &kernel_free_interface );
-      if (head == 0) { clear_exclusive(); }
-    } while (head == 0); // The core that wrote 0 will be allocating more interfaces
+      if (head != 0) break;
+      // The core that wrote 0 will be allocating more interfaces, its store to
+      // the list head will clear this core's monitor and wake it.
+      asm volatile ( "wfe" );
+    }
     result = interface_from_index( head );
   } while (!store_exclusive_word( &kernel_free_interface, result->free.next ));
 
@@ -373,6 +554,20 @@ void initialise_new_thread( thread_context *thread )
   thread->spsr = 0;
   thread->gate = 0;
   thread->fp = 0;
+  thread->current_core = 0; // Set by the caller, if it's going to run elsewhere
+  thread->affinity = ~0ull;
+  thread->last_ran = 0;
+  thread->woken_at = 0;
+  thread->wake_latency_max = 0;
+  for (int i = 0; i < WAKE_LATENCY_BUCKETS; i++) {
+    thread->wake_latency[i] = 0;
+  }
+  thread->priority = THREAD_PRIORITY_DEFAULT;
+  thread->base_priority = THREAD_PRIORITY_DEFAULT;
+  for (int i = 0; i < LENT_PRIORITY_LOCKS; i++) {
+    thread->lent[i].lock = 0;
+  }
+  thread->quantum = TIME_SLICE_TICKS;
   thread->regs[18] = thread_code( thread );
 
   // No particularly good reason for a downward growing stack...
@@ -683,6 +878,9 @@ static bool find_and_map_memory( Core *core, thread_context *thread, uint64_t fa
 
       entry = with_physical_memory_attrs( entry, cmb );
       entry = with_virtual_memory_attrs( entry, vmb );
+      if (cmb.moving) {
+        entry.read_only = 1;
+      }
       *entry_location = entry;
 
       return true;
@@ -794,7 +992,9 @@ void initialise_driver_maps( Core *core0, integer_register first_free_page )
       thread->regs[0] = system_map_index;
       thread->regs[1] = memory_allocator_map_index;
       thread->regs[2] = n;
+      thread->current_core = n;
       thread->regs[3] = first_free_page;
+      make_runnable( &core0[n], thread );
       core0[n].runnable = thread;
     }
   }
@@ -858,7 +1058,7 @@ void initialise_driver_maps( Core *core0, integer_register first_free_page )
     thread->spsr = 0x0;
     thread->regs[0] = index_from_interface( map_interface );
 
-    insert_thread_at_tail( &core0->runnable, thread );
+    make_runnable( core0, thread );
   }
 }
 
@@ -871,7 +1071,10 @@ void __attribute__(( noreturn )) enter_secure_el1_himem( Core *core )
   secure_registers.vbar_el1 = (uint64_t) VBAR_SEL1;
 
   // ARM DDI 0487C.a D10-2942
-  asm volatile ( "\tmsr CNTKCTL_EL1, %[bits]\n" : : [bits] "r" (0b1100000011) );
+  // Also enables the event stream, waking wfe every 64 ticks (bit 5 of the counter),
+  // so spinning on a lock at EL0 can't sleep for long past its budget.
+  // EL0 may read the physical counter, but not program the timer, that's the kernel's.
+  asm volatile ( "\tmsr CNTKCTL_EL1, %[bits]\n" : : [bits] "r" (0b0101010111) );
 
   core->core = core;
 
@@ -899,6 +1102,16 @@ void __attribute__(( noreturn )) enter_secure_el1_himem( Core *core )
     while (core->runnable == 0) { asm( "dsb sy\nwfe" ); }
   }
 
+  qa7->Core_write_clear[core->core_number].Mailbox[0] = 0xffffffff;
+  qa7->Core_Mailboxes_Interrupt_control[core->core_number] = 1; // Mailbox 0 IRQ
+
+  // The timer is off until there's something to time (see update_core_timer)
+  core->timeouts.now = counter_now() >> TIMER_WHEEL_SHIFT;
+  core->timer_cval = ~0ull;
+  asm volatile ( "msr CNTP_CVAL_EL0, %[cval]" : : [cval] "r" (core->timer_cval) );
+  asm volatile ( "msr CNTP_CTL_EL0, %[ctl]" : : [ctl] "r" (1) ); // Enabled, interrupt not masked
+  qa7->Core_timers_Interrupt_control[core->core_number] = 2; // nCNTPNSIRQ IRQ
+
   core->loaded_map = illegal_interface_index;
   //asm volatile ( "mov %0, %0\n\tmov %1, %1\n\tmov %2, %2\n\twfi" : : "r" (core), "r" (core->runnable), "r" (core->runnable->current_map) );
   load_this_map( core, core->runnable->current_map );
@@ -944,6 +1157,205 @@ void __attribute__(( noreturn )) isambard_secure_el1( Core *phys_core, int numbe
   __builtin_unreachable();
 }
 
+// Threads created on one core to run on another are pushed onto the target core's
+// incoming list (linked through next), which only the target core empties.
+static void pass_thread_to_core( Core *target, thread_context *thread )
+{
+  uint32_t head;
+  do {
+    head = load_exclusive_word( &target->incoming );
+    thread->next = thread_from_code( head );
+  } while (!store_exclusive_word( &target->incoming, thread_code( thread ) ));
+}
+
+// Each core holds its own runnable_lock while in the kernel, so another core holding
+// it can be sure the list head is running at EL0, and leave it alone.
+static inline bool try_claim_runnable_lock( Core *core )
+{
+  return try_claim_lock( &core->runnable_lock );
+}
+
+static inline void claim_runnable_lock( Core *core )
+{
+  claim_lock( &core->runnable_lock );
+}
+
+static inline void release_runnable_lock( Core *core )
+{
+  release_lock( &core->runnable_lock );
+}
+
+// A thread that stopped running more recently than this is assumed to have its
+// working set in the other core's cache (and will have finished storing its
+// registers), so is left where it is.
+#define MIGRATION_COST_MICROSECONDS 500
+
+static bool may_migrate( thread_context *thread, Core *from, Core *to, uint64_t now, uint64_t cost )
+{
+  return thread != from->runnable                       // Running
+      && thread != from->interrupt_thread
+      && thread->current_map != system_map_index        // Including the idle thread
+      && thread->current_map != memory_allocator_map_index
+      && thread->partner == 0                           // Virtual machines stay put
+      && thread->fp == 0                                // FP registers may be loaded on the other core
+      && 0 != (thread->affinity & (1ull << to->core_number))
+      && now - thread->last_ran >= cost;
+}
+
+// Take the last thread to run from another core's runnable list.
+static bool steal_thread( Core *core )
+{
+  uint64_t now;
+  uint64_t frequency;
+  asm volatile ( "mrs %[t], CNTPCT_EL0" : [t] "=r" (now) );
+  asm ( "mrs %[f], CNTFRQ_EL0" : [f] "=r" (frequency) );
+  uint64_t cost = (frequency / 1000000) * MIGRATION_COST_MICROSECONDS;
+
+  Core *core0 = core - core->core_number;
+
+  for (uint32_t i = 1; i < 64; i++) {
+    uint32_t number = (core->core_number + i) % 64;
+    if (0 == (standard_isambard_cores & (1ull << number))) continue;
+
+    Core *victim = core0 + number;
+    if (!try_claim_runnable_lock( victim )) continue; // Busy, try the next one
+
+    // Highest priority first, then from the back of its queue
+    thread_context *found = 0;
+    for (int priority = THREAD_PRIORITY_LEVELS - 1; priority > THREAD_PRIORITY_IDLE && found == 0; priority--) {
+      thread_context *head = victim->run_queues[priority];
+      if (head != 0) {
+        thread_context *thread = head->prev;
+        do {
+          if (may_migrate( thread, victim, core, now, cost )) {
+            found = thread;
+          }
+          thread = thread->prev;
+        } while (thread != head->prev && found == 0);
+      }
+    }
+    if (found != 0) {
+      make_unrunnable( victim, found );
+    }
+
+    release_runnable_lock( victim );
+
+    if (found != 0) {
+      found->current_core = core->core_number;
+      make_runnable( core, found );
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Inter-processor interrupts, reasons are bits in mailbox 0 of the target core
+enum { IPI_RESCHEDULE = 1,           // Threads have been passed to the core
+       IPI_TRANSLATION_TABLES = 2 }; // Memory has moved, rebuild the translation tables
+
+static void send_ipi( Core *target, uint32_t reasons )
+{
+  uint64_t now;
+  asm volatile ( "mrs %[t], CNTPCT_EL0" : [t] "=r" (now) );
+  target->ipi_sent = now;
+  dsb();
+  qa7->Core_write_set[target->core_number].Mailbox[0] = reasons;
+}
+
+static inline uint32_t pending_ipis( Core *target )
+{
+  return qa7->Core_write_clear[target->core_number].Mailbox[0];
+}
+
+static bool adopt_incoming_threads( Core *core )
+{
+  uint32_t head;
+  do {
+    head = load_exclusive_word( &core->incoming );
+    if (head == 0) { clear_exclusive(); return false; }
+  } while (!store_exclusive_word( &core->incoming, 0 ));
+
+  thread_context *thread = thread_from_code( head );
+  while (thread != 0) {
+    thread_context *next = thread->next;
+    thread->current_core = core->core_number;
+    make_runnable( core, thread );
+    thread = next;
+  }
+
+  return true;
+}
+
+// Other cores rebuild their translation tables from the updated memory blocks,
+// and this core waits until they have (before the old memory can be re-used).
+static void shoot_down_translation_tables( Core *core )
+{
+  Core *core0 = core - core->core_number;
+
+  release_runnable_lock( core ); // A target may be waiting for it
+
+  for (uint32_t number = 0; number < 64; number++) {
+    if (number != core->core_number && 0 != (standard_isambard_cores & (1ull << number))) {
+      send_ipi( core0 + number, IPI_TRANSLATION_TABLES );
+    }
+  }
+  for (uint32_t number = 0; number < 64; number++) {
+    if (number != core->core_number && 0 != (standard_isambard_cores & (1ull << number))) {
+      while (0 != (pending_ipis( core0 + number ) & IPI_TRANSLATION_TABLES)) {}
+    }
+  }
+
+  claim_runnable_lock( core );
+}
+
+// A PhysicalMemoryBlock interface may only be released by the map using it, when no
+// map has it mapped, and no other interface (a duplicate or subpage) refers to its memory.
+static bool memory_block_releasable( Interface *block, interface_index map )
+{
+  if (block->free.marker == free_marker
+   || block->provider != system_map_index
+   || block->handler != System_Service_PhysicalMemoryBlock
+   || block->user != map) {
+    return false;
+  }
+
+  ContiguousMemoryBlock cmb = { .r = block->object.as_number };
+  uint64_t start = cmb.start_page;
+  uint64_t end = start + cmb.page_count;
+  uint32_t index = index_from_interface( block );
+
+  Interface *ii = interfaces();
+  for (uint32_t i = 1; i < kernel_last_interface; i++) {
+    if (i == index || i == system_map_index || ii[i].free.marker == free_marker
+     || ii[i].provider != system_map_index) continue;
+
+    if (ii[i].handler == System_Service_PhysicalMemoryBlock) {
+      ContiguousMemoryBlock other = { .r = ii[i].object.as_number };
+      uint64_t other_start = other.start_page;
+      if (other_start < end && other_start + other.page_count > start) {
+        return false;
+      }
+    }
+    else if (ii[i].handler == System_Service_Map) {
+      MapValue mv = { .r = ii[i].object.as_number };
+      if (mv.heap_offset_lsr4 > ((kernel_heap_top - kernel_heap_bottom)>>4)) {
+        BSOD( __LINE__ );
+      }
+      VirtualMemoryBlock *vmb = heap_pointer_from_offset_lsr4( mv.heap_offset_lsr4 );
+      for (uint32_t v = 0; v < mv.number_of_vmbs && vmb[v].page_count > 0; v++) {
+        if (vmb[v].memory_block == index) {
+          return false;
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+static bool is_real_thread( uint32_t code );
+
 static thread_switch system_driver_request( Core *core, thread_context *thread )
 {
   // Note: The system driver is responsible for ensuring that this is only called for one core at a time.
@@ -1062,13 +1474,114 @@ static thread_switch system_driver_request( Core *core, thread_context *thread )
       thread_context *new_thread = allocate_heap( sizeof( thread_context ) );
       initialise_new_thread( new_thread );
       new_thread->current_map = thread->stack_pointer[0].caller_map;
+      new_thread->current_core = core->core_number;
       new_thread->pc = thread->regs[1];
       new_thread->sp = thread->regs[2];
       new_thread->spsr = 0;
+      new_thread->priority = thread->base_priority;
+      new_thread->base_priority = thread->base_priority;
       thread->regs[0] = thread_code( new_thread );
       result.now = new_thread;
       // Run new thread until blocks, then old thread resumes.
-      insert_thread_as_head( &core->runnable, result.now );
+      make_runnable_as_head( core, result.now );
+    }
+    break;
+  case Isambard_System_Service_Create_Thread_On_Core:
+    {
+      uint64_t number = thread->regs[1];
+      if (number >= 64 || 0 == (standard_isambard_cores & (1ull << number))) {
+        thread->regs[0] = 0;
+        break;
+      }
+      if (0 != (thread->regs[3] & 0xf)) {
+        BSOD( __LINE__ ); // FIXME
+      }
+      thread_context *new_thread = allocate_heap( sizeof( thread_context ) );
+      initialise_new_thread( new_thread );
+      new_thread->current_map = thread->stack_pointer[0].caller_map;
+      new_thread->current_core = number;
+      new_thread->affinity = 1ull << number;
+      new_thread->pc = thread->regs[2];
+      new_thread->sp = thread->regs[3];
+      new_thread->spsr = 0;
+      new_thread->priority = thread->base_priority;
+      new_thread->base_priority = thread->base_priority;
+      thread->regs[0] = thread_code( new_thread );
+      if (number == core->core_number) {
+        make_runnable( core, new_thread );
+      }
+      else {
+        dsb(); // Thread initialised before it can be seen by the other core
+        pass_thread_to_core( core - core->core_number + number, new_thread );
+      }
+    }
+    break;
+  case Isambard_System_Service_Adopt_Threads:
+    thread->regs[0] = adopt_incoming_threads( core );
+    break;
+  case Isambard_System_Service_Steal_Thread:
+    thread->regs[0] = steal_thread( core );
+    break;
+  case Isambard_System_Service_IPI_Statistics:
+    {
+      uint64_t number = thread->regs[1];
+      if (number >= 64 || 0 == (standard_isambard_cores & (1ull << number))) {
+        thread->regs[0] = 0;
+        break;
+      }
+      Core *target = core - core->core_number + number;
+      switch (thread->regs[2]) {
+      case 0: thread->regs[0] = target->ipis_received; break;
+      case 1: thread->regs[0] = target->ipi_latency_total; break;
+      case 2: thread->regs[0] = target->ipi_latency_max; break;
+      default: thread->regs[0] = 0;
+      }
+    }
+    break;
+  case Isambard_System_Service_Wake_Latency:
+    {
+      uint64_t statistic = thread->regs[2];
+      if (!is_real_thread( thread->regs[1] ) || statistic > WAKE_LATENCY_BUCKETS) {
+        thread->regs[0] = 0;
+        break;
+      }
+      thread_context *target = thread_from_code( thread->regs[1] );
+      if (statistic == WAKE_LATENCY_BUCKETS) {
+        thread->regs[0] = target->wake_latency_max;
+      }
+      else {
+        thread->regs[0] = target->wake_latency[statistic];
+      }
+    }
+    break;
+  case Isambard_System_Service_Set_Affinity:
+    {
+      // The calling thread isn't moved, so the mask has to include this core;
+      // use Create_Thread_On_Core to start a thread elsewhere.
+      uint64_t mask = thread->regs[1] & standard_isambard_cores;
+      thread->regs[0] = (0 != (mask & (1ull << core->core_number)));
+      if (thread->regs[0]) {
+        thread->affinity = mask;
+      }
+    }
+    break;
+  case Isambard_System_Service_Set_Priority:
+    {
+      // Of the calling thread, which carries on if it's still the most urgent
+      uint64_t priority = thread->regs[1];
+      if (priority >= THREAD_PRIORITY_INTERRUPT || thread == core->interrupt_thread) {
+        thread->regs[0] = 0;
+        break;
+      }
+      thread->regs[0] = thread->base_priority;
+      make_unrunnable( core, thread );
+      // Keeping any higher priority lent to it by threads waiting for a lock it owns
+      if (thread->priority == thread->base_priority || priority > thread->priority) {
+        thread->priority = priority;
+      }
+      thread->base_priority = priority;
+      make_runnable_as_head( core, thread );
+      result.now = highest_priority_thread( core );
     }
     break;
   case Isambard_System_Service_Set_Interrupt_Thread:
@@ -1080,10 +1593,90 @@ static thread_switch system_driver_request( Core *core, thread_context *thread )
     else {
       core->interrupt_thread = thread;
       thread->spsr = 0x80; // IRQs disabled (FIQs stay enabled)
+      thread->priority = THREAD_PRIORITY_INTERRUPT;
+      thread->base_priority = THREAD_PRIORITY_INTERRUPT;
+    }
+    adopt_incoming_threads( core );
+    make_unrunnable( core, thread );
+    result.now = highest_priority_thread( core );
+    break;
+  case Isambard_System_Service_Create_Event:
+    thread->regs[0] = create_event( thread->stack_pointer[0].caller_map, thread->regs[1] );
+    break;
+  case Isambard_System_Service_Destroy_Event:
+    thread->regs[0] = destroy_event( thread->stack_pointer[0].caller_map, thread->regs[1] );
+    break;
+  case Isambard_System_Service_Freeze_Memory: // Start page, page count
+  case Isambard_System_Service_Relocate_Memory: // Old start page, new start page, page count
+    {
+      bool freeze = (thread->regs[0] == Isambard_System_Service_Freeze_Memory);
+      uint64_t old_start = thread->regs[1];
+      uint64_t new_start = freeze ? old_start : thread->regs[2];
+      uint64_t end = old_start + (freeze ? thread->regs[2] : thread->regs[3]);
+
+      // Every PhysicalMemoryBlock within the old range (including subpages and
+      // duplicates passed to other maps) is frozen, or moved the same distance.
+      claim_lock( &moving_memory.lock );
+
+      Interface *ii = interfaces();
+      for (uint32_t i = 1; i < kernel_last_interface; i++) {
+        if (ii[i].free.marker != free_marker
+         && ii[i].provider == system_map_index
+         && ii[i].handler == System_Service_PhysicalMemoryBlock) {
+          ContiguousMemoryBlock cmb = { .r = ii[i].object.as_number };
+          uint64_t start_page = cmb.start_page;
+          if (start_page >= old_start && start_page < end) {
+            if (start_page + cmb.page_count > end) BSOD( __LINE__ );
+            cmb.start_page = start_page - old_start + new_start;
+            cmb.moving = freeze;
+            ii[i].object.as_number = cmb.r;
+          }
+        }
+      }
+
+      thread_context *waiters = freeze ? 0 : moving_memory.waiters;
+      if (!freeze) {
+        moving_memory.waiters = 0;
+      }
+
+      release_lock( &moving_memory.lock );
+
+      // The caller is in the system map, so this core's translation tables will be
+      // re-built from the updated blocks when another map is loaded.
+      asm volatile ( "dsb ishst\n\ttlbi vmalle1is\n\tdsb ish\n\tisb" );
+      shoot_down_translation_tables( core );
+
+      // Only once no core can still be using the old translations
+      wake_moving_memory_waiters( core, waiters );
+    }
+    break;
+  case Isambard_System_Service_Release_Interface:
+    {
+      Interface *e = interface_from_index( thread->regs[1] );
+      if (e == 0 || thread->regs[1] == 0
+       || e->free.marker == free_marker
+       || e->user != system_map_index
+       || e->provider == system_map_index) {
+        BSOD( __LINE__ );
+      }
+      free_interface( e );
+    }
+    break;
+  case Isambard_System_Service_Release_Memory_Block: // Interface of the caller's map
+    {
+      Interface *block = interface_from_index( thread->regs[1] );
+      if (block == 0 || thread->regs[1] == 0
+       || !memory_block_releasable( block, thread->stack_pointer[0].caller_map )) {
+        thread->regs[0] = 0;
+        break;
+      }
+      thread->regs[0] = block->object.as_number;
+      free_interface( block );
+
+      // No core may keep a translation for memory that's about to be re-used
+      asm volatile ( "dsb ishst\n\ttlbi vmalle1is\n\tdsb ish\n\tisb" );
+      shoot_down_translation_tables( core );
     }
-    result.now = thread->next;
-    remove_thread( thread );
-    core->runnable = result.now;
     break;
   case Isambard_System_Service_Thread_Make_Partner:
     {
@@ -1095,6 +1688,10 @@ static thread_switch system_driver_request( Core *core, thread_context *thread )
       thread->partner = partner;
       initialise_new_thread( thread->partner );
       partner->partner = thread;
+      partner->current_core = core->core_number;
+      partner->priority = thread->priority;
+      partner->base_priority = thread->base_priority;
+      thread->affinity = partner->affinity = 1ull << core->core_number;
       dsb();
 
       asm ( "dc civac, %[va]" : : [va] "r" (&partner->partner) );
@@ -1183,6 +1780,28 @@ static bool address_is_user_writable( Core *core, thread_context *thread, uint64
   return false;
 }
 
+// The physical address of memory the thread can read, ~0 if it can't
+static uint64_t user_physical_address( Core *core, thread_context *thread, uint64_t address )
+{
+  uint64_t pa;
+  asm volatile ( "\tAT S1E0R, %[va]"
+               "\n\tmrs %[pa], PAR_EL1"
+                 : [pa] "=r" (pa)
+                 : [va] "r" (address) );
+  if (0 != (pa & 1)) {
+    if (!find_and_map_memory( core, thread, address )) return ~0ull;
+
+    asm volatile ( "  dsb sy"
+                 "\n  AT S1E0R, %[va]"
+                 "\n  mrs %[pa], PAR_EL1"
+                   : [pa] "=r" (pa)
+                   : [va] "r" (address) );
+    if (0 != (pa & 1)) return ~0ull;
+  }
+
+  return (pa & 0x000ffffffffff000ull) | (address & 0xfff);
+}
+
 static bool is_real_thread( uint32_t code )
 {
   if (!could_be_in_heap( code )
@@ -1208,6 +1827,85 @@ void *memcpy(void *dest, const void *src, long unsigned int n)
 
 #include "svc_handling.h"
 
+// A write to a block that's being moved (see moving_memory) is a permission fault, once
+// the block's been mapped read-only.
+static inline bool is_write_permission_fault( uint32_t esr )
+{
+  return 0 != (esr & (1 << 6))  // WnR
+      && 0x0c == (esr & 0x3c);  // DFSC 0b0011xx
+}
+
+// Returns true if the thread now waits until the memory has moved
+static bool wait_for_moving_memory( Core *core, thread_context *thread, uint64_t fa, thread_switch *result )
+{
+  VirtualMemoryBlock *vmb = find_vmb( thread, fa );
+  if (vmb == 0 || thread == core->interrupt_thread) {
+    return false; // Interrupt handlers can't wait, they keep retrying
+  }
+  Interface *block = interface_from_index( vmb->memory_block );
+  if (block == 0) {
+    return false;
+  }
+
+  claim_lock( &moving_memory.lock );
+
+  ContiguousMemoryBlock cmb = { .r = block->object.as_number };
+  bool moving = (block->handler == System_Service_PhysicalMemoryBlock && cmb.moving);
+  if (moving) {
+    make_unrunnable( core, thread );
+    thread->gate = THREAD_WAITING_FOR_MEMORY;
+    thread->current_core = core->core_number;
+    insert_thread_at_tail( &moving_memory.waiters, thread );
+  }
+
+  release_lock( &moving_memory.lock );
+
+  if (moving) {
+    result->now = highest_priority_thread( core );
+  }
+
+  return moving;
+}
+
+// The waiters have been taken from moving_memory (so its lock isn't needed here, and
+// isn't held while claiming runnable locks), they retry their writes.
+static void wake_moving_memory_waiters( Core *core, thread_context *waiters )
+{
+  thread_context *t = waiters;
+  if (t != 0) {
+    do {
+      t->list = &waiters;
+      t = t->next;
+    } while (t != waiters);
+  }
+
+  while (waiters != 0) {
+    thread_context *thread = waiters;
+    remove_thread( thread );
+
+    Core *target = claim_blocked_threads_core( core, thread );
+
+    if (thread->gate != THREAD_WAITING_FOR_MEMORY) {
+      BSOD( __LINE__ );
+    }
+
+    thread->gate = 0;
+    woken( thread );
+    if (target == core) {
+      make_runnable( core, thread );
+    }
+    else {
+      pass_thread_to_core( target, thread );
+    }
+
+    release_blocked_threads_core( core, target );
+
+    if (target != core) {
+      send_ipi( target, IPI_RESCHEDULE );
+    }
+  }
+}
+
 static inline thread_switch SEL1_LOWER_AARCH64_SYNC_CODE_may_change_map( Core *core, thread_context *thread )
 {
   thread_switch result = { .then = thread, .now = thread }; // By default, stay with the same thread
@@ -1233,6 +1931,10 @@ asm ( "mov x23, #0x20" );
       }
     case 0b100100: // Data Abort from a lower Exception level.
       {
+        if (is_write_permission_fault( esr )
+         && wait_for_moving_memory( core, thread, fault_address(), &result )) {
+          return result;
+        }
         if (!find_and_map_memory( core, thread, fault_address() )) { // BSOD( __LINE__ ); }
 asm ( "mrs x20, elr_el1" );
 asm ( "mrs x21, far_el1" );
@@ -1305,35 +2007,151 @@ asm ( "mov x26, %[r]" : : [r] "r" (thread->regs[30]) );
   return result;
 }
 
+static inline void stopped_running( thread_switch threads )
+{
+  if (threads.then != threads.now) {
+    asm volatile ( "mrs %[t], CNTPCT_EL0" : [t] "=r" (threads.then->last_ran) );
+  }
+}
+
+// Records the time a thread that's been woken (see woken in svc_handling.h) waited to run
+static inline void started_running( thread_switch threads )
+{
+  thread_context *thread = threads.now;
+  if (thread->woken_at == 0) return;
+
+  uint64_t latency = counter_now() - thread->woken_at;
+  thread->woken_at = 0;
+
+  uint32_t bucket = 0;
+  while (bucket < WAKE_LATENCY_BUCKETS - 1 && latency >= (64ull << (2 * bucket))) {
+    bucket++;
+  }
+  thread->wake_latency[bucket]++;
+  if (latency > thread->wake_latency_max) thread->wake_latency_max = latency;
+}
+
 thread_switch __attribute__(( noinline )) SEL1_LOWER_AARCH64_SYNC_CODE( void *opaque, thread_context *thread )
 {
   Core *core = opaque;
+  claim_runnable_lock( core );
   thread_switch result = SEL1_LOWER_AARCH64_SYNC_CODE_may_change_map( core, thread );
   if (result.now->current_map != result.then->current_map) {
     change_map( core, result.now, result.now->current_map );
   }
-  if (core->runnable != result.now) {
-    asm ( "smc 0x7777" ); // FIXME, can't I just set core->runnable here?
-  }
+  core->runnable = result.now;
+  update_core_timer( core );
+  stopped_running( result );
+  started_running( result );
+  release_runnable_lock( core );
   return result;
 }
 
+static void handle_ipis( Core *core, thread_context *thread )
+{
+  uint64_t now;
+  asm volatile ( "mrs %[t], CNTPCT_EL0" : [t] "=r" (now) );
+  uint64_t latency = now - core->ipi_sent;
+  core->ipis_received++;
+  core->ipi_latency_total += latency;
+  if (latency > core->ipi_latency_max) core->ipi_latency_max = latency;
+
+  uint32_t reasons = pending_ipis( core );
+  // Clear all but the translation table request now, so further requests aren't lost;
+  // the sender of that one waits until it's been dealt with.
+  qa7->Core_write_clear[core->core_number].Mailbox[0] = reasons & ~IPI_TRANSLATION_TABLES;
+
+  if (0 != (reasons & IPI_TRANSLATION_TABLES)) {
+    core->loaded_map = illegal_interface_index;
+    load_this_map( core, thread->current_map );
+    asm volatile ( "dsb ishst\n\ttlbi vmalle1\n\tdsb nsh\n\tisb" );
+    qa7->Core_write_clear[core->core_number].Mailbox[0] = IPI_TRANSLATION_TABLES;
+  }
+
+  if (0 != (reasons & IPI_RESCHEDULE)) {
+    adopt_incoming_threads( core );
+  }
+
+}
+
+// Idle cores only look for threads to steal when something wakes them, so one is woken
+// when a thread has waited a whole time slice for its turn.
+static void wake_an_idle_core( Core *core )
+{
+  Core *core0 = core - core->core_number;
+
+  for (uint32_t i = 1; i < 64; i++) {
+    uint32_t number = (core->core_number + i) % 64;
+    if (0 == (standard_isambard_cores & (1ull << number))) continue;
+
+    Core *other = core0 + number;
+    thread_context *running = other->runnable; // Without the lock, it's only a hint
+    if (running != 0 && running->priority == THREAD_PRIORITY_IDLE) {
+      send_ipi( other, IPI_RESCHEDULE );
+      return;
+    }
+  }
+}
+
+static void handle_timer_interrupt( Core *core, thread_context *thread )
+{
+  uint64_t now = counter_now();
+
+  release_timed_out_threads( core, now );
+
+  if (core->slice_tick != 0 && now >= core->slice_tick) {
+    core->slice_tick = 0; // Re-started by update_core_timer, if still needed
+    time_slice_tick( core, thread );
+    if (others_waiting( core, thread )) {
+      wake_an_idle_core( core );
+    }
+  }
+}
+
+// Returns true if there are no other interrupts to pass to the interrupt thread
+static bool handle_core_interrupts( Core *core, thread_context *thread )
+{
+  static const uint32_t kernel_sources = (1 << 4) | (1 << 1); // Mailbox 0, CNTPNSIRQ
+
+  uint32_t sources = qa7->Core_IRQ_Source[core->core_number];
+
+  if (0 != (sources & (1 << 4))) {
+    handle_ipis( core, thread );
+  }
+
+  if (0 != (sources & (1 << 1))) {
+    handle_timer_interrupt( core, thread );
+  }
+
+  return 0 != (sources & kernel_sources) && 0 == (sources & ~kernel_sources);
+}
+
 thread_switch __attribute__(( noinline )) SEL1_LOWER_AARCH64_IRQ_CODE( void *opaque, thread_context *thread )
 {
   thread_switch result = { .then = thread, .now = thread };
   Core *core = opaque;
+  claim_runnable_lock( core );
 
-  result.now = core->interrupt_thread;
-  if (0 == core->interrupt_thread) BSOD( __LINE__ );
+  if (handle_core_interrupts( core, thread )) {
+    // The interrupted thread continues, unless an adopted or timed out thread is more urgent
+    result.now = highest_priority_thread( core );
+  }
+  else {
+    result.now = core->interrupt_thread;
+    if (0 == core->interrupt_thread) BSOD( __LINE__ );
+
+    make_runnable_as_head( core, result.now );
+  }
 
-  insert_thread_as_head( &core->runnable, result.now );
   if (result.now->current_map != thread->current_map) {
     change_map( core, result.now, result.now->current_map );
   }
 
-  if (core->runnable != result.now) {
-    asm ( "smc 0x3333" ); // FIXME, can't I just set core->runnable here?
-  }
+  core->runnable = result.now;
+  update_core_timer( core );
+  stopped_running( result );
+  started_running( result );
+  release_runnable_lock( core );
   return result;
 }
 
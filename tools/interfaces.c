@@ -185,6 +185,9 @@ static inline void split( const char *interface_name, char *routine, routine_par
 
 void export_interface_routine_client_code( const char *interface_name, const char *name, unsigned crc, char *in, char *out )
 {
+  // For code that calls a method it's been given, e.g. DRIVER_SYSTEM add_timer_callback
+  printf( "#define %s__%s__METHOD 0x%08x\n", interface_name, name, crc );
+
   printf( "static inline " );
 
   int out_params = parameters_count( out );
@@ -277,13 +280,21 @@ void export_client_code()
     unsigned crc = crc32( interface_name, strlen( interface_name ), 0 );
     crc = crc32( "__", 2, crc );
 
-    if (0 != strcmp( interface_name, "SYSTEM" )) {
+    if (0 != strcmp( interface_name, "SYSTEM" )
+     && 0 != strcmp( interface_name, "SERVICE_DIRECTORY" )) {
             // FIXME Implement timeouts in system driver, but release the thread's resources in the map while waiting...
+      // Registered services are found in the map's service directory, the system driver's
+      // own services (and the directory itself) by asking the system driver.
       printf( "static inline %s %s__get_service( const char *name, long timeout )\n", interface_name, interface_name );
       printf( "{\n" );
       printf( "  NUMBER result = {};\n" );
       printf( "  do {\n" );
-      printf( "    result = SYSTEM__get_service( system, name_code( name ), NUMBER__from_integer_register( 0x%08x ), NUMBER__from_integer_register( 0 ) );\n", crc );
+      printf( "    if (service_directory().r != 0) {\n" );
+      printf( "      result = SERVICE_DIRECTORY__find( service_directory(), name_code( name ), NUMBER__from_integer_register( 0x%08x ) );\n", crc );
+      printf( "    }\n" );
+      printf( "    if (result.r == 0) {\n" );
+      printf( "      result = SYSTEM__get_service( system, name_code( name ), NUMBER__from_integer_register( 0x%08x ), NUMBER__from_integer_register( 0 ) );\n", crc );
+      printf( "    }\n" );
       printf( "    if (timeout > 0) { timeout--; }\n" );
       printf( "    if (result.r == 0 && timeout != 0) { sleep_ms( 1 ); }\n" );
       printf( "  } while (timeout != 0 && result.r == 0);\n" );
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Host build of the physical memory allocator, e.g.:
+//   gcc -O2 -I include unit_tests/allocator.c -o allocator && ./allocator
+// Replays synthetic workloads through the allocator's entry point and reports
+// call latency percentiles, fragmentation and the largest free block over time.
+
+typedef uint64_t integer_register;
+
+#define BEING_TESTED
+
+void inter_map_exception( const char *string )
+{
+  printf( "Allocator exception: %s\n", string );
+  exit( 1 );
+}
+
+#include "../drivers/physical_memory_allocator.c"
+
+#define ARENA_SIZE (256ull << 20)
+#define MAX_LIVE 4096
+#define MAX_SAMPLES (1 << 20)
+
+static integer_register arena_base;
+
+static uint64_t random_state = 0x2545F4914F6CDD1Dull;
+
+static uint64_t random_number()
+{
+  // xorshift64, so that runs are repeatable
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+static uint64_t nanoseconds()
+{
+  struct timespec t;
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+typedef struct {
+  uint32_t count;
+  uint64_t ns[MAX_SAMPLES];
+} samples;
+
+static samples allocate_latency;
+static samples free_latency;
+
+static void record( samples *s, uint64_t ns )
+{
+  if (s->count < MAX_SAMPLES) {
+    s->ns[s->count++] = ns;
+  }
+}
+
+static int compare_samples( const void *a, const void *b )
+{
+  uint64_t l = *(const uint64_t *) a;
+  uint64_t r = *(const uint64_t *) b;
+  return (l > r) - (l < r);
+}
+
+static void report_latency( const char *name, samples *s )
+{
+  if (s->count == 0) {
+    return;
+  }
+  qsort( s->ns, s->count, sizeof( s->ns[0] ), compare_samples );
+  printf( "  %-8s %8u calls, ns: p50 %6" PRIu64 " p90 %6" PRIu64 " p99 %6" PRIu64 " p99.9 %6" PRIu64 " max %8" PRIu64 "\n",
+          name, s->count,
+          s->ns[s->count / 2],
+          s->ns[(s->count * 90) / 100],
+          s->ns[(s->count * 99) / 100],
+          s->ns[(s->count * 999) / 1000],
+          s->ns[s->count - 1] );
+  s->count = 0;
+}
+
+typedef struct {
+  integer_register free;
+  integer_register largest;
+  uint32_t chunks;
+} free_state;
+
+static free_state examine_free_chunks()
+{
+  free_state result = { 0, 0, 0 };
+  for (chunk *c = available_chunks; c != 0; c = c->next) {
+    integer_register size = 1ull << c->log2size;
+    result.free += size;
+    result.chunks++;
+    if (size > result.largest) {
+      result.largest = size;
+    }
+  }
+  return result;
+}
+
+static void report_fragmentation( uint32_t step )
+{
+  free_state s = examine_free_chunks();
+  // 0% means all the free memory is in one block
+  uint32_t fragmentation = s.free == 0 ? 0 : 100 - (uint32_t) ((s.largest * 100) / s.free);
+  printf( "  step %7u: free %6" PRIu64 "k in %5u chunks, largest %6" PRIu64 "k, fragmentation %3u%%\n",
+          step, s.free >> 10, s.chunks, s.largest >> 10, fragmentation );
+}
+
+typedef struct {
+  integer_register base;
+  integer_register size;
+} block;
+
+static block live[MAX_LIVE];
+static uint32_t live_count;
+static uint32_t failures;
+
+static integer_register allocate_block( integer_register size )
+{
+  uint64_t start = nanoseconds();
+  integer_register result = entry( 0, 1, size, 0, 0 );
+  record( &allocate_latency, nanoseconds() - start );
+
+  if (result == 0) {
+    failures++;
+    return 0;
+  }
+
+  size = (size + 4095) & ~0xfffull;
+  if (result < arena_base || result + size > arena_base + ARENA_SIZE || 0 != (result & 0xfff)) {
+    printf( "Block %" PRIx64 " (%" PRIx64 " bytes) outside arena\n", result, size );
+    exit( 1 );
+  }
+
+  live[live_count].base = result;
+  live[live_count].size = size;
+  live_count++;
+  return result;
+}
+
+static void free_live_block( uint32_t i )
+{
+  uint64_t start = nanoseconds();
+  entry( 0, 2, live[i].base, live[i].size, 0 );
+  record( &free_latency, nanoseconds() - start );
+
+  live[i] = live[--live_count];
+}
+
+static void free_all()
+{
+  while (live_count > 0) {
+    free_live_block( live_count - 1 );
+  }
+}
+
+static integer_register mixed_size()
+{
+  // Mostly pages, some small buffers, a few large blocks
+  uint32_t r = random_number() % 100;
+  if (r < 60) return 4096;
+  if (r < 90) return 4096 << (1 + random_number() % 4);
+  return (64 + random_number() % 960) << 10;
+}
+
+// Random allocations and frees, up to a limited number live at any time
+static void mixed_sizes( uint32_t steps )
+{
+  for (uint32_t step = 1; step <= steps; step++) {
+    if (live_count < 1024 && (live_count == 0 || (random_number() & 1) == 0)) {
+      allocate_block( mixed_size() );
+    }
+    else {
+      free_live_block( random_number() % live_count );
+    }
+    if (step % (steps / 4) == 0) {
+      report_fragmentation( step );
+    }
+  }
+}
+
+// One in ten allocations is never freed (until the end of the test), the rest
+// only live for a few steps; the long-lived blocks pin the free memory apart.
+static void long_lived_and_transient( uint32_t steps )
+{
+  uint32_t long_lived = 0;
+  for (uint32_t step = 1; step <= steps; step++) {
+    if (live_count < MAX_LIVE - 1) {
+      integer_register size = mixed_size();
+      if (allocate_block( size ) != 0 && random_number() % 10 == 0) {
+        // Swap into the long-lived area at the bottom of the array
+        block b = live[live_count - 1];
+        live[live_count - 1] = live[long_lived];
+        live[long_lived++] = b;
+      }
+    }
+    while (live_count > long_lived + 16) {
+      free_live_block( long_lived + random_number() % (live_count - long_lived) );
+    }
+    if (step % (steps / 4) == 0) {
+      report_fragmentation( step );
+    }
+  }
+}
+
+// Virtual machine sized blocks (RISC OS asks for 16MB or more) allocated
+// while smaller allocations churn around them.
+static void vm_sized_blocks( uint32_t steps )
+{
+  uint32_t attempts = 0;
+  uint32_t unavailable = 0;
+  for (uint32_t step = 1; step <= steps; step++) {
+    if (step % 500 == 0) {
+      attempts++;
+      integer_register vm = allocate_block( (16ull << 20) << (random_number() % 3) );
+      if (vm != 0) {
+        free_live_block( live_count - 1 );
+      }
+      else {
+        unavailable++;
+      }
+    }
+    else if (live_count < 2048 && (live_count == 0 || (random_number() % 3) != 0)) {
+      allocate_block( mixed_size() );
+    }
+    else {
+      free_live_block( random_number() % live_count );
+    }
+    if (step % (steps / 4) == 0) {
+      report_fragmentation( step );
+    }
+  }
+  printf( "  %u of %u VM-sized blocks unavailable\n", unavailable, attempts );
+}
+
+static void run( const char *name, void (*workload)( uint32_t steps ), uint32_t steps )
+{
+  printf( "%s\n", name );
+  failures = 0;
+  workload( steps );
+  report_latency( "allocate", &allocate_latency );
+  report_latency( "free", &free_latency );
+  printf( "  %u failed allocations\n", failures );
+
+  free_all();
+
+  // Everything freed, the buddies should all have merged back
+  free_state s = examine_free_chunks();
+  if (s.free != ARENA_SIZE || s.chunks != 1) {
+    printf( "  FAILED: %" PRIu64 "k free in %u chunks after freeing everything\n", s.free >> 10, s.chunks );
+    exit( 1 );
+  }
+}
+
+int main()
+{
+  uint8_t *arena = mmap( 0, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+  if (arena == MAP_FAILED) {
+    printf( "No memory for arena\n" );
+    return 1;
+  }
+  // Naturally aligned, like physical memory
+  arena_base = ((integer_register) arena + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1);
+
+  entry( 0, 0, arena_base, arena_base + ARENA_SIZE, 0 );
+
+  run( "Mixed sizes", mixed_sizes, 200000 );
+  run( "Long-lived and transient", long_lived_and_transient, 200000 );
+  run( "VM-sized blocks", vm_sized_blocks, 200000 );
+
+  // Compaction primitives: claim a window with a block in it, then release it
+  integer_register window = arena_base + (64ull << 20);
+  integer_register in_window = window + (4ull << 20);
+  claim_range( arena_base, arena_base + ARENA_SIZE ); // Everything...
+  free_block( in_window, 1 << 20 );                   // ...except this
+  if (entry( 0, 4, window, window + (16ull << 20), 0 ) != (1 << 20)) {
+    printf( "FAILED: free bytes in range\n" );
+    return 1;
+  }
+  entry( 0, 5, window, window + (16ull << 20), 0 );
+  if (entry( 0, 4, arena_base, arena_base + ARENA_SIZE, 0 ) != 0) {
+    printf( "FAILED: claim range\n" );
+    return 1;
+  }
+  free_block( arena_base, ARENA_SIZE );
+  free_state s = examine_free_chunks();
+  if (s.free != ARENA_SIZE || s.chunks != 1) {
+    printf( "FAILED: %" PRIu64 "k free in %u chunks after releasing claimed range\n", s.free >> 10, s.chunks );
+    return 1;
+  }
+  printf( "Compaction primitives OK\n" );
+
+  return 0;
+}
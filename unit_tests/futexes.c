@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <inttypes.h>
+
+// Host build of the futex system calls, e.g.:
+//   gcc -I include unit_tests/futexes.c -o futexes && ./futexes
+// One core, no timeouts; a thread's map can read the words in mapped[] only.
+
+typedef uint32_t bool;
+enum { false = 0, true };
+
+static const uint32_t system_map_index = 1;
+
+static int failures = 0;
+
+void BSOD( int n )
+{
+  printf( "Failure %d\n", n );
+  failures++;
+}
+
+// The kernel's debugging traps
+#define asm( x ) BSOD( __LINE__ )
+
+typedef uint64_t integer_register;
+
+typedef struct Core Core;
+typedef struct thread_context thread_context;
+
+struct thread_context {
+  integer_register regs[31];
+  integer_register pc;
+  uint32_t spsr;
+  uint32_t current_map;
+  uint32_t current_core;
+  int32_t gate;
+  thread_context *next;
+  thread_context *prev;
+  thread_context **list;
+  thread_context *partner;
+  uint64_t woken_at;
+};
+
+#include "timer_wheel.h"
+
+struct Core {
+  uint32_t core_number;
+  thread_context *runnable;
+  thread_context *interrupt_thread;
+  timer_wheel timeouts;
+};
+
+typedef struct {
+  thread_context *now;
+  thread_context *then;
+} thread_switch;
+
+typedef struct event_set {
+  uint64_t volatile lock;
+  uint32_t signalled;
+  uint32_t in_use;
+  thread_context *waiters;
+  struct event_set *next_free;
+} event_set;
+
+// No event interfaces, only futexes
+typedef struct {
+  struct { uint64_t marker; } free;
+  uint32_t user;
+  uint32_t provider;
+  integer_register handler;
+  union { integer_register as_number; } object;
+} Interface;
+
+static const uint64_t free_marker = 0x00746e4965657246;
+enum { System_Service_Event = 1 };
+static const uint32_t kernel_last_interface = 0;
+Interface *interface_from_index( integer_register index ) { return 0; }
+Interface *interfaces() { return 0; }
+void free_interface( Interface *interface ) { BSOD( __LINE__ ); }
+void *allocate_heap( uint64_t size ) { BSOD( __LINE__ ); return 0; }
+
+static uint8_t *start_address() { return (uint8_t*) 0; }
+static inline uint32_t event_set_code( event_set *s ) { return ((uint8_t*) s) - start_address(); }
+static inline event_set *event_set_from_code( uint32_t c ) { if (c == 0) return 0; return (event_set*) (start_address() + c); }
+
+static inline void claim_lock( uint64_t volatile *lock ) { if (*lock != 0) BSOD( __LINE__ ); *lock = 1; }
+static inline void release_lock( uint64_t volatile *lock ) { if (*lock != 1) BSOD( __LINE__ ); *lock = 0; }
+
+void insert_new_thread_after_old( thread_context *new, thread_context *old )
+{
+  new->next = old->next;
+  new->next->prev = new;
+  new->prev = old;
+  old->next = new;
+}
+
+void remove_thread( thread_context *thread )
+{
+  thread->next->prev = thread->prev;
+  thread->prev->next = thread->next;
+  thread->prev = thread->next = 0;
+}
+
+uint64_t thread_code( thread_context *t ) { return (uint64_t) t; }
+thread_context * thread_from_code( uint64_t t ) { return (void*) t; }
+
+bool is_real_thread( uint64_t t ) { return true; }
+
+void invalidate_all_caches() {}
+
+// Single core, no other core's threads to wake
+enum { IPI_RESCHEDULE = 1 };
+bool try_claim_runnable_lock( Core *core ) { return true; }
+void claim_runnable_lock( Core *core ) {}
+void release_runnable_lock( Core *core ) {}
+void pass_thread_to_core( Core *target, thread_context *thread ) { BSOD( __LINE__ ); }
+
+// One priority, runnable is the run queue
+void make_runnable_first( Core *core, thread_context *thread ) { insert_new_thread_after_old( thread, core->runnable ); }
+void make_runnable_as_head( Core *core, thread_context *thread ) { insert_new_thread_after_old( thread, core->runnable->prev ); core->runnable = thread; }
+void make_unrunnable( Core *core, thread_context *thread ) { if (core->runnable == thread) core->runnable = thread->next; remove_thread( thread ); }
+thread_context *highest_priority_thread( Core *core ) { return core->runnable; }
+void send_ipi( Core *target, uint32_t reasons ) { BSOD( __LINE__ ); }
+
+#define TIMER_WHEEL_SHIFT 10
+uint64_t counter_now() { return 1 << 20; }
+uint64_t counter_frequency() { return 1000 << TIMER_WHEEL_SHIFT; }
+void release_timed_out_threads( Core *core, uint64_t now ) {}
+
+static uint32_t volatile mapped[4];
+
+// As in secure_el1.c, ~0 if the thread can't read the address
+static uint64_t user_physical_address( Core *core, thread_context *thread, uint64_t address )
+{
+  if (address < (uint64_t) mapped || address >= (uint64_t) &mapped[4]) return ~0ull;
+  return address;
+}
+
+#define WITHOUT_SVC
+#define WITHOUT_LOCKS
+#define WITHOUT_INTERFACE_CREATION
+#include "svc_handling.h"
+
+thread_context __attribute__(( aligned( 256 ) )) threads[3] = { { .next = threads, .prev = threads, .current_map = system_map_index } };
+
+thread_context not_running;
+
+Core the_core = { .runnable = threads, .interrupt_thread = &not_running };
+
+static void expect( const char *what, integer_register result, integer_register expected )
+{
+  printf( "%-40s %" PRId64 "\n", what, (int64_t) result );
+  if (result != expected) {
+    printf( "  expected %" PRId64 "\n", (int64_t) expected );
+    failures++;
+  }
+}
+
+static integer_register Wait( uint32_t volatile *word, uint32_t value )
+{
+  thread_context *t = the_core.runnable;
+  t->regs[0] = (integer_register) word;
+  t->regs[1] = value;
+  t->regs[2] = 0;
+  handle_svc_futex_wait( &the_core, t );
+  return (the_core.runnable == t) ? t->regs[0] : 42; // 42: blocked
+}
+
+static integer_register Wake( uint32_t volatile *word, uint32_t count )
+{
+  thread_context *t = the_core.runnable;
+  t->regs[0] = (integer_register) word;
+  t->regs[1] = count;
+  handle_svc_futex_wake( &the_core, t );
+  return t->regs[0];
+}
+
+int main()
+{
+  for (int i = 1; i < 3; i++) {
+    insert_new_thread_after_old( &threads[i], &threads[i-1] );
+    threads[i].current_map = system_map_index;
+  }
+
+  // Bad addresses are refused, without blocking the thread
+  expect( "Wait, misaligned", Wait( (uint32_t volatile *) (1 + (uint8_t*) &mapped[1]), 0 ), NOT_A_FUTEX );
+  expect( "Wake, misaligned", Wake( (uint32_t volatile *) (2 + (uint8_t*) &mapped[1]), 0 ), NOT_A_FUTEX );
+  expect( "Wait, unmapped", Wait( &mapped[4], 0 ), NOT_A_FUTEX );
+  expect( "Wake, unmapped", Wake( (uint32_t volatile *) 0, 0 ), NOT_A_FUTEX );
+
+  // Good ones still work
+  thread_context *waiter = the_core.runnable;
+  mapped[2] = 7;
+  expect( "Wait, word changed", Wait( &mapped[2], 6 ), 1 );
+  expect( "Wait, blocks", Wait( &mapped[2], 7 ), 42 );
+  expect( "Wake, other word", Wake( &mapped[1], 0 ), 0 );
+  expect( "Wake", Wake( &mapped[2], 0 ), 1 );
+  expect( "Woken thread's result", waiter->regs[0], 0 );
+  expect( "Wake, no waiters", Wake( &mapped[2], 0 ), 0 );
+
+  return failures == 0 ? 0 : 1;
+}
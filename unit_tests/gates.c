@@ -11,24 +11,34 @@ void BSOD( int n )
   printf( "Failure %d\n", n );
 }
 
+// The kernel's debugging traps
+#define asm( x ) BSOD( __LINE__ )
+
 typedef uint64_t integer_register;
 
 typedef struct Core Core;
 typedef struct thread_context thread_context;
 
 struct thread_context {
-  integer_register regs[32-5];
+  integer_register regs[31];
   integer_register pc;
+  uint32_t spsr;
   uint32_t current_map;
+  uint32_t current_core;
   int32_t gate;
   thread_context *next;
   thread_context *prev;
+  thread_context *partner;
+  uint64_t woken_at;
 };
 
+#include "timer_wheel.h"
+
 struct Core {
+  uint32_t core_number;
   thread_context *runnable;
   thread_context *interrupt_thread;
-  thread_context *blocked_with_timeout;
+  timer_wheel timeouts;
 };
 
 typedef struct {
@@ -58,23 +68,60 @@ bool is_real_thread( uint64_t t ) { return true; }
 
 void invalidate_all_caches() {}
 
+// Single core, no other core's threads to wake
+enum { IPI_RESCHEDULE = 1 };
+bool try_claim_runnable_lock( Core *core ) { return true; }
+void claim_runnable_lock( Core *core ) {}
+void release_runnable_lock( Core *core ) {}
+void pass_thread_to_core( Core *target, thread_context *thread ) { BSOD( __LINE__ ); }
+
+// One priority, runnable is the run queue
+void make_runnable_first( Core *core, thread_context *thread ) { insert_new_thread_after_old( thread, core->runnable ); }
+void make_runnable_as_head( Core *core, thread_context *thread ) { insert_new_thread_after_old( thread, core->runnable->prev ); core->runnable = thread; }
+void make_unrunnable( Core *core, thread_context *thread ) { if (core->runnable == thread) core->runnable = thread->next; remove_thread( thread ); }
+thread_context *highest_priority_thread( Core *core ) { return core->runnable; }
+void send_ipi( Core *target, uint32_t reasons ) { BSOD( __LINE__ ); }
+
+// A millisecond is one wheel tick
+#define TIMER_WHEEL_SHIFT 10
+uint64_t counter = 1 << 20;
+uint64_t counter_now() { return counter; }
+uint64_t counter_frequency() { return 1000 << TIMER_WHEEL_SHIFT; }
+
+// As in secure_el1.c
+void release_timed_out_threads( Core *core, uint64_t now )
+{
+  thread_context *thread = timer_wheel_expire( &core->timeouts, now >> TIMER_WHEEL_SHIFT );
+  while (thread != 0) {
+    thread_context *next = (void*) thread->regs[17];
+    thread->regs[0] = -1; // Timed out
+    thread->gate = 0; // No longer blocked
+    make_runnable_as_head( core, thread );
+    thread = next;
+  }
+}
+
 #define WITHOUT_SVC
 #define WITHOUT_LOCKS
 #define WITHOUT_
 #define WITHOUT_INTERFACE_CREATION
+#define WITHOUT_EVENTS
 #include "svc_handling.h"
 
-// Start with the first thread in the runnable queue
-// For gates, that is also the interrupt thread
 thread_context __attribute__(( aligned( 256 ) )) threads[6] = { { .next = threads, .prev = threads, .current_map = system_map_index } };
 
-Core the_core = { .runnable = threads, .interrupt_thread = threads };
+thread_context not_running;
 
-thread_context *ithread = threads;
+Core the_core = { .runnable = threads, .interrupt_thread = &not_running, .timeouts = { .now = 1 << (20 - TIMER_WHEEL_SHIFT) } };
 
 static inline char id( thread_context *t )
 {
-  return (t - threads) == 0 ? 'i' : '@' + (t-threads);
+  return '@' + (t-threads);
+}
+
+static uint64_t ms()
+{
+  return (counter >> TIMER_WHEEL_SHIFT) - (1 << (20 - TIMER_WHEEL_SHIFT));
 }
 
 void show()
@@ -87,19 +134,18 @@ void show()
   } while (t != the_core.runnable);
 
   printf( "\tBlocked: " );
-  t = the_core.blocked_with_timeout;
-  if (t == 0) {
-    printf( "-" );
-  }
-  else {
-    uint64_t prev = (uint64_t) &the_core.blocked_with_timeout;
-    do {
-      if (t->regs[16] != prev)
-        printf( "!" );
-      printf( "%c (%ld) ", id( t ), t->regs[1] );
-      prev = (uint64_t) &t->regs[17];
-      t = (void*) t->regs[17];
-    } while (t != 0);
+  for (int i = 0; i < 6; i++) {
+    t = &threads[i];
+    if (t->gate == THREAD_WAITING) {
+      if (t->regs[16] == 0) {
+        printf( "%c ", id( t ) );
+      }
+      else {
+        if (*(thread_context **) t->regs[16] != t)
+          printf( "!" );
+        printf( "%c (%" PRId64 ") ", id( t ), t->regs[1] - (counter >> TIMER_WHEEL_SHIFT) );
+      }
+    }
   }
 
   printf( "\n" );
@@ -107,33 +153,33 @@ void show()
 
 void Yield()
 {
-  printf( "Yield: \t\t" );
+  printf( "%6" PRIu64 " Yield: \t", ms() );
   the_core.runnable = the_core.runnable->next;
   show();
 }
 
-void WFI()
+// Passes the time, as the timer interrupt would (only when there's something due)
+void Pass( int milliseconds )
 {
-  printf( "WFI: \t\t" );
-  the_core.runnable = the_core.runnable->next;
-  remove_thread( ithread );
+  printf( "%6" PRIu64 " Pass( %d ): \t", ms(), milliseconds );
+  counter += (uint64_t) milliseconds << TIMER_WHEEL_SHIFT;
+  release_timed_out_threads( &the_core, counter );
   show();
+  uint64_t next = timer_wheel_next_event( &the_core.timeouts );
+  if (next != ~0ull && next <= (counter >> TIMER_WHEEL_SHIFT)) printf( "Next event in the past!\n" );
 }
 
 void Tick()
 {
-  printf( "Tick: \t\t" );
-  insert_new_thread_after_old( ithread, the_core.runnable->prev );
-  the_core.runnable = ithread;
-  ithread->regs[0] = 0;
-  ithread->regs[1] = 0;
-  handle_svc_gate( &the_core, the_core.runnable );
-  show();
+  Pass( 1 );
 }
 
-void Wait( int timeout )
+void Wait( integer_register timeout )
 {
-  printf( "Wait( %d ): \t", timeout );
+  if (0 != (timeout & GATE_TIMEOUT_MICROSECONDS))
+    printf( "%6" PRIu64 " Wait( %" PRIu64 "us ): \t", ms(), (uint64_t) (timeout & ~GATE_TIMEOUT_MICROSECONDS) );
+  else
+    printf( "%6" PRIu64 " Wait( %" PRIu64 " ): \t", ms(), timeout );
   the_core.runnable->regs[0] = 0;
   the_core.runnable->regs[1] = timeout;
   handle_svc_gate( &the_core, the_core.runnable );
@@ -142,54 +188,106 @@ void Wait( int timeout )
 
 void Wake( thread_context *t )
 {
-  printf( "Wake( %c ):\t", id( t ) );
+  printf( "%6" PRIu64 " Wake( %c ):\t", ms(), id( t ) );
   the_core.runnable->regs[0] = thread_code( t );
   handle_svc_gate( &the_core, the_core.runnable );
   show();
 }
 
+void WakeAndWait( thread_context *t )
+{
+  printf( "%6" PRIu64 " WakeAndWait( %c ):\t", ms(), t == 0 ? '-' : id( t ) );
+  the_core.runnable->regs[0] = t == 0 ? 0 : thread_code( t );
+  the_core.runnable->regs[1] = 0;
+  handle_svc_wake_and_wait( &the_core, the_core.runnable );
+  show();
+}
+
 int main()
 {
   for (int i = 1; i < 6; i++) {
     insert_new_thread_after_old( &threads[i], &threads[i-1] );
+    threads[i].current_map = system_map_index;
   }
-  WFI();
 
-  Tick(); WFI();
   // Simple sleep
-  Wait( 3 ); Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
+  Wait( 3 ); Tick(); Tick(); Tick();
 
   // Two threads, should wake at the same time
-  Wait( 6 ); Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
-  Wait( 3 ); Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
+  Wait( 6 ); Tick(); Tick(); Tick();
+  Wait( 3 ); Tick(); Tick(); Tick();
 
   // Ditto, both waiting between two ticks
   Wait( 3 ); Wait( 3 );
-  Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
+  Tick(); Tick(); Tick();
 
   // First returns, then second
   Wait( 3 ); Wait( 5 );
-  Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
-  Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
+  Tick(); Tick(); Tick();
+  Tick(); Tick(); Tick();
 
   // Second returns, then first
   Wait( 5 ); Wait( 3 );
-  Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
-  Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
+  Tick(); Tick(); Tick();
+  Tick(); Tick(); Tick();
 
   Wait( 5 ); Wait( 3 ); Wait( 6 );
-  Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
-  Tick(); WFI(); Tick(); WFI(); Tick(); WFI();
+  Tick(); Tick(); Tick();
+  Tick(); Tick(); Tick();
 
   thread_context *waiting = the_core.runnable;
   Wait( 0 ); // No timeout
   Wait( 2 );
   Wait( 1 );
-  Tick(); WFI();
+  Tick();
+  Wake( waiting );
+  Tick();
+  Tick();
+  Tick();
+
+  // Long sleeps move down the wheel's levels, without ticks in between
+  Wait( 100 ); Wait( 5000 ); Wait( 300000 );
+  Pass( 99 ); Pass( 1 );
+  Pass( 4899 ); Pass( 1 );
+  Pass( 294999 ); Pass( 1 );
+
+  // Longer than the wheel goes round
+  Wait( 20000000 );
+  Pass( 16777215 ); Pass( 3222784 ); Pass( 1 );
+
+  // Woken before the timeout, and a wait that's already been woken
+  waiting = the_core.runnable;
+  Wait( 700 );
   Wake( waiting );
-  Tick(); WFI();
-  Tick(); WFI();
-  Tick(); WFI();
+  Pass( 1000 );
+  Wake( the_core.runnable->next );
+  Yield();
+  Wait( 10 );
+
+  // Microseconds, rounded up to the wheel's resolution
+  Wait( GATE_TIMEOUT_MICROSECONDS | 2500 );
+  Pass( 2 ); Pass( 1 );
+
+  // Request and response, the woken thread runs next each time
+  thread_context *server = the_core.runnable;
+  Wait( 0 );
+  thread_context *client = the_core.runnable;
+  WakeAndWait( server );
+  if (the_core.runnable != server) printf( "Server not running\n" );
+  WakeAndWait( client );
+  if (the_core.runnable != client) printf( "Client not running\n" );
+  // A server that hasn't waited yet doesn't wait for the next request
+  Wake( server );
+  WakeAndWait( server );
+  Wait( 0 );
+  if (the_core.runnable != server) printf( "Server not running\n" );
+  WakeAndWait( client );
+
+  // Nothing to wake, just waits
+  thread_context *waiter = the_core.runnable;
+  WakeAndWait( 0 );
+  if (the_core.runnable == waiter) printf( "Waiter still running\n" );
+  Wake( waiter );
 
   return 0;
 }
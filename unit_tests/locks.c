@@ -1,14 +1,24 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h>
 
+// Host build of the kernel's lock wait and release code, e.g.:
+//   gcc -I include unit_tests/locks.c -o locks && ./locks
+// First a single core walk-through, then a deterministic simulation of several
+// cores running threads that execute the CLAIM_LOCK and RELEASE_LOCK sequences
+// one instruction at a time, interleaved at random (with fixed seeds).
+
 typedef uint32_t bool;
 enum { false = 0, true };
 
 static const uint32_t system_map_index = 1;
 
+static int failures = 0;
+
 void BSOD( int n )
 {
   printf( "Failure %d\n", n );
+  failures++;
 }
 
 typedef uint64_t integer_register;
@@ -16,17 +26,31 @@ typedef uint64_t integer_register;
 typedef struct Core Core;
 typedef struct thread_context thread_context;
 
+#define LENT_PRIORITY_LOCKS 4
+
 struct thread_context {
   integer_register regs[32-5];
   integer_register pc;
   uint32_t current_map;
+  uint32_t current_core;
   int32_t gate;
   thread_context *next;
   thread_context *prev;
+  thread_context **list;
+  thread_context *partner;
+  uint32_t priority;
+  uint32_t base_priority;
+  struct { uint64_t lock; uint32_t priority; } lent[LENT_PRIORITY_LOCKS];
+  uint32_t quantum;
 };
 
+#define NUMBER_OF_CORES 4
+
 struct Core {
+  uint32_t core_number;
   thread_context *runnable;
+  thread_context *incoming;
+  bool ipi_pending;
 };
 
 typedef struct {
@@ -34,78 +58,125 @@ typedef struct {
   thread_context *then;
 } thread_switch;
 
-void insert_new_thread_after_old( thread_context *new, thread_context *old )
-{
-  new->next = old->next;
-  new->next->prev = new;
-  new->prev = old;
-  old->next = new;
-}
+#include "thread_priorities.h"
+#include "doubly_linked_lists.h"
+DEFINE_DOUBLE_LINKED_LIST( thread, thread_context, next, prev, list );
 
-void insert_thread_at_tail( thread_context **list, thread_context *new )
-{
-  thread_context *old_head = *list;
-  insert_new_thread_after_old( new, old_head->prev );
-}
+bool is_real_thread( uint64_t t ) { return true; }
 
-void insert_thread_as_head( thread_context **list, thread_context *new )
-{
-  if (*list != 0)
-    insert_thread_at_tail( list, new );
-  else
-    new->prev = new->next = new;
-  *list = new;
-}
+void invalidate_all_caches() {}
 
-void remove_thread( thread_context *thread )
+bool address_is_user_writable( Core *core, thread_context *thread, uint64_t a )
 {
-  thread->next->prev = thread->prev;
-  thread->prev->next = thread->next;
-  thread->prev = thread->next = 0;
+  return true;
 }
 
-bool is_real_thread( uint64_t t ) { return true; }
-
-void invalidate_all_caches() {}
+// The simulated core executing the current step, and its exclusive monitor
+static uint32_t sim_core = 0;
+static struct { uint64_t address; bool valid; } monitor[NUMBER_OF_CORES];
 
-bool address_is_user_writable( uint64_t a )
+static void clear_monitors( uint64_t p )
 {
-  return true;
+  for (int i = 0; i < NUMBER_OF_CORES; i++) {
+    if (monitor[i].address == p) monitor[i].valid = false;
+  }
 }
 
 uint64_t LDXR( uint64_t p )
 {
+  monitor[sim_core].address = p;
+  monitor[sim_core].valid = true;
   return *(uint64_t*)p;
 }
 
+// Returns true if the write failed, like the instruction
 bool STXR( uint64_t p, uint64_t v )
 {
+  if (!monitor[sim_core].valid || monitor[sim_core].address != p) {
+    monitor[sim_core].valid = false;
+    return true;
+  }
   *(uint64_t*)p = v;
+  clear_monitors( p );
   return false;
 }
 
+void STR( uint64_t p, uint64_t v )
+{
+  *(uint64_t*)p = v;
+  clear_monitors( p );
+}
+
 void CLREX()
 {
+  monitor[sim_core].valid = false;
 }
 
 void dsb()
 {
 }
 
+// Each kernel entry is a single simulation step, so the kernel ticket locks
+// must always be free when it starts, and when it ends.
+static inline bool lock_is_free( uint64_t v ) { return (uint32_t) v == (v >> 32); }
+static inline void claim_lock( uint64_t volatile *lock ) { if (!lock_is_free( *lock )) BSOD( __LINE__ ); *lock += 1ull << 32; }
+static inline void release_lock( uint64_t volatile *lock ) { *lock += 1; }
+
+enum { IPI_RESCHEDULE = 1 };
+
+static void pass_thread_to_core( Core *target, thread_context *thread )
+{
+  thread->next = target->incoming;
+  target->incoming = thread;
+}
+
+static void send_ipi( Core *target, uint32_t reasons )
+{
+  if (reasons != IPI_RESCHEDULE) BSOD( __LINE__ );
+  target->ipi_pending = true;
+}
+
+// All threads have the same priority; runnable is the only run queue, headed by the
+// running thread.
+static void make_runnable_first( Core *core, thread_context *thread )
+{
+  insert_new_thread_after_old( thread, core->runnable );
+}
+
+static void make_runnable_as_head( Core *core, thread_context *thread )
+{
+  insert_thread_as_head( &core->runnable, thread );
+}
+
+static void make_unrunnable( Core *core, thread_context *thread )
+{
+  remove_thread( thread );
+  thread->list = 0;
+}
+
+static thread_context *highest_priority_thread( Core *core )
+{
+  return core->runnable;
+}
+
 #define WITHOUT_SVC
 #define WITHOUT_GATE
 #define DEBUG_ASM
 #define WITHOUT_INTERFACE_CREATION
 
+#define NUMBER_OF_THREADS 24
+
+#define numberof( a ) (sizeof( a ) / sizeof( a[0] ))
+
 // Start with the first thread in the runnable queue
-thread_context __attribute__(( aligned( 256 ) )) threads[6] = { { .next = threads, .prev = threads, .current_map = system_map_index } };
+thread_context __attribute__(( aligned( 256 ) )) threads[NUMBER_OF_THREADS] = { { .next = threads, .prev = threads, .current_map = system_map_index } };
 
-uint64_t thread_code( thread_context *t ) { return 0x42000000 | (t - threads); }
-thread_context *thread_from_code( uint64_t t ) { if (t == 0) return 0; if (0x42000000 != (t & 0xff000000)) BSOD( __COUNTER__); return &threads[t & 0xf]; }
+uint64_t thread_code( thread_context *t ) { if (t == 0) return 0; return 0x42000000 | (t - threads); }
+thread_context *thread_from_code( uint64_t t ) { if (t == 0) return 0; if (0x42000000 != (t & 0xff000000)) BSOD( __COUNTER__); return &threads[t & 0xff]; }
 
 #include "svc_handling.h"
 
-Core the_core = { .runnable = threads };
+Core cores[NUMBER_OF_CORES] = { { .core_number = 0 }, { .core_number = 1 }, { .core_number = 2 }, { .core_number = 3 } };
 
 static inline char id( thread_context *t )
 {
@@ -113,16 +184,16 @@ static inline char id( thread_context *t )
   return 'A' + (t-threads);
 }
 
-uint64_t locks[3] = { 0 };
+uint64_t __attribute__(( aligned( 4096 ) )) locks[3 * 64] = { 0 };
 
 void show()
 {
   printf( "Running: " );
-  thread_context *t = the_core.runnable;
+  thread_context *t = cores[0].runnable;
   do {
     printf( "%c ", id( t ) );
     t = t->next;
-  } while (t != the_core.runnable);
+  } while (t != cores[0].runnable);
 
   for (int i = 0; i < 3; i++) {
     t = (void*) thread_from_code( locks[i] & 0xffffffff );
@@ -148,54 +219,414 @@ void show()
 void Yield()
 {
   printf( "Yield: \t\t" );
-  the_core.runnable = the_core.runnable->next;
+  cores[0].runnable = cores[0].runnable->next;
   show();
 }
 
 void Lock( int n )
 {
   printf( "Lock: (%d)\t", n );
-  the_core.runnable->regs[17] = (uint64_t) &locks[n];
-  the_core.runnable = handle_svc_wait_for_lock( &the_core, the_core.runnable ).now;
+  cores[0].runnable->regs[17] = (uint64_t) &locks[n];
+  cores[0].runnable = handle_svc_wait_for_lock( &cores[0], cores[0].runnable ).now;
   show();
 }
 
 void Release( int n )
 {
   printf( "Release: (%d)\t", n );
-  the_core.runnable->regs[17] = (uint64_t) &locks[n];
-  the_core.runnable = handle_svc_release_lock( &the_core, the_core.runnable ).now;
+  cores[0].runnable->regs[17] = (uint64_t) &locks[n];
+  cores[0].runnable = handle_svc_release_lock( &cores[0], cores[0].runnable ).now;
   show();
 }
 
-int main()
+static void single_core_walk_through()
 {
-  threads[0].regs[18] = thread_code( &threads[0] );
-  for (int i = 1; i < 6; i++) {
+  cores[0].runnable = 0;
+  for (int i = 0; i < 6; i++) {
     threads[i].regs[18] = thread_code( &threads[i] );
-    insert_new_thread_after_old( &threads[i], &threads[i-1] );
+    insert_thread_at_tail( &cores[0].runnable, &threads[i] );
   }
 
   printf( "%p\n", locks );
 
   thread_context *owner = 0;
 
-  owner = the_core.runnable;
+  // A blocked thread lends its time to the owner, which runs next
+  owner = cores[0].runnable;
   Lock( 0 );
   Yield();
   Lock( 0 );
+  if (cores[0].runnable != owner) printf( "Owner not running\n" );
+  Yield();
   Lock( 0 );
-  the_core.runnable = owner;
+  cores[0].runnable = owner;
   Release( 0 );
-  owner = the_core.runnable;
+  owner = cores[0].runnable;
   Yield();
   Lock( 0 );
-  the_core.runnable = owner;
+  if (cores[0].runnable != owner) printf( "Owner not running\n" );
+  cores[0].runnable = owner;
   Release( 0 );
-  owner = the_core.runnable;
+  owner = cores[0].runnable;
   Release( 0 );
-  owner = the_core.runnable;
+  owner = cores[0].runnable;
   Release( 0 );
+}
+
+// Releasing one lock gives back only the priority lent by the threads waiting for it
+static void lent_priority_walk_through()
+{
+  thread_context *owner = cores[0].runnable;
+  thread_context *urgent = owner->next;
+  thread_context *less_urgent = urgent->next;
+
+  owner->priority = owner->base_priority = THREAD_PRIORITY_DEFAULT;
+  urgent->priority = urgent->base_priority = THREAD_PRIORITY_DEFAULT + 2;
+  less_urgent->priority = less_urgent->base_priority = THREAD_PRIORITY_DEFAULT + 1;
+
+  Lock( 1 );
+  Lock( 2 );
+  cores[0].runnable = urgent;
+  Lock( 1 );
+  cores[0].runnable = less_urgent;
+  Lock( 2 );
+  if (owner->priority != urgent->priority) printf( "Priority not lent\n" ), failures++;
+  cores[0].runnable = owner;
+  Release( 1 );
+  if (owner->priority != less_urgent->priority) printf( "Priority lent for lock 2 given back\n" ), failures++;
+  cores[0].runnable = owner;
+  Release( 2 );
+  if (owner->priority != owner->base_priority) printf( "Lent priority kept\n" ), failures++;
+  cores[0].runnable = urgent;
+  Release( 1 );
+  cores[0].runnable = less_urgent;
+  Release( 2 );
+
+  owner->priority = owner->base_priority = 0;
+  urgent->priority = urgent->base_priority = 0;
+  less_urgent->priority = less_urgent->base_priority = 0;
+}
+
+// Simulation
+
+static uint64_t random_state;
+
+static uint64_t random_number()
+{
+  // xorshift64, so that runs are repeatable
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+// The steps of CLAIM_LOCK, a critical section, and RELEASE_LOCK (see isambard_client.h),
+// or of claim_write_lock and release_write_lock, or claim_read_lock and release_read_lock
+// (see exclusive.h) when simulating reader-writer locks.
+enum step { IDLE, START, CLAIM_LDXR, CLAIM_STXR, CLAIM_SVC, CRITICAL, RELEASE_LDXR, RELEASE_STXR, RELEASE_SVC,
+            READ_LDXR, READ_STXR, READ_SVC, READ_CRITICAL, UNREAD_LDXR, UNREAD_STXR, UNREAD_SVC, FINISHED };
+
+static struct {
+  enum step step;
+  uint64_t lock;
+  uint64_t value;
+  uint32_t critical_steps;
+  uint32_t iterations;
+} program[NUMBER_OF_THREADS];
+
+static thread_context *in_critical_section[numberof( locks )];
+static uint32_t readers_in_critical_section[numberof( locks )];
+static uint32_t lock_stride;
+static uint32_t number_of_locks;
+static bool rwlocks;
+static uint32_t one_write_in; // Claims of a reader-writer lock
+
+static void adopt_incoming( Core *core )
+{
+  core->ipi_pending = false;
+  while (core->incoming != 0) {
+    thread_context *t = core->incoming;
+    core->incoming = t->next;
+    t->current_core = core->core_number;
+    insert_thread_at_tail( &core->runnable, t );
+  }
+}
+
+static void preempt( Core *core )
+{
+  // An exception return clears the local monitor
+  monitor[core->core_number].valid = false;
+  core->runnable = core->runnable->next;
+}
+
+static void kernel_entry( Core *core, thread_switch (*handler)( Core *core, thread_context *thread ) )
+{
+  thread_context *thread = core->runnable;
+  monitor[core->core_number].valid = false;
+  thread_switch result = handler( core, thread );
+  core->runnable = result.now;
+  for (int i = 0; i < NUMBER_OF_LOCK_LIST_SPINLOCKS; i++) {
+    if (!lock_is_free( lock_list_spinlocks[i] )) {
+      printf( "  kernel ticket lock %d left claimed\n", i );
+      failures++;
+      lock_list_spinlocks[i] = 0;
+    }
+  }
+}
+
+static void step_thread( Core *core, thread_context *t )
+{
+  int n = t - threads;
+  uint64_t x16;
+
+  if (t->current_core != core->core_number) {
+    printf( "  thread %c running on core %d, not %d\n", id( t ), core->core_number, t->current_core );
+    failures++;
+  }
+
+  switch (program[n].step) {
+  case IDLE:
+    preempt( core );
+    break;
+  case START:
+    program[n].lock = (uint64_t) &locks[lock_stride * (random_number() % number_of_locks)];
+    t->regs[17] = program[n].lock;
+    program[n].step = (rwlocks && random_number() % one_write_in != 0) ? READ_LDXR : CLAIM_LDXR;
+    break;
+  case CLAIM_LDXR:
+    x16 = LDXR( t->regs[17] );
+    program[n].step = (x16 == 0) ? CLAIM_STXR : CLAIM_SVC;
+    break;
+  case CLAIM_STXR:
+    program[n].step = STXR( t->regs[17], t->regs[18] ) ? CLAIM_LDXR : CRITICAL;
+    break;
+  case CLAIM_SVC:
+    program[n].step = CRITICAL; // When it returns
+    kernel_entry( core, rwlocks ? handle_svc_rwlock_write_wait : handle_svc_wait_for_lock );
+    break;
+  case CRITICAL:
+    {
+      int lock = ((uint64_t*) program[n].lock) - locks;
+      if (program[n].critical_steps == 0) {
+        if (in_critical_section[lock] != 0) {
+          printf( "  threads %c and %c both own lock %d\n", id( t ), id( in_critical_section[lock] ), lock );
+          failures++;
+        }
+        if (rwlocks && readers_in_critical_section[lock] != 0) {
+          printf( "  thread %c writing with %d readers, lock %d\n", id( t ), readers_in_critical_section[lock], lock );
+          failures++;
+        }
+        if ((locks[lock] & 0xffffffff) != thread_code( t )) {
+          printf( "  thread %c in critical section, lock value %" PRIx64 "\n", id( t ), locks[lock] );
+          failures++;
+        }
+        in_critical_section[lock] = t;
+      }
+      if (++program[n].critical_steps > random_number() % 4) {
+        in_critical_section[lock] = 0;
+        program[n].critical_steps = 0;
+        program[n].step = RELEASE_LDXR;
+      }
+    }
+    break;
+  case RELEASE_LDXR:
+    x16 = LDXR( t->regs[17] );
+    program[n].step = (x16 == t->regs[18]) ? RELEASE_STXR : RELEASE_SVC;
+    break;
+  case RELEASE_STXR:
+    program[n].step = STXR( t->regs[17], 0 ) ? RELEASE_SVC : FINISHED;
+    break;
+  case RELEASE_SVC:
+    program[n].step = FINISHED; // When it returns
+    kernel_entry( core, rwlocks ? handle_svc_rwlock_release : handle_svc_release_lock );
+    break;
+  case READ_LDXR:
+    x16 = LDXR( t->regs[17] );
+    program[n].value = x16 + RWLOCK_READER;
+    program[n].step = (0 != (x16 & (RWLOCK_WRITER_MASK | RWLOCK_WRITERS_BLOCKED | RWLOCK_READERS_BLOCKED))) ? READ_SVC : READ_STXR;
+    break;
+  case READ_STXR:
+    program[n].step = STXR( t->regs[17], program[n].value ) ? READ_LDXR : READ_CRITICAL;
+    break;
+  case READ_SVC:
+    program[n].step = READ_CRITICAL; // When it returns
+    kernel_entry( core, handle_svc_rwlock_read_wait );
+    break;
+  case READ_CRITICAL:
+    {
+      int lock = ((uint64_t*) program[n].lock) - locks;
+      if (program[n].critical_steps == 0) {
+        if (in_critical_section[lock] != 0) {
+          printf( "  thread %c reading while %c writes lock %d\n", id( t ), id( in_critical_section[lock] ), lock );
+          failures++;
+        }
+        if (0 != (locks[lock] & RWLOCK_WRITER_MASK) || 0 == (locks[lock] & RWLOCK_READERS_MASK)) {
+          printf( "  thread %c reading, lock value %" PRIx64 "\n", id( t ), locks[lock] );
+          failures++;
+        }
+        readers_in_critical_section[lock]++;
+      }
+      if (++program[n].critical_steps > random_number() % 4) {
+        readers_in_critical_section[lock]--;
+        program[n].critical_steps = 0;
+        program[n].step = UNREAD_LDXR;
+      }
+    }
+    break;
+  case UNREAD_LDXR:
+    x16 = LDXR( t->regs[17] );
+    program[n].value = x16 - RWLOCK_READER;
+    program[n].step = (0 == (program[n].value & RWLOCK_READERS_MASK) && 0 != (program[n].value & RWLOCK_WRITERS_BLOCKED)) ? UNREAD_SVC : UNREAD_STXR;
+    break;
+  case UNREAD_STXR:
+    program[n].step = STXR( t->regs[17], program[n].value ) ? UNREAD_LDXR : FINISHED;
+    break;
+  case UNREAD_SVC:
+    program[n].step = FINISHED; // When it returns
+    kernel_entry( core, handle_svc_rwlock_release );
+    break;
+  case FINISHED:
+    program[n].step = (--program[n].iterations == 0) ? IDLE : START;
+    break;
+  }
+}
+
+// Every thread must be runnable on exactly one core, incoming to exactly one core,
+// or blocked on exactly one lock.
+static void check_all_threads_accounted_for()
+{
+  int seen[NUMBER_OF_THREADS] = { 0 };
+
+  for (int c = 0; c < NUMBER_OF_CORES; c++) {
+    thread_context *t = cores[c].runnable;
+    do {
+      if (t->next->prev != t || t->prev->next != t || t->list != &cores[c].runnable) {
+        printf( "  runnable list of core %d corrupt at %c\n", c, id( t ) );
+        failures++;
+        return;
+      }
+      seen[t - threads]++;
+      t = t->next;
+    } while (t != cores[c].runnable);
+    for (t = cores[c].incoming; t != 0; t = t->next) {
+      seen[t - threads]++;
+    }
+  }
+  for (uint32_t l = 0; l < number_of_locks; l++) {
+    // Simple locks have one list, reader-writer locks two (readers and writers)
+    for (int list = 0; list < (rwlocks ? 2 : 1); list++) {
+      uint32_t code = rwlocks ? locks[l * lock_stride + 1] >> (32 * list) : locks[l * lock_stride] >> 32;
+      thread_context *first = thread_from_code( code );
+      thread_context *t = first;
+      if (t != 0) do {
+        if (t->next->prev != t || t->prev->next != t || t->regs[17] != (uint64_t) &locks[l * lock_stride]) {
+          printf( "  blocked list of lock %d corrupt at %c\n", l, id( t ) );
+          failures++;
+          return;
+        }
+        seen[t - threads]++;
+        t = t->next;
+      } while (t != first);
+    }
+  }
+  for (int i = 0; i < NUMBER_OF_THREADS; i++) {
+    if (seen[i] != 1) {
+      printf( "  thread %c found %d times\n", id( &threads[i] ), seen[i] );
+      failures++;
+    }
+  }
+}
+
+static void simulate( const char *name, bool reader_writer, uint32_t writes, uint32_t locks_used, uint32_t stride, uint32_t iterations, uint64_t seed )
+{
+  int failures_before = failures;
+  uint64_t steps = 0;
+
+  random_state = seed;
+  number_of_locks = locks_used;
+  lock_stride = stride;
+  rwlocks = reader_writer;
+  one_write_in = writes;
+  for (unsigned i = 0; i < numberof( locks ); i++) {
+    locks[i] = 0;
+    in_critical_section[i] = 0;
+    readers_in_critical_section[i] = 0;
+  }
+
+  for (int c = 0; c < NUMBER_OF_CORES; c++) {
+    cores[c].runnable = 0;
+    cores[c].incoming = 0;
+    cores[c].ipi_pending = false;
+    monitor[c].valid = false;
+  }
+
+  for (int i = 0; i < NUMBER_OF_THREADS; i++) {
+    thread_context *t = &threads[i];
+    t->regs[18] = thread_code( t );
+    t->current_core = i % NUMBER_OF_CORES;
+    // The first thread on each core is its idle thread
+    program[i].step = (i < NUMBER_OF_CORES) ? IDLE : START;
+    program[i].iterations = iterations;
+    program[i].critical_steps = 0;
+    insert_thread_at_tail( &cores[t->current_core].runnable, t );
+  }
+
+  bool finished = false;
+  while (!finished && failures == failures_before) {
+    sim_core = random_number() % NUMBER_OF_CORES;
+    Core *core = &cores[sim_core];
+
+    if (core->ipi_pending) {
+      adopt_incoming( core );
+    }
+    else if (random_number() % 16 == 0) {
+      preempt( core );
+    }
+    else {
+      step_thread( core, core->runnable );
+    }
+    steps++;
+
+    if (steps % 64 == 0) {
+      if (steps > 10000000) {
+        printf( "  threads stuck\n" );
+        failures++;
+      }
+      check_all_threads_accounted_for();
+      finished = true;
+      for (int i = NUMBER_OF_CORES; i < NUMBER_OF_THREADS; i++) {
+        if (program[i].step != IDLE) finished = false;
+      }
+    }
+  }
+
+  for (uint32_t l = 0; l < locks_used; l++) {
+    if (locks[l * stride] != 0 || (rwlocks && locks[l * stride + 1] != 0)) {
+      printf( "  lock %d left with value %" PRIx64 "\n", l, locks[l * stride] );
+      failures++;
+    }
+  }
+
+  printf( "%s, seed %" PRIx64 ": %s after %" PRIu64 " steps\n", name, seed, failures == failures_before ? "OK" : "FAILED", steps );
+}
+
+int main()
+{
+  single_core_walk_through();
+  lent_priority_walk_through();
+
+  static const uint64_t seeds[] = { 0x2545F4914F6CDD1Dull, 0x9E3779B97F4A7C15ull, 0x123456789ull, 0xdeadbeefcafef00dull };
+
+  for (unsigned i = 0; i < numberof( seeds ); i++) {
+    simulate( "One lock, four cores", false, 0, 1, 1, 200, seeds[i] );
+    simulate( "Three locks, four cores", false, 0, 3, 1, 200, seeds[i] );
+    // Locks 512 bytes apart share a kernel ticket lock
+    simulate( "Three locks sharing a ticket lock", false, 0, 3, 64, 200, seeds[i] );
+    simulate( "One reader-writer lock, four cores", true, 4, 1, 2, 200, seeds[i] );
+    simulate( "Three reader-writer locks, four cores", true, 4, 3, 2, 200, seeds[i] );
+    // Like the system driver's services_lock: lookups from every map, the odd registration
+    simulate( "Reader-writer lock, rare writers", true, 32, 1, 2, 200, seeds[i] );
+  }
 
-  return 0;
+  return failures == 0 ? 0 : 1;
 }
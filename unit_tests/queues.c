@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+// Host build of the ring queues, e.g.:
+//   gcc -O2 -pthread -I include unit_tests/queues.c -o queues && ./queues
+// Checks that every item pushed is popped exactly once, in order per producer, with
+// threads using the non-blocking and the waiting functions, then reports throughput.
+//
+// The exclusive monitor is imitated with a compare and swap against the value loaded,
+// and each thread's gate with a semaphore.
+
+#define BEING_TESTED
+
+static __thread uint32_t this_thread;
+static __thread uint64_t exclusive_value;
+
+static inline void queue_barrier()
+{
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+}
+
+static inline uint64_t load_exclusive( uint64_t volatile *mem )
+{
+  exclusive_value = __atomic_load_n( mem, __ATOMIC_SEQ_CST );
+  return exclusive_value;
+}
+
+static inline bool store_exclusive( uint64_t volatile *mem, uint64_t value )
+{
+  uint64_t expected = exclusive_value;
+  return __atomic_compare_exchange_n( mem, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+}
+
+static inline void clear_exclusive()
+{
+}
+
+#define MAX_THREADS 16
+static sem_t gates[MAX_THREADS + 1];
+static uint64_t volatile wakes = 0;
+
+static void wake_thread( uint32_t thread )
+{
+  __atomic_fetch_add( &wakes, 1, __ATOMIC_RELAXED );
+  sem_post( &gates[thread] );
+}
+
+static uint64_t wait_until_woken()
+{
+  sem_wait( &gates[this_thread] );
+  return 1;
+}
+
+static bool sleep_ms( uint64_t ms )
+{
+  usleep( ms * 1000 );
+  return false;
+}
+
+#include "queues.h"
+
+DEFINE_SPSC_QUEUE( small_spsc, uint64_t, 8 )
+DEFINE_SPSC_QUEUE( large_spsc, uint64_t, 1024 )
+DEFINE_MPMC_QUEUE( small_mpmc, uint64_t, 8 )
+DEFINE_MPMC_QUEUE( large_mpmc, uint64_t, 1024 )
+
+// Items are ( producer << 32 ) | ( sequence + 1 ); zero is never pushed.
+#define ITEM( producer, sequence ) (((uint64_t) (producer) << 32) | ((sequence) + 1))
+
+static int failures = 0;
+
+static void fail( char const *test, char const *message, uint64_t item )
+{
+  printf( "%s: %s (%#" PRIx64 ")\n", test, message, item );
+  failures++;
+}
+
+static double seconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+  char const *name;
+  void *queue;
+  bool (*try_push)( void *q, uint64_t item );
+  bool (*try_pop)( void *q, uint64_t *item );
+  void (*push)( void *q, uint64_t item );
+  uint64_t (*pop)( void *q );
+  int producers;
+  int consumers;
+  bool waiting;
+  uint64_t items;  // Per producer
+
+  uint64_t volatile popped;
+  uint64_t received[MAX_THREADS];       // Count per producer
+  uint64_t checksum[MAX_THREADS];
+} test;
+
+typedef struct {
+  test *t;
+  uint32_t thread;
+  int number;
+} thread_parameters;
+
+static void *producer( void *p )
+{
+  thread_parameters *params = p;
+  test *t = params->t;
+  this_thread = params->thread;
+
+  for (uint64_t i = 0; i < t->items; i++) {
+    uint64_t item = ITEM( params->number, i );
+    if (t->waiting) {
+      t->push( t->queue, item );
+    }
+    else {
+      while (!t->try_push( t->queue, item )) {
+        sched_yield();
+      }
+    }
+  }
+  return 0;
+}
+
+static void *consumer( void *p )
+{
+  thread_parameters *params = p;
+  test *t = params->t;
+  this_thread = params->thread;
+
+  uint64_t last[MAX_THREADS] = { 0 };
+  uint64_t received[MAX_THREADS] = { 0 };
+  uint64_t checksum[MAX_THREADS] = { 0 };
+  uint64_t total = t->items * t->producers;
+
+  for (;;) {
+    uint64_t item;
+    // Claim the right to pop one more item, so that waiting consumers all finish
+    uint64_t claimed = __atomic_fetch_add( &t->popped, 1, __ATOMIC_SEQ_CST );
+    if (claimed >= total) break;
+
+    if (t->waiting) {
+      item = t->pop( t->queue );
+    }
+    else {
+      while (!t->try_pop( t->queue, &item )) {
+        sched_yield();
+      }
+    }
+
+    uint32_t from = item >> 32;
+    uint64_t sequence = item & 0xffffffff;
+    if (item == 0 || from >= (uint32_t) t->producers) {
+      fail( t->name, "Corrupt item", item );
+      continue;
+    }
+    if (sequence <= last[from]) {
+      fail( t->name, "Out of order", item );
+    }
+    last[from] = sequence;
+    received[from]++;
+    checksum[from] += sequence;
+  }
+
+  for (int i = 0; i < t->producers; i++) {
+    __atomic_fetch_add( &t->received[i], received[i], __ATOMIC_SEQ_CST );
+    __atomic_fetch_add( &t->checksum[i], checksum[i], __ATOMIC_SEQ_CST );
+  }
+  return 0;
+}
+
+static void run( test *t )
+{
+  pthread_t threads[MAX_THREADS];
+  thread_parameters params[MAX_THREADS];
+  int n = 0;
+
+  t->popped = 0;
+  for (int i = 0; i < MAX_THREADS; i++) {
+    t->received[i] = 0;
+    t->checksum[i] = 0;
+  }
+
+  uint64_t wakes_before = wakes;
+  double start = seconds();
+
+  for (int i = 0; i < t->consumers; i++, n++) {
+    params[n] = (thread_parameters){ .t = t, .thread = n + 1, .number = i };
+    pthread_create( &threads[n], 0, consumer, &params[n] );
+  }
+  for (int i = 0; i < t->producers; i++, n++) {
+    params[n] = (thread_parameters){ .t = t, .thread = n + 1, .number = i };
+    pthread_create( &threads[n], 0, producer, &params[n] );
+  }
+  for (int i = 0; i < n; i++) {
+    pthread_join( threads[i], 0 );
+  }
+
+  double elapsed = seconds() - start;
+
+  for (int i = 0; i < t->producers; i++) {
+    if (t->received[i] != t->items) {
+      fail( t->name, "Items lost or duplicated", t->received[i] );
+    }
+    if (t->checksum[i] != t->items * (t->items + 1) / 2) {
+      fail( t->name, "Checksum mismatch", t->checksum[i] );
+    }
+  }
+
+  uint64_t total = t->items * t->producers;
+  uint64_t item;
+  if (t->try_pop( t->queue, &item )) {
+    fail( t->name, "Not empty at the end", item );
+  }
+
+  // Leave the gates closed for the next test
+  for (int i = 1; i <= MAX_THREADS; i++) {
+    while (0 == sem_trywait( &gates[i] )) {}
+  }
+
+  printf( "%-36s %d:%d %s %10.0f items/s, %8" PRIu64 " wakes\n",
+          t->name, t->producers, t->consumers, t->waiting ? "waiting" : "polling",
+          total / elapsed, wakes - wakes_before );
+}
+
+#define ADAPTERS( name ) \
+static bool name##_try_push_adapter( void *q, uint64_t item ) { return name##_try_push( q, item ); } \
+static bool name##_try_pop_adapter( void *q, uint64_t *item ) { return name##_try_pop( q, item ); } \
+static void name##_push_adapter( void *q, uint64_t item ) { name##_push( q, item ); } \
+static uint64_t name##_pop_adapter( void *q ) { return name##_pop( q ); } \
+static name##_queue name##_instance;
+
+ADAPTERS( small_spsc )
+ADAPTERS( large_spsc )
+ADAPTERS( small_mpmc )
+ADAPTERS( large_mpmc )
+
+#define TEST( queue_name, p, c, w, n ) \
+  { .name = #queue_name, .queue = &queue_name##_instance, \
+    .try_push = queue_name##_try_push_adapter, .try_pop = queue_name##_try_pop_adapter, \
+    .push = queue_name##_push_adapter, .pop = queue_name##_pop_adapter, \
+    .producers = p, .consumers = c, .waiting = w, .items = n }
+
+int main()
+{
+  for (int i = 0; i <= MAX_THREADS; i++) {
+    sem_init( &gates[i], 0, 0 );
+  }
+
+  static test tests[] = {
+    TEST( small_spsc, 1, 1, false, 1000000 ),
+    TEST( small_spsc, 1, 1, true, 200000 ),
+    TEST( large_spsc, 1, 1, false, 4000000 ),
+    TEST( large_spsc, 1, 1, true, 4000000 ),
+    TEST( small_mpmc, 1, 1, false, 1000000 ),
+    TEST( small_mpmc, 4, 4, false, 250000 ),
+    TEST( small_mpmc, 4, 4, true, 50000 ),
+    TEST( small_mpmc, 8, 2, true, 25000 ),
+    TEST( small_mpmc, 2, 8, true, 100000 ),
+    TEST( large_mpmc, 4, 4, false, 1000000 ),
+    TEST( large_mpmc, 4, 4, true, 1000000 ),
+  };
+
+  for (unsigned i = 0; i < sizeof( tests ) / sizeof( tests[0] ); i++) {
+    run( &tests[i] );
+  }
+
+  if (failures == 0) {
+    printf( "OK\n" );
+  }
+
+  return failures == 0 ? 0 : 1;
+}